@@ -0,0 +1,75 @@
+/*
+ * opencv_v4l2 - bayer.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Raw Bayer unpacking and demosaicing to BGR.
+
+#ifndef BAYER_HPP
+#define BAYER_HPP
+
+#include <stddef.h>
+
+#include <opencv2/opencv.hpp>
+
+#include <yuv_convert.hpp>
+
+class StripePool;
+
+/* Colours of the top-left 2x2 cell, as in the V4L2 format names. */
+enum bayer_order {
+    BAYER_RGGB = 0,
+    BAYER_BGGR,
+    BAYER_GRBG,
+    BAYER_GBRG
+};
+
+enum bayer_packing {
+    BAYER_RAW8 = 0,     /* a byte per sample */
+    BAYER_RAW10,        /* little-endian 16-bit words, 10 bits used */
+    BAYER_RAW12,        /* the same with 12 bits */
+    BAYER_RAW10P,       /* MIPI CSI-2: 4 samples in 5 bytes, 4 high bytes first */
+    BAYER_RAW12P        /* MIPI CSI-2: 2 samples in 3 bytes, 2 high bytes first */
+};
+
+enum bayer_demosaic {
+    BAYER_BILINEAR = 0,     /* cv::COLOR_Bayer*2BGR */
+    BAYER_EDGE_AWARE,       /* cv::COLOR_Bayer*2BGR_EA, sharper edges, ~2x the cost */
+    BAYER_SUPERPIXEL        /* each 2x2 cell to one pixel: half the size, no interpolation */
+};
+
+const char *bayer_demosaic_name(enum bayer_demosaic demosaic);
+
+/* Bytes of a row of 'width' samples (a multiple of 4 for BAYER_RAW10P, else of 2). */
+size_t bayer_row_bytes(enum bayer_packing packing, unsigned int width);
+/* Samples in a row of 'bytes' bytes; the inverse of bayer_row_bytes(). */
+unsigned int bayer_row_width(enum bayer_packing packing, size_t bytes);
+
+/*
+ * Unpacks a row of 'width' samples to their 8 most significant bits, which
+ * is all the BGR output keeps. Packed rows only need their high bytes
+ * picked out, 16-bit ones shifting down. Every kernel gives the same result.
+ */
+void bayer_unpack_row(const unsigned char *src, unsigned char *dst, unsigned int width,
+                      enum bayer_packing packing, enum yuv_isa isa = YUV_ISA_AUTO);
+
+/*
+ * Demosaics a raw frame to BGR: 'raw' is a view of its rows as stored,
+ * CV_16UC1 for BAYER_RAW10 / BAYER_RAW12 and CV_8UC1 bytes otherwise (see
+ * bayer_row_bytes()). 'dst' is 1/scale the size of the frame (scale 1, 2,
+ * 4 or 8). Previews (scale above 1) always bin superpixels: each output
+ * pixel averages the R, G and B samples of (scale / 2)^2 cells, so nothing
+ * is interpolated at full size. BAYER_SUPERPIXEL at scale 1 gives half the
+ * frame size.
+ *
+ * With 'pool', the frame is done in tiles of whole row pairs, each unpacked
+ * and demosaiced while it is in the cache of the thread working on it; two
+ * rows of overlap make the tiles join up exactly. Without, the frame is
+ * unpacked into 'scratch' and demosaiced by OpenCV on its own threads.
+ */
+void bayer_to_bgr(const cv::Mat &raw, cv::Mat &dst, enum bayer_order order,
+                  enum bayer_packing packing, enum bayer_demosaic demosaic, unsigned int scale,
+                  StripePool *pool, cv::Mat &scratch, enum yuv_isa isa = YUV_ISA_AUTO);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * opencv_v4l2 - buffer_pool.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Allocator for user-pointer capture buffers.
+
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <stddef.h>
+
+/*
+ * Options for pool_alloc(). Each one is best effort: when the system can't
+ * provide it the allocation still succeeds without it, see pool_block.
+ */
+enum pool_flags {
+    POOL_HUGEPAGES = 1 << 0,    /* hugetlbfs pages, else transparent hugepages */
+    POOL_PREFAULT  = 1 << 1,    /* fault every page in up front */
+    POOL_LOCK      = 1 << 2     /* mlock() the buffer */
+};
+
+enum pool_backing {
+    POOL_BACKING_HEAP = 0,      /* posix_memalign(), used when no flag is given */
+    POOL_BACKING_PAGES,         /* anonymous mapping of base pages */
+    POOL_BACKING_THP,           /* anonymous mapping advised MADV_HUGEPAGE */
+    POOL_BACKING_HUGETLB        /* MAP_HUGETLB mapping */
+};
+
+struct pool_block {
+    void *start;
+    size_t map_length;          /* size of the mapping, 0 for heap memory */
+    enum pool_backing backing;
+    bool locked;
+    int node;                   /* NUMA node the pages were bound to, or -1 */
+};
+
+/*
+ * Allocates 'size' bytes, page aligned, with the given pool_flags, preferably
+ * on the given NUMA node (-1 for the node of the first thread touching it).
+ * Returns -1 only when no memory could be obtained at all.
+ */
+int pool_alloc(struct pool_block *blk, size_t size, unsigned int flags,
+               int numa_node = -1);
+void pool_free(void *start, size_t map_length);
+const char *pool_backing_name(enum pool_backing backing);
+
+#endif
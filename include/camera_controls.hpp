@@ -0,0 +1,97 @@
+/*
+ * opencv_v4l2 - camera_controls.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Control values and the update queue used by CamV4L2's control API.
+
+#ifndef CAMERA_CONTROLS_HPP
+#define CAMERA_CONTROLS_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+/*
+ * A control and its value. 64-bit controls use the whole value, all others
+ * its lower 32 bits.
+ */
+struct ControlValue {
+    __u32 id;
+    int64_t value;
+};
+
+/*
+ * Queue of control batches, filled by any number of threads and drained by
+ * the capture thread.
+ *
+ * push() is a single CAS loop on the list head. take_all() swaps the whole
+ * list out at once, so nodes are never popped one at a time and there is no
+ * ABA problem. Neither side takes a lock or waits for the other.
+ */
+class ControlUpdateQueue {
+    private:
+        struct Node {
+            std::vector<ControlValue> values;
+            Node *next;
+        };
+        std::atomic<Node*> head;
+
+    public:
+        ControlUpdateQueue() : head(nullptr) {}
+
+        ~ControlUpdateQueue() {
+            std::vector<ControlValue> dropped;
+
+            take_all(dropped);
+        }
+
+        void push(const std::vector<ControlValue> &values) {
+            Node *node = new Node;
+
+            node->values = values;
+            node->next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(node->next, node,
+                        std::memory_order_release, std::memory_order_relaxed))
+                ;
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_acquire) == nullptr;
+        }
+
+        /*
+         * Appends every queued update to 'out', oldest first. Only one thread
+         * may call this at a time. Returns false if nothing was queued.
+         */
+        bool take_all(std::vector<ControlValue> &out) {
+            Node *node = head.exchange(nullptr, std::memory_order_acquire);
+            Node *oldest = nullptr;
+
+            if (!node)
+                return false;
+
+            /* The list is newest first; reverse it. */
+            while (node) {
+                Node *next = node->next;
+
+                node->next = oldest;
+                oldest = node;
+                node = next;
+            }
+
+            while (oldest) {
+                Node *next = oldest->next;
+
+                out.insert(out.end(), oldest->values.begin(), oldest->values.end());
+                delete oldest;
+                oldest = next;
+            }
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * opencv_v4l2 - camera_reactor.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Header file for the epoll based multi-camera event loop.
+
+#ifndef CAMERA_REACTOR_HPP
+#define CAMERA_REACTOR_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <v4l2_util.hpp>
+
+/*
+ * Services any number of cameras from a single polling thread.
+ *
+ * The fd of every camera is registered in one epoll set. Whenever a camera
+ * has a filled buffer, the polling thread dequeues it and hands the camera
+ * to a pool of worker threads, which run CamV4L2::process_frame() (convert,
+ * save and release). Each camera is registered with EPOLLONESHOT and is only
+ * re-armed once its frame has been released, so a camera never has more than
+ * one frame in flight and frames of one camera are processed in order.
+ *
+ * Cameras must be initialised (helper_init_cam) before being added and must
+ * not be driven by start_thread() at the same time.
+ */
+class CameraReactor {
+    private:
+        int epfd = -1;
+        int wake_fd = -1;
+        std::vector<CamV4L2*> cams;
+        std::thread poller;
+        std::vector<std::thread> workers;
+        unsigned int n_workers;
+
+        std::mutex lock;
+        std::condition_variable cond;
+        std::deque<CamV4L2*> ready;
+        bool quit_workers = false;	/* protected by lock */
+        std::atomic<bool> running;
+
+        int arm(CamV4L2 *cam, int op);
+        void poll_loop();
+        void worker_loop();
+
+    public:
+        /*
+         * n_workers = 0 uses one worker per online CPU.
+         */
+        explicit CameraReactor(unsigned int n_workers = 0);
+        ~CameraReactor();
+
+        int add_camera(CamV4L2 *cam);
+        int start();
+        void stop();
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * opencv_v4l2 - capture_stats.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Frame drop counters and latency histograms for CamV4L2.
+
+#ifndef CAPTURE_STATS_HPP
+#define CAPTURE_STATS_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+
+/*
+ * Stages of a frame's life that are timed. All times use CLOCK_MONOTONIC.
+ *
+ * LAT_CAPTURE_TO_DQBUF starts at the driver timestamp and is only recorded
+ * for buffers flagged V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC. With start-of-exposure
+ * (SOE) timestamps it includes exposure and readout time.
+ */
+enum latency_stage {
+    LAT_CAPTURE_TO_DQBUF = 0,
+    LAT_DQBUF_TO_CONVERTED,
+    LAT_CONVERTED_TO_RELEASE,
+    LAT_STAGES
+};
+
+/*
+ * Histogram with power-of-two microsecond buckets: bucket 0 counts values
+ * below 1 us, bucket i counts [2^(i-1), 2^i) us and the last bucket also
+ * counts everything above.
+ */
+struct LatencyHistogram {
+    static const unsigned int BUCKETS = 20;
+
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[BUCKETS];
+
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        count = sum_us = max_us = 0;
+        memset(buckets, 0, sizeof(buckets));
+    }
+
+    void add(uint64_t us) {
+        unsigned int bucket = 0;
+
+        while (bucket < BUCKETS - 1 && (us >> bucket) != 0)
+            bucket++;
+        buckets[bucket]++;
+        count++;
+        sum_us += us;
+        if (us > max_us)
+            max_us = us;
+    }
+
+    /* Upper bound of the bucket holding the given percentile (0-100). */
+    uint64_t percentile(double p) const {
+        uint64_t seen = 0, target;
+
+        if (count == 0)
+            return 0;
+        target = (uint64_t) (count * p / 100.0 + 0.5);
+        if (target < 1)
+            target = 1;
+        for (unsigned int i = 0; i < BUCKETS - 1; i++) {
+            seen += buckets[i];
+            if (seen >= target)
+                return (uint64_t) 1 << i;
+        }
+        return max_us;
+    }
+
+    uint64_t mean_us() const {
+        return count ? sum_us / count : 0;
+    }
+};
+
+struct CaptureStats {
+    uint64_t frames;        /* frames dequeued */
+    uint64_t dropped;       /* sequence gaps between dequeued frames */
+    uint64_t ts_unusable;   /* frames without a monotonic timestamp */
+    uint64_t ts_soe;        /* timestamps taken at start of exposure */
+    uint64_t ts_eof;        /* timestamps taken at end of frame */
+    uint64_t skipped;       /* passed over in latest-frame mode */
+    uint64_t starved;       /* times the driver ran out of queued buffers */
+    uint64_t starved_us;    /* total time spent without a queued buffer */
+    unsigned int held_max;  /* most frames held by the application at once */
+    LatencyHistogram latency[LAT_STAGES];
+    LatencyHistogram copy_out;  /* copy-out mode, see CamV4L2::set_copy_out */
+
+    CaptureStats() { reset(); }
+
+    void reset() {
+        frames = dropped = ts_unusable = ts_soe = ts_eof = skipped = 0;
+        starved = starved_us = 0;
+        held_max = 0;
+        for (unsigned int i = 0; i < LAT_STAGES; i++)
+            latency[i].reset();
+        copy_out.reset();
+    }
+
+    static void print_histogram(std::ostream &os, const char *name,
+                                const LatencyHistogram &h) {
+        if (h.count == 0)
+            return;
+        os << "    " << name << ": mean " << h.mean_us()
+            << " us, p50 < " << h.percentile(50)
+            << " us, p99 < " << h.percentile(99)
+            << " us, max " << h.max_us << " us" << std::endl;
+    }
+
+    void print(std::ostream &os, int camidx) const {
+        static const char *names[LAT_STAGES] = {
+            "capture -> dqbuf", "dqbuf -> converted", "converted -> release"
+        };
+
+        os << "cam #" << camidx << " - frames = " << frames
+            << ", dropped = " << dropped;
+        if (skipped)
+            os << ", skipped for newer = " << skipped;
+        if (ts_unusable)
+            os << ", without monotonic timestamp = " << ts_unusable;
+        if (ts_soe)
+            os << " (start-of-exposure timestamps)";
+        os << std::endl;
+        if (starved)
+            os << "    queue starved " << starved << " time(s) for "
+                << starved_us / 1000 << " ms, up to " << held_max
+                << " frame(s) held" << std::endl;
+
+        for (unsigned int i = 0; i < LAT_STAGES; i++)
+            print_histogram(os, names[i], latency[i]);
+        print_histogram(os, "copy-out", copy_out);
+    }
+};
+
+/*
+ * Time taken by each step of bringing a camera up, in milliseconds: open(),
+ * capability query and format negotiation, buffer allocation, queueing the
+ * buffers and STREAMON, and from STREAMON to the first frame dequeued (0
+ * until one was).
+ */
+struct StartupTiming {
+    double open_ms;
+    double format_ms;
+    double alloc_ms;
+    double streamon_ms;
+    double first_frame_ms;
+
+    StartupTiming() { reset(); }
+
+    void reset() {
+        open_ms = format_ms = alloc_ms = streamon_ms = first_frame_ms = 0;
+    }
+
+    double total_ms() const {
+        return open_ms + format_ms + alloc_ms + streamon_ms + first_frame_ms;
+    }
+
+    void print(std::ostream &os, int camidx) const {
+        os << "cam #" << camidx << " - startup " << total_ms() << " ms: open "
+            << open_ms << ", format " << format_ms << ", alloc " << alloc_ms
+            << ", streamon " << streamon_ms << ", first frame " << first_frame_ms
+            << std::endl;
+    }
+};
+
+#endif
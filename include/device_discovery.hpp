@@ -0,0 +1,91 @@
+/*
+ * opencv_v4l2 - device_discovery.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Discovery of V4L2 capture nodes and an on-disk cache of the modes they offer.
+
+#ifndef DEVICE_DISCOVERY_HPP
+#define DEVICE_DISCOVERY_HPP
+
+#include <linux/videodev2.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <v4l2_util.hpp>
+
+/*
+ * A video capture node and what identifies the camera behind it. Device
+ * numbers change with probe order, so cameras are matched by serial number
+ * (USB cameras that have one) or bus_info (the port they are plugged into).
+ */
+struct VideoDevice {
+    std::string path;           /* /dev/videoN */
+    std::string driver;
+    std::string card;
+    std::string bus_info;
+    std::string serial;         /* USB serial number, empty if none */
+    std::string firmware;       /* USB bcdDevice, empty if unknown */
+    __u32 version = 0;          /* driver version, KERNEL_VERSION() style */
+    unsigned int caps = 0;      /* capabilities of this node */
+
+    /* The serial number if there is one, otherwise bus_info. */
+    const std::string &id() const {
+        return serial.empty() ? bus_info : serial;
+    }
+};
+
+/*
+ * Fills 'dev' for the node opened as 'fd' (VIDIOC_QUERYCAP and sysfs). Returns
+ * ERR if it is no video capture node with streaming I/O, e.g. the metadata
+ * node UVC cameras also register.
+ */
+int describe_device(int fd, const char *path, VideoDevice *dev);
+
+/* Same as describe_device() for a node that isn't open yet. */
+int query_device(const char *path, VideoDevice *dev);
+
+/* All capture nodes in /dev, ordered by bus_info and then device number. */
+int discover_devices(std::vector<VideoDevice> &devices);
+
+/*
+ * Index of the device whose serial number, bus_info or path is 'name', or -1.
+ */
+int match_device(const std::vector<VideoDevice> &devices, const std::string &name);
+
+/*
+ * Modes of each camera model and firmware, kept in a text file so that warm
+ * starts don't repeat the VIDIOC_ENUM_FMT / ENUM_FRAMESIZES /
+ * ENUM_FRAMEINTERVALS calls (see CamV4L2::set_mode_cache). Entries are keyed
+ * by driver, driver version, card, firmware and id(), so a driver or firmware
+ * update probes the modes again. Safe to share between cameras being brought
+ * up in parallel.
+ */
+class ModeCache {
+    private:
+        std::string path;
+        std::map<std::string, std::vector<CameraMode> > entries;
+        bool dirty = false;
+        mutable std::mutex lock;
+
+        static std::string key(const VideoDevice &dev);
+
+    public:
+        explicit ModeCache(const std::string &path_) : path(path_) {}
+
+        /* A missing file is an empty cache; returns ERR on a malformed one. */
+        int load();
+        /* Writes the file if anything was stored since it was loaded. */
+        int save();
+
+        bool lookup(const VideoDevice &dev, std::vector<CameraMode> &modes) const;
+        void store(const VideoDevice &dev, const std::vector<CameraMode> &modes);
+
+        /* $XDG_CACHE_HOME/opencv_v4l2_modes, ~/.cache/... or /tmp/... */
+        static std::string default_path();
+};
+
+#endif
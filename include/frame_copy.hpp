@@ -0,0 +1,27 @@
+/*
+ * opencv_v4l2 - frame_copy.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Copying frames out of capture buffers.
+
+#ifndef FRAME_COPY_HPP
+#define FRAME_COPY_HPP
+
+#include <stddef.h>
+
+/*
+ * Copies with non-temporal (streaming) stores where the CPU has them (SSE2),
+ * so a frame that is only read later by the conversion doesn't evict the
+ * working set from the cache on the way. Plain memcpy() elsewhere.
+ */
+void stream_copy(void *dst, const void *src, size_t n);
+
+/*
+ * stream_copy() split into stripes run on OpenCV's worker threads for
+ * large frames, as one core can't saturate memory bandwidth alone.
+ */
+void copy_frame(void *dst, const void *src, size_t n);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * opencv_v4l2 - frame_ring.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Bounded single-producer / single-consumer ring handing frames between threads.
+
+#ifndef FRAME_RING_HPP
+#define FRAME_RING_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+struct FrameSlot {
+    cv::Mat frame;
+    std::vector<cv::Mat> planes;    /* colour planes, see CamV4L2::get_frame_planes */
+    uint64_t dequeue_us = 0;        /* CLOCK_MONOTONIC time the frame was dequeued */
+
+    void clear() {
+        frame.release();
+        planes.clear();
+    }
+};
+
+/*
+ * Queue of slot indices that never holds more than 'size' entries: every
+ * index is in at most one queue at a time. Entries are pushed by one thread;
+ * pop() may race between two threads (the consumer and, for eviction, the
+ * producer) and exactly one of them gets each entry.
+ */
+class SlotIndexQueue {
+    private:
+        std::unique_ptr<std::atomic<unsigned int>[]> entries;
+        unsigned int size;
+        std::atomic<uint64_t> head;
+        std::atomic<uint64_t> tail;
+
+    public:
+        explicit SlotIndexQueue(unsigned int size_)
+            : entries(new std::atomic<unsigned int>[size_]), size(size_), head(0), tail(0) {}
+
+        void push(unsigned int idx) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+
+            entries[h % size].store(idx, std::memory_order_relaxed);
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        bool pop(unsigned int *idx) {
+            uint64_t t = tail.load(std::memory_order_acquire);
+
+            for (;;) {
+                if (t == head.load(std::memory_order_acquire))
+                    return false;
+                /*
+                 * The entry can't be rewritten before the tail moves on,
+                 * and then the exchange below fails and re-reads it.
+                 */
+                *idx = entries[t % size].load(std::memory_order_relaxed);
+                if (tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel,
+                                               std::memory_order_acquire))
+                    return true;
+            }
+        }
+
+        bool empty() const {
+            return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+        }
+
+        /* Exact for the pushing thread, which alone moves the head. */
+        unsigned int count() const {
+            uint64_t t = tail.load(std::memory_order_acquire);
+
+            return head.load(std::memory_order_acquire) - t;
+        }
+};
+
+/*
+ * Hands frames from a capture thread to a processing thread. Both ends are
+ * lock-free while there is something to do; a mutex and condition variable
+ * are only used to sleep on an empty ring (consumer) or, with RING_BLOCK, a
+ * full one (producer).
+ *
+ * Frames are held in capacity + 2 slots: up to 'capacity' waiting, one being
+ * written and one being processed. Once 'capacity' frames wait, whether or
+ * not the consumer holds one, RING_OVERWRITE drops the oldest of them so the
+ * newest always gets through, while RING_BLOCK makes the producer wait.
+ *
+ * Producer: begin_write(), fill the slot, publish(); close() when done.
+ * Consumer: acquire(), process the slot, release(). A slot's frame is
+ * cleared when it is released or dropped, which gives zero-copy frames from
+ * CamV4L2::acquire_frame() back to the driver.
+ */
+class FrameRing {
+    public:
+        enum full_policy {
+            RING_OVERWRITE,
+            RING_BLOCK
+        };
+
+    private:
+        std::vector<FrameSlot> slots;
+        SlotIndexQueue ready;       /* published, oldest first */
+        SlotIndexQueue free_slots;  /* released by the consumer */
+        full_policy policy;
+        unsigned int capacity;
+        unsigned int writing = 0;   /* producer only */
+        bool have_writing = false;  /* producer only */
+        unsigned int reading = 0;   /* consumer only */
+        bool have_reading = false;  /* consumer only */
+        std::atomic<uint64_t> n_overwritten;
+        std::atomic<bool> closed;
+
+        std::mutex wait_lock;
+        std::condition_variable wait_cond;
+        std::atomic<int> sleepers;
+
+        void wake() {
+            /* Pairs with the fence in sleep_until(), so no wakeup is lost. */
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleepers.load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> guard(wait_lock);
+                wait_cond.notify_all();
+            }
+        }
+
+        /* Sleeps until 'ready_to_go' holds, for up to timeout_ms. */
+        template <typename Pred>
+        bool sleep_until(Pred ready_to_go, int timeout_ms) {
+            std::unique_lock<std::mutex> guard(wait_lock);
+            bool ok;
+
+            sleepers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            ok = wait_cond.wait_for(guard, std::chrono::milliseconds(timeout_ms), ready_to_go);
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+            return ok;
+        }
+
+    public:
+        /* 'capacity_' must be at least 1. */
+        FrameRing(unsigned int capacity_, full_policy policy_)
+            : slots(capacity_ + 2), ready(capacity_ + 2), free_slots(capacity_ + 2),
+              policy(policy_), capacity(capacity_), n_overwritten(0), closed(false),
+              sleepers(0) {
+            for (unsigned int i = 0; i < slots.size(); i++)
+                free_slots.push(i);
+        }
+
+        /*
+         * Slot for the next frame, or NULL once the ring is closed (or, with
+         * RING_BLOCK, after waiting timeout_ms for the consumer).
+         */
+        FrameSlot *begin_write(int timeout_ms = 2000) {
+            if (have_writing)
+                return &slots[writing];
+
+            while (!closed.load(std::memory_order_acquire)) {
+                /*
+                 * A free slot alone is no room: there is one more than
+                 * 'capacity' needs while the consumer is between frames.
+                 */
+                if (ready.count() < capacity && free_slots.pop(&writing)) {
+                    have_writing = true;
+                    return &slots[writing];
+                }
+                if (RING_OVERWRITE == policy) {
+                    /* Take back the oldest frame the consumer hasn't picked up. */
+                    if (ready.pop(&writing)) {
+                        slots[writing].clear();
+                        n_overwritten++;
+                        have_writing = true;
+                        return &slots[writing];
+                    }
+                    continue;
+                }
+                if (!sleep_until([this] {
+                                     return (ready.count() < capacity && !free_slots.empty()) ||
+                                            closed.load();
+                                 }, timeout_ms))
+                    return NULL;
+            }
+            return NULL;
+        }
+
+        void publish() {
+            if (!have_writing)
+                return;
+            have_writing = false;
+            ready.push(writing);
+            wake();
+        }
+
+        /* No more frames; acquire() returns NULL once the ring is drained. */
+        void close() {
+            closed.store(true, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> guard(wait_lock);
+                wait_cond.notify_all();
+            }
+        }
+
+        /*
+         * Oldest published frame, waiting up to timeout_ms for one. NULL on
+         * timeout or once the ring is closed and empty. The previous slot
+         * must have been released.
+         */
+        FrameSlot *acquire(int timeout_ms = 2000) {
+            if (have_reading)
+                return NULL;
+
+            for (;;) {
+                if (ready.pop(&reading)) {
+                    have_reading = true;
+                    /* Taking a frame makes room for a blocked producer. */
+                    if (RING_BLOCK == policy)
+                        wake();
+                    return &slots[reading];
+                }
+                if (closed.load(std::memory_order_acquire))
+                    return NULL;
+                if (!sleep_until([this] { return !ready.empty() || closed.load(); },
+                                 timeout_ms))
+                    return NULL;
+            }
+        }
+
+        void release() {
+            if (!have_reading)
+                return;
+            slots[reading].clear();
+            have_reading = false;
+            free_slots.push(reading);
+            if (RING_BLOCK == policy)
+                wake();
+        }
+
+        bool is_closed() const {
+            return closed.load(std::memory_order_acquire);
+        }
+
+        /* Frames dropped by RING_OVERWRITE. */
+        uint64_t overwritten() const {
+            return n_overwritten.load(std::memory_order_relaxed);
+        }
+
+        unsigned int size() const {
+            return capacity;
+        }
+};
+
+#endif
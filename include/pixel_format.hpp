@@ -0,0 +1,235 @@
+/*
+ * opencv_v4l2 - pixel_format.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Compile-time traits of the single-planar pixel formats CamV4L2 streams.
+
+#ifndef PIXEL_FORMAT_HPP
+#define PIXEL_FORMAT_HPP
+
+#include <stddef.h>
+#include <vector>
+#include <linux/videodev2.h>
+
+#include <opencv2/opencv.hpp>
+
+#include <bayer.hpp>
+
+class StripePool;
+
+/* How to_bgr() converts a frame. */
+struct ConvertParams {
+    unsigned int scale = 1;         /* 1, 2, 4 or 8: a box-filtered 1/scale preview */
+    StripePool *pool = NULL;        /* converts in row stripes on it when set */
+    enum bayer_demosaic demosaic = BAYER_BILINEAR;  /* for raw Bayer formats */
+};
+
+/*
+ * Everything that depends on the pixel format of a frame:
+ *
+ *   fourcc, name()           V4L2 code and the name used on the command line
+ *   min_bytesperline(width)  line pitch of the first plane without padding
+ *   min_sizeimage(bpl, h)    smallest buffer holding a frame with pitch bpl
+ *   views(...)               cv::Mat headers on the planes of a frame, with
+ *                            the pitch the driver reported (not width * bpp)
+ *   to_bgr(...)              the conversion kernel of the format
+ *
+ * Only the formats specialised below exist; asking for another one fails
+ * to compile rather than at runtime.
+ */
+template <__u32 FOURCC> struct PixelFormatTraits;
+
+/* One plane of TYPE elements, BPP bytes each: YUYV, UYVY, GREY, Y16. */
+template <int TYPE, unsigned int BPP>
+struct PackedFormat {
+    static const unsigned int n_planes = 1;
+
+    static size_t min_bytesperline(unsigned int width) {
+        return (size_t) width * BPP;
+    }
+    static size_t min_sizeimage(size_t bytesperline, unsigned int height) {
+        return bytesperline * height;
+    }
+    static int views(unsigned char *data, size_t length, unsigned int width,
+                     unsigned int height, size_t bytesperline, std::vector<cv::Mat> &planes) {
+        planes.clear();
+        if (bytesperline < min_bytesperline(width) ||
+            min_sizeimage(bytesperline, height) > length)
+            return -1;
+        planes.push_back(cv::Mat(height, width, TYPE, data, bytesperline));
+        return 0;
+    }
+};
+
+/*
+ * A luma plane followed by a plane of interleaved Cb/Cr at half the width
+ * and 1/V_DIV the height, both with the same pitch: NV12 (2), NV16 (1).
+ */
+template <unsigned int V_DIV>
+struct SemiPlanarFormat {
+    static const unsigned int n_planes = 2;
+
+    static size_t min_bytesperline(unsigned int width) {
+        return width;
+    }
+    static size_t min_sizeimage(size_t bytesperline, unsigned int height) {
+        return bytesperline * (height + height / V_DIV);
+    }
+    static int views(unsigned char *data, size_t length, unsigned int width,
+                     unsigned int height, size_t bytesperline, std::vector<cv::Mat> &planes) {
+        planes.clear();
+        if (width % 2 || height % V_DIV || bytesperline < min_bytesperline(width) ||
+            min_sizeimage(bytesperline, height) > length)
+            return -1;
+        planes.push_back(cv::Mat(height, width, CV_8UC1, data, bytesperline));
+        planes.push_back(cv::Mat(height / V_DIV, width / 2, CV_8UC2,
+                                 data + bytesperline * height, bytesperline));
+        return 0;
+    }
+};
+
+/*
+ * Raw Bayer in the CFA order ORDER. The plane is CV_16UC1 for the 16-bit
+ * packings and a byte view of the rows as stored for the others, MIPI
+ * packed ones included; see bayer_to_bgr().
+ */
+template <enum bayer_order ORDER, enum bayer_packing PACKING>
+struct BayerFormat {
+    static const unsigned int n_planes = 1;
+
+    static size_t min_bytesperline(unsigned int width) {
+        return bayer_row_bytes(PACKING, width);
+    }
+    static size_t min_sizeimage(size_t bytesperline, unsigned int height) {
+        return bytesperline * height;
+    }
+    static int views(unsigned char *data, size_t length, unsigned int width,
+                     unsigned int height, size_t bytesperline, std::vector<cv::Mat> &planes) {
+        bool words = BAYER_RAW10 == PACKING || BAYER_RAW12 == PACKING;
+
+        planes.clear();
+        if (width % (BAYER_RAW10P == PACKING ? 4 : 2) || height % 2 ||
+            bytesperline < min_bytesperline(width) ||
+            min_sizeimage(bytesperline, height) > length)
+            return -1;
+        planes.push_back(cv::Mat(height, words ? width : min_bytesperline(width),
+                                 words ? CV_16UC1 : CV_8UC1, data, bytesperline));
+        return 0;
+    }
+    static void to_bgr(const std::vector<cv::Mat> &planes, cv::Mat &bgr,
+                       const ConvertParams &params, cv::Mat &scratch) {
+        bayer_to_bgr(planes[0], bgr, ORDER, PACKING, params.demosaic, params.scale,
+                     params.pool, scratch);
+    }
+};
+
+/*
+ * to_bgr() converts the planes from views() into 'bgr' as 'params' asks;
+ * 'scratch' holds intermediate frames between calls.
+ */
+#define PIXEL_FORMAT_TO_BGR \
+    static void to_bgr(const std::vector<cv::Mat> &planes, cv::Mat &bgr, \
+                       const ConvertParams &params, cv::Mat &scratch)
+
+template <> struct PixelFormatTraits<V4L2_PIX_FMT_UYVY> : PackedFormat<CV_8UC2, 2> {
+    static const __u32 fourcc = V4L2_PIX_FMT_UYVY;
+    static const char *name() { return "uyvy"; }
+    PIXEL_FORMAT_TO_BGR;
+};
+
+template <> struct PixelFormatTraits<V4L2_PIX_FMT_YUYV> : PackedFormat<CV_8UC2, 2> {
+    static const __u32 fourcc = V4L2_PIX_FMT_YUYV;
+    static const char *name() { return "yuyv"; }
+    PIXEL_FORMAT_TO_BGR;
+};
+
+template <> struct PixelFormatTraits<V4L2_PIX_FMT_NV12> : SemiPlanarFormat<2> {
+    static const __u32 fourcc = V4L2_PIX_FMT_NV12;
+    static const char *name() { return "nv12"; }
+    PIXEL_FORMAT_TO_BGR;
+};
+
+template <> struct PixelFormatTraits<V4L2_PIX_FMT_NV16> : SemiPlanarFormat<1> {
+    static const __u32 fourcc = V4L2_PIX_FMT_NV16;
+    static const char *name() { return "nv16"; }
+    PIXEL_FORMAT_TO_BGR;
+};
+
+template <> struct PixelFormatTraits<V4L2_PIX_FMT_GREY> : PackedFormat<CV_8UC1, 1> {
+    static const __u32 fourcc = V4L2_PIX_FMT_GREY;
+    static const char *name() { return "grey"; }
+    PIXEL_FORMAT_TO_BGR;
+};
+
+/* Little-endian 16-bit luma; the preview shows its upper 8 bits. */
+template <> struct PixelFormatTraits<V4L2_PIX_FMT_Y16> : PackedFormat<CV_16UC1, 2> {
+    static const __u32 fourcc = V4L2_PIX_FMT_Y16;
+    static const char *name() { return "y16"; }
+    PIXEL_FORMAT_TO_BGR;
+};
+
+#undef PIXEL_FORMAT_TO_BGR
+
+#define BAYER_TRAITS(fourcc_, name_, order, packing) \
+    template <> struct PixelFormatTraits<fourcc_> : BayerFormat<order, packing> { \
+        static const __u32 fourcc = fourcc_; \
+        static const char *name() { return name_; } \
+    }
+
+BAYER_TRAITS(V4L2_PIX_FMT_SRGGB8,   "rggb8",   BAYER_RGGB, BAYER_RAW8);
+BAYER_TRAITS(V4L2_PIX_FMT_SBGGR8,   "bggr8",   BAYER_BGGR, BAYER_RAW8);
+BAYER_TRAITS(V4L2_PIX_FMT_SGRBG8,   "grbg8",   BAYER_GRBG, BAYER_RAW8);
+BAYER_TRAITS(V4L2_PIX_FMT_SGBRG8,   "gbrg8",   BAYER_GBRG, BAYER_RAW8);
+BAYER_TRAITS(V4L2_PIX_FMT_SRGGB10,  "rggb10",  BAYER_RGGB, BAYER_RAW10);
+BAYER_TRAITS(V4L2_PIX_FMT_SBGGR10,  "bggr10",  BAYER_BGGR, BAYER_RAW10);
+BAYER_TRAITS(V4L2_PIX_FMT_SGRBG10,  "grbg10",  BAYER_GRBG, BAYER_RAW10);
+BAYER_TRAITS(V4L2_PIX_FMT_SGBRG10,  "gbrg10",  BAYER_GBRG, BAYER_RAW10);
+BAYER_TRAITS(V4L2_PIX_FMT_SRGGB12,  "rggb12",  BAYER_RGGB, BAYER_RAW12);
+BAYER_TRAITS(V4L2_PIX_FMT_SBGGR12,  "bggr12",  BAYER_BGGR, BAYER_RAW12);
+BAYER_TRAITS(V4L2_PIX_FMT_SGRBG12,  "grbg12",  BAYER_GRBG, BAYER_RAW12);
+BAYER_TRAITS(V4L2_PIX_FMT_SGBRG12,  "gbrg12",  BAYER_GBRG, BAYER_RAW12);
+BAYER_TRAITS(V4L2_PIX_FMT_SRGGB10P, "rggb10p", BAYER_RGGB, BAYER_RAW10P);
+BAYER_TRAITS(V4L2_PIX_FMT_SBGGR10P, "bggr10p", BAYER_BGGR, BAYER_RAW10P);
+BAYER_TRAITS(V4L2_PIX_FMT_SGRBG10P, "grbg10p", BAYER_GRBG, BAYER_RAW10P);
+BAYER_TRAITS(V4L2_PIX_FMT_SGBRG10P, "gbrg10p", BAYER_GBRG, BAYER_RAW10P);
+BAYER_TRAITS(V4L2_PIX_FMT_SRGGB12P, "rggb12p", BAYER_RGGB, BAYER_RAW12P);
+BAYER_TRAITS(V4L2_PIX_FMT_SBGGR12P, "bggr12p", BAYER_BGGR, BAYER_RAW12P);
+BAYER_TRAITS(V4L2_PIX_FMT_SGRBG12P, "grbg12p", BAYER_GRBG, BAYER_RAW12P);
+BAYER_TRAITS(V4L2_PIX_FMT_SGBRG12P, "gbrg12p", BAYER_GBRG, BAYER_RAW12P);
+
+#undef BAYER_TRAITS
+
+/*
+ * The traits of a format as a table entry, for picking one by the format
+ * the driver settled on.
+ */
+struct PixelFormatOps {
+    __u32 fourcc;
+    const char *name;
+    unsigned int n_planes;
+    size_t (*min_bytesperline)(unsigned int width);
+    size_t (*min_sizeimage)(size_t bytesperline, unsigned int height);
+    int (*views)(unsigned char *data, size_t length, unsigned int width,
+                 unsigned int height, size_t bytesperline, std::vector<cv::Mat> &planes);
+    void (*to_bgr)(const std::vector<cv::Mat> &planes, cv::Mat &bgr,
+                   const ConvertParams &params, cv::Mat &scratch);
+};
+
+template <class Traits>
+PixelFormatOps pixel_format_ops() {
+    PixelFormatOps ops = {
+        Traits::fourcc, Traits::name(), Traits::n_planes,
+        &Traits::min_bytesperline, &Traits::min_sizeimage, &Traits::views, &Traits::to_bgr
+    };
+    return ops;
+}
+
+/* NULL for formats without traits. */
+const PixelFormatOps *find_pixel_format(__u32 fourcc);
+const PixelFormatOps *find_pixel_format(const char *name);
+/* The formats with traits, cheapest to convert first. */
+const std::vector<PixelFormatOps> &pixel_formats();
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * opencv_v4l2 - stripe_pool.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Persistent pool of pinned threads running row stripes of a frame.
+
+#ifndef STRIPE_POOL_HPP
+#define STRIPE_POOL_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+struct StripeTiming {
+    unsigned int worker;        /* 0 is the thread that called run() */
+    int cpu;                    /* CPU the stripe ran on */
+    uint64_t start_us, end_us;  /* from the start of the job */
+};
+
+/*
+ * Splits a range of rows into stripes and runs them on a set of threads
+ * created once and pinned to a CPU each, so that no thread is created or
+ * migrated per frame. The thread calling run() works on stripes too and
+ * returns once all of them are done. One job runs at a time; callers from
+ * several threads (e.g. one per camera) take turns.
+ */
+class StripePool {
+    private:
+        unsigned int n_threads;
+        bool pin;
+        std::vector<std::thread> workers;
+        std::vector<int> cpus;
+
+        std::mutex run_lock;            /* held for a whole job */
+        std::mutex lock;
+        std::condition_variable work_cond, done_cond;
+        uint64_t generation = 0;        /* jobs posted; protected by lock */
+        unsigned int active = 0;        /* workers inside work(); protected by lock */
+        bool quit = false;              /* protected by lock */
+
+        /* The current job; only changed under lock with no worker active. */
+        const cv::ParallelLoopBody *body = NULL;
+        cv::Range rows;
+        unsigned int n_stripes = 0;
+        uint64_t job_start_us = 0, job_us = 0;
+        std::atomic<unsigned int> next_stripe, stripes_left;
+        std::vector<StripeTiming> timings;
+
+        void worker_loop(unsigned int idx);
+        void work(unsigned int idx);
+
+    public:
+        /*
+         * n_threads counts the caller of run(); 0 uses one thread per CPU
+         * the process may run on. With 'pin', worker i is bound to the
+         * i-th of those CPUs, counting from the second.
+         */
+        explicit StripePool(unsigned int n_threads = 0, bool pin = true);
+        ~StripePool();
+
+        int start();
+        void stop();
+        unsigned int threads() const;
+
+        /*
+         * Stripes for a frame of 'bytes' source bytes over 'rows' rows: as
+         * many as keep the rows read and written by one stripe (taken as
+         * 5/2 of the source, e.g. UYVY to BGR) within half of a core's L2
+         * cache, rounded up to a multiple of the threads to keep them
+         * evenly loaded. Small frames get fewer stripes than threads, and
+         * one means running inline.
+         */
+        unsigned int stripes_for(size_t bytes, int rows) const;
+
+        /*
+         * Runs body over 'range' in 'stripes' row stripes (0 picks
+         * stripes_for() from the range and 'bytes'). Falls back to running
+         * inline when the pool isn't started.
+         */
+        void run(const cv::Range &range, const cv::ParallelLoopBody &body,
+                 size_t bytes, unsigned int stripes = 0);
+
+        /*
+         * Timing of each stripe of the last job and its wall time, to see
+         * how conversion scales with the number of cores.
+         */
+        void last_job(std::vector<StripeTiming> &stripes, uint64_t *wall_us);
+        /* One-line summary of last_job(): wall time, stripes, per-stripe times. */
+        void print_last_job(std::ostream &os);
+};
+
+#endif
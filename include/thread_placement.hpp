@@ -0,0 +1,47 @@
+/*
+ * opencv_v4l2 - thread_placement.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// CPU affinity, scheduling policy and NUMA node of capture threads.
+
+#ifndef THREAD_PLACEMENT_HPP
+#define THREAD_PLACEMENT_HPP
+
+#include <sched.h>
+#include <string>
+#include <vector>
+
+struct ThreadPlacement {
+    std::vector<int> cpus;          /* CPUs the thread may run on, empty for any */
+    int policy = SCHED_OTHER;       /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int priority = 0;               /* 1-99 for SCHED_FIFO / SCHED_RR */
+    int numa_node = -1;             /* node for buffers, -1 for the node of cpus[0] */
+};
+
+/*
+ * Checks the placement against this system: CPUs online and allowed for the
+ * process, a priority in range for the policy and an existing NUMA node.
+ * Problems are printed, prefixed with 'who'. Returns -1 if any is found.
+ */
+int placement_validate(const ThreadPlacement &pl, const char *who);
+
+/*
+ * Applies the placement to the calling thread and prints what was applied.
+ * A real-time policy the process may not use (no CAP_SYS_NICE, RLIMIT_RTPRIO)
+ * is reported and the thread stays on SCHED_OTHER. Returns -1 on failure to
+ * set the affinity.
+ */
+int placement_apply(const ThreadPlacement &pl, const char *who);
+
+/* NUMA node the buffers of a thread with this placement belong on, or -1. */
+int placement_node(const ThreadPlacement &pl);
+
+/* NUMA node of a CPU, -1 when unknown (e.g. no NUMA support). */
+int cpu_node(int cpu);
+
+/* "2,3 SCHED_FIFO/50" style description, for log messages. */
+std::string placement_string(const ThreadPlacement &pl);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * opencv_v4l2 - triple_buffer.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// Triple-buffered mailbox handing the latest frame to a display loop.
+
+#ifndef TRIPLE_BUFFER_HPP
+#define TRIPLE_BUFFER_HPP
+
+#include <atomic>
+
+/*
+ * Three slots: the writer fills one, the reader shows another and the third
+ * holds the latest complete value between them. Publishing and taking are a
+ * single atomic exchange each, so neither side ever waits for the other; a
+ * value the reader didn't get to in time is simply replaced by a newer one.
+ *
+ * One writer thread and one reader thread. Slots are reused, so e.g. a
+ * cv::Mat slot keeps its allocation from frame to frame.
+ */
+template <typename T>
+class TripleBuffer {
+    private:
+        static const unsigned int FRESH = 4;    /* middle slot not taken yet */
+
+        T slots[3];
+        unsigned int back = 0;                  /* writer only */
+        unsigned int front = 1;                 /* reader only */
+        std::atomic<unsigned int> middle;
+
+    public:
+        TripleBuffer() : middle(2) {}
+
+        /* Slot to fill with the next value. */
+        T &write_slot() {
+            return slots[back];
+        }
+
+        /* Makes the filled slot the latest value. */
+        void publish() {
+            back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+        }
+
+        /*
+         * Switches to the latest value if one was published since the last
+         * call; returns false (keeping the current one) otherwise.
+         */
+        bool take_latest() {
+            if (!(middle.load(std::memory_order_relaxed) & FRESH))
+                return false;
+            front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+            return true;
+        }
+
+        /* The value taken last. */
+        const T &read_slot() const {
+            return slots[front];
+        }
+};
+
+#endif
@@ -6,13 +6,29 @@
  */
 // Header file for v4l2_helper functions.
 
+#ifndef V4L2_UTIL_HPP
+#define V4L2_UTIL_HPP
 
 #define GET 1
 #define SET 2
+#include <stdint.h>
 #include <linux/videodev2.h>
 #include <opencv2/opencv.hpp>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 #include <string>
+#include <vector>
+#include <map>
+
+#include <buffer_pool.hpp>
+#include <capture_stats.hpp>
+#include <camera_controls.hpp>
+#include <thread_placement.hpp>
+#include <frame_ring.hpp>
+#include <bayer.hpp>
 
 #define ERR -128
 
@@ -20,27 +36,141 @@
 enum io_method {
     IO_METHOD_READ = 1,
     IO_METHOD_MMAP,
-    IO_METHOD_USERPTR
+    IO_METHOD_USERPTR,
+    IO_METHOD_DMABUF
 };
 
 struct buffer {
 	void   *start;
 	size_t  length;
+	int     dmabuf_fd;	/* -1 unless the buffer is (or was exported as) a dma-buf */
+	size_t  pool_length;	/* USERPTR: size of the pool mapping, 0 for heap memory */
+};
+
+/*
+ * A format / frame size / frame interval combination offered by a device.
+ * interval is the time per frame; 0/0 when the driver doesn't report it.
+ */
+struct CameraMode {
+    __u32 pixelformat = 0;
+    unsigned int width = 0, height = 0;
+    struct v4l2_fract interval = {0, 0};
+    bool compressed = false;
+
+    double fps() const {
+        return interval.numerator ? (double) interval.denominator / interval.numerator : 0;
+    }
+};
+
+/*
+ * Requirements for automatic mode selection. Zero means no limit. Of the
+ * modes that qualify, the one with the highest frame rate wins, then the
+ * cheapest format to convert (the order of 'formats', or a built-in ranking
+ * when it is empty), then the larger frame. With 'formats' empty only the
+ * formats with PixelFormatTraits qualify; compressed or other formats must
+ * be listed to be picked.
+ */
+struct ModeConstraints {
+    unsigned int min_width = 0, min_height = 0;
+    unsigned int max_width = 0, max_height = 0;
+    double min_fps = 0;
+    std::vector<__u32> formats;
 };
 
+class FrameAllocator;
+class ModeCache;
+class StripePool;
+struct PixelFormatOps;
+
 class CamV4L2{
+    friend class FrameAllocator;
+
     private:
         enum io_method io = IO_METHOD_MMAP;
+        enum v4l2_buf_type buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         int fd = -1;
-        struct buffer *buffers;
-        unsigned int n_buffers;
+        /*
+         * n_planes entries per V4L2 buffer: one for each memory plane of
+         * multi-planar formats (VIDEO_CAPTURE_MPLANE), otherwise just one.
+         */
+        struct buffer *buffers = NULL;
+        unsigned int n_buffers = 0;
+        unsigned int n_planes = 1;
+        unsigned int num_buffs;
+        struct v4l2_format cur_fmt;
+        CameraMode cur_mode;
+        cv::Rect cur_roi;
         struct v4l2_buffer frame_buf;
+        struct v4l2_plane frame_planes[VIDEO_MAX_PLANES];
         char is_initialised = 0;
         char is_released = 1;
         unsigned char* ptr_cam_frame;
         int bytes_used;
 	    unsigned int start, end, fps = 0;
+        uint64_t last_dropped = 0;
         std::thread runner;
+        std::vector<int> import_fds;
+        unsigned int pool_flags = 0;
+        ThreadPlacement placement;
+        int buffer_node = -1;
+        std::string dev_path;
+        ModeCache *mode_cache = NULL;
+        bool copy_out = false;
+        bool latest_frame = false;
+        unsigned int last_skipped = 0;
+        struct buffer copy_bufs[VIDEO_MAX_PLANES] = {};
+
+        /*
+         * Hot reconfiguration (see helper_change_cam_res). Frames are only
+         * dequeued and released under cfg_lock; while 'reconfiguring' is set
+         * no new frame is handed out. Held through pointers as CamV4L2 must
+         * stay movable.
+         */
+        std::unique_ptr<std::mutex> cfg_lock{new std::mutex};
+        std::unique_ptr<std::condition_variable> cfg_cond{new std::condition_variable};
+        bool reconfiguring = false;
+        uint64_t switch_start_us = 0;
+
+        /*
+         * Capture thread state. 'running' is polled by the thread between
+         * frames; wake_fd (an eventfd) is signalled by request_stop() so that
+         * a thread blocked waiting for a frame sees it at once.
+         */
+        std::unique_ptr<std::atomic<bool> > running{new std::atomic<bool>(false)};
+        int wake_fd = -1;
+
+        /* Controls (see set_controls) */
+        std::map<__u32, struct v4l2_query_ext_ctrl> controls;
+        std::unique_ptr<ControlUpdateQueue> ctrl_queue{new ControlUpdateQueue};
+
+        /* Telemetry (see get_stats) */
+        CaptureStats stats;
+        unsigned int n_queued = 0;	/* buffers the driver can fill */
+        unsigned int handles_out = 0;	/* frames held through acquire_frame */
+        uint64_t starve_start_us = 0;
+        uint64_t dqbuf_us = 0, converted_us = 0;
+        StartupTiming startup;
+        uint64_t streamon_us = 0;	/* set until the first frame is dequeued */
+
+        /* Adaptive queue depth (see set_adaptive_buffers) */
+        bool adaptive = false;
+        unsigned int min_buffs = 0, max_buffs = 0;
+        std::vector<unsigned int> parked;	/* buffer indices */
+        bool park_next = false;
+        bool just_shrunk = false;
+        bool seq_valid = false;
+        unsigned int last_sequence = 0;
+        unsigned int win_frames = 0, win_drops = 0, calm_windows = 0;
+        unsigned int win_start = 0;
+        uint64_t win_first_ts = 0, win_last_ts = 0, win_max_latency_us = 0;
+
+        std::vector<cv::Mat> plane_views;
+        unsigned int preview_scale = 1;
+        StripePool *stripe_pool = NULL;
+        enum bayer_demosaic demosaic = BAYER_BILINEAR;
+        cv::Mat full_preview;   /* frames between conversion and downscaling */
+        cv::Mat plane_scratch;  /* colour planes repacked for OpenCV */
+        const PixelFormatOps *pix_ops = NULL;   /* NULL for formats without traits */
 
         std::string winname;
         std::string savepath;
@@ -49,20 +179,71 @@ class CamV4L2{
         int open_device(const char *dev_name);
         int xioctl(int fh, unsigned long request, void *arg);
         int set_io_method(enum io_method io_meth);
+        enum v4l2_memory memory_type(void);
+        int dmabuf_sync(int dmabuf_fd, __u64 flags);
+        void sync_buffer(unsigned int index, __u64 flags);
+        size_t plane_size(unsigned int plane) const;
+        unsigned int plane_bytesperline(unsigned int plane) const;
+        int queue_buffer(unsigned int index);
+        int alloc_udmabuf(size_t size);
         int stop_capturing(void);
         int start_capturing(void);
         int uninit_device(void);
         int init_read(unsigned int buffer_size);
         int init_mmap(void);
-        int init_userp(unsigned int buffer_size);
+        int init_userp(void);
+        int init_dmabuf(void);
         int init_device(unsigned int width, unsigned int height, 
-                        unsigned int format);
+                        unsigned int format, const cv::Rect &roi = cv::Rect(),
+                        struct v4l2_fract interval = {0, 0});
+        int set_crop(const cv::Rect &roi);
+        int set_format(unsigned int width, unsigned int height,
+                       unsigned int format);
         int close_device(void);
+        int query_caps(unsigned int *caps);
+        void add_size_modes(std::vector<CameraMode> &modes,
+                            const struct v4l2_fmtdesc &fmtdesc,
+                            unsigned int width, unsigned int height);
+        size_t probe_size_modes(std::vector<CameraMode> &modes,
+                                const ModeConstraints &constraints);
+        int set_frame_interval(struct v4l2_fract interval);
+        int open_cam(int idx, const char* devname, enum io_method io_meth,
+                     bool enable_display_, unsigned int num_buffers);
+        int start_cam(void);
+        void abort_init(void);
+        int wait_for_frame(int timeout_ms);
+        int dequeue_buffer(struct v4l2_buffer *buf, struct v4l2_plane *planes);
+        int dequeue_frame(unsigned char** pointer_to_cam_data, int *size);
+        void track_dequeue(const struct v4l2_buffer &buf);
+        void note_queued(void);
+        void note_held(void);
+        void adapt_queue_depth(void);
+        int grow_queue(void);          /* 1: deferred while frames are held */
+        int add_buffer(void);
+        int restart_with_buffers(unsigned int count);
+        int reinit_buffers(bool reuse);
+        int reconfigure(unsigned int width, unsigned int height,
+                        unsigned int format, const cv::Rect *roi,
+                        double *switch_ms);
+        int release_frame(void);
+        void drain_to_latest(void);
+        int copy_out_frame(void);
+        int return_buffer(unsigned int index);
+        void release_handle(unsigned int index);
+        int build_plane_views(const struct buffer *bufs, const struct v4l2_plane *info,
+                              std::vector<cv::Mat> &planes);
+        int query_controls(void);
+        int validate_controls(const std::vector<ControlValue> &values) const;
+        void apply_pending_controls(void);
+        void arm_thread();
         int run_thread();
+        int run_ring_thread(FrameRing *ring);
+        int finish_frame();
+        int convert_split_planes(cv::Mat &bgr);
 
     public:
         int camidx;
-        bool running;
+        /* The first plane of the frame being processed, with the driver's pitch. */
         cv::Mat yuyv_frame;
         cv::Mat preview;
         bool enable_display;
@@ -70,14 +251,258 @@ class CamV4L2{
         int helper_init_cam(int idx, const char* devname, 
                             unsigned int width, unsigned int height, 
                             unsigned int format, enum io_method io_meth, 
-                            bool enable_display_);
+                            bool enable_display_,
+                            unsigned int num_buffers = 0,
+                            const cv::Rect &roi = cv::Rect());
+        /*
+         * Probes the modes of the device (VIDIOC_ENUM_FMT, ENUM_FRAMESIZES,
+         * ENUM_FRAMEINTERVALS), picks the best one meeting the constraints
+         * and applies its frame rate with VIDIOC_S_PARM. On failure either
+         * overload closes the device again and frees what it had set up, so
+         * the object can be initialised again.
+         */
+        int helper_init_cam(int idx, const char* devname,
+                            const ModeConstraints &constraints,
+                            enum io_method io_meth, bool enable_display_,
+                            unsigned int num_buffers = 0);
+        /* Returns 1 without a frame when interrupted by request_stop(). */
         int helper_get_cam_frame(unsigned char** pointer_to_cam_data, int *size);
+        /*
+         * Non-blocking variant of helper_get_cam_frame(). Returns 1 when no
+         * frame is ready yet.
+         */
+        int helper_try_get_cam_frame(unsigned char** pointer_to_cam_data, int *size);
         int helper_release_cam_frame();
         int helper_deinit_cam();
         void start_thread();
+        /*
+         * Capture-only thread: frames are acquired as zero-copy handles
+         * (acquire_frame()) and published to 'ring' for processing on the
+         * consumer's own thread; nothing in the camera (preview,
+         * yuyv_frame) is touched. The ring is closed when the thread ends.
+         * Size the queue (num_buffers) for the frames the ring can hold, two
+         * more than its capacity, plus one the driver keeps filling.
+         */
+        void start_thread(FrameRing *ring);
+        /*
+         * request_stop() asks the capture thread to finish without waiting
+         * for it; a thread blocked waiting for a frame is woken up at once.
+         * stop_thread() also joins it. is_running() turns false once a stop
+         * was requested or the thread ended on an error.
+         */
+        void request_stop();
         void stop_thread();
+        bool is_running() const;
+
+        /*
+         * Queue depth. helper_init_cam() takes the initial number of buffers
+         * (0 for the default of 4). With adaptive buffers enabled, the depth
+         * is grown when frames are dropped and shrunk when capture keeps up,
+         * within [min_buffers, max_buffers]. max_buffers = 0 disables it.
+         */
+        void set_adaptive_buffers(unsigned int min_buffers, unsigned int max_buffers);
+        unsigned int queue_depth() const;
+
+        /*
+         * Modes offered by the opened device, and the best of them for the
+         * given constraints (ERR if none qualifies).
+         */
+        int enumerate_modes(std::vector<CameraMode> &modes);
+        static int select_mode(const std::vector<CameraMode> &modes,
+                               const ModeConstraints &constraints,
+                               CameraMode *best);
+        /* The negotiated mode; the size may differ from the one requested. */
+        CameraMode current_mode() const;
+
+        /*
+         * Telemetry: dropped frames (sequence gaps) and latency histograms for
+         * capture -> dequeue, dequeue -> conversion done and conversion ->
+         * release. Callers that use helper_get_cam_frame() directly should call
+         * mark_converted() once they are done with the frame data.
+         *
+         * The counters are updated by the thread driving the camera; read them
+         * from that thread or once capture has been stopped.
+         */
+        void mark_converted(void);
+        CaptureStats get_stats(void) const;
+        void reset_stats(void);
+        /*
+         * Phases of helper_init_cam(); the first-frame time is filled in by
+         * the first dequeue, with the same threading rules as get_stats().
+         */
+        StartupTiming get_startup_timing(void) const;
+
+        /*
+         * Used when frames are driven by an external event loop (see
+         * CameraReactor) instead of start_thread(). try_get_frame() makes one
+         * non-blocking dequeue attempt and returns 1 if no frame is ready;
+         * process_frame() converts the dequeued frame and releases it.
+         */
+        int get_fd() const;
+        int try_get_frame(void);
+        int process_frame();
+
+        /*
+         * dma-bufs to import as capture buffers with IO_METHOD_DMABUF. Must be
+         * called before helper_init_cam(); the fds are duplicated. Without it,
+         * memfd-backed buffers are allocated through /dev/udmabuf. With
+         * multi-planar formats, give one fd per plane, buffer after buffer.
+         */
+        void set_dmabuf_fds(const std::vector<int> &fds);
+
+        /*
+         * How IO_METHOD_USERPTR buffers are allocated (pool_flags, see
+         * buffer_pool.hpp): hugepages to cut TLB misses while converting large
+         * frames, pre-faulted and mlock()ed so capture never takes a page
+         * fault. Options the system can't provide are dropped with a notice.
+         * Must be called before helper_init_cam().
+         */
+        void set_buffer_pool(unsigned int flags);
+
+        /*
+         * CPUs, scheduling policy / priority and NUMA node of the capture
+         * thread started by start_thread(). Must be called before
+         * helper_init_cam(), which validates it and binds USERPTR buffers
+         * to the node (that of the first CPU unless given). The thread
+         * applies it when it starts and reports the result; a real-time
+         * policy that isn't permitted falls back to SCHED_OTHER.
+         */
+        void set_thread_placement(const ThreadPlacement &pl);
+
+        /*
+         * Cache that enumerate_modes() (and so mode selection in
+         * helper_init_cam()) reads the modes of a known camera from instead
+         * of probing them, and adds newly probed ones to. Saving it is left
+         * to the owner. Set before helper_init_cam().
+         */
+        void set_mode_cache(ModeCache *cache);
+
+        /*
+         * Copy-out mode: every frame dequeued through helper_get_cam_frame()
+         * (and so start_thread() / CameraReactor) is copied into a buffer of
+         * the application's (see set_buffer_pool()) and the V4L2 buffer is
+         * queued back straight away, instead of after the frame is
+         * released. Trades one copy per frame, timed in get_stats(), against
+         * the driver running out of buffers (the starvation counters). Not
+         * for IO_METHOD_READ or acquire_frame(). Set before capture starts.
+         */
+        void set_copy_out(bool enable);
+
+        /*
+         * Latest-frame mode, for minimum latency in closed-loop use: once a
+         * frame is dequeued (helper_get_cam_frame(), start_thread(),
+         * CameraReactor), every other frame already waiting is dequeued too
+         * and all but the newest go straight back to the driver.
+         * frames_skipped() tells how many were passed over for the frame
+         * held; the total is in get_stats().
+         */
+        void set_latest_frame(bool enable);
+        unsigned int frames_skipped() const;
+
+        /*
+         * Size of 'preview' as a fraction of the frame: 1 (default), 2, 4
+         * or 8. UYVY frames are converted and box-filtered in one pass (see
+         * uyvy_to_bgr_scaled()), raw Bayer ones binned (see bayer_to_bgr()),
+         * so a small preview of a large sensor costs far less than a
+         * full-size one. ERR for other values.
+         */
+        int set_preview_scale(unsigned int scale);
+
+        /*
+         * Runs the conversion of UYVY frames in row stripes on 'pool', which
+         * several cameras may share, instead of on OpenCV's threads. The
+         * pool must be started and outlive capture. NULL to stop using it.
+         */
+        void set_stripe_pool(StripePool *pool);
+
+        /*
+         * How raw Bayer frames are demosaiced (see bayer_to_bgr()). Scaled
+         * previews always bin superpixels.
+         */
+        void set_demosaic(enum bayer_demosaic demosaic);
+
+        /*
+         * dma-buf fd of a plane of the frame currently held, for zero-copy
+         * sharing with other devices or processes. MMAP buffers are exported
+         * with VIDIOC_EXPBUF on first use. The fd is owned by the camera.
+         */
+        int get_frame_fd(unsigned int plane = 0);
+
+        /*
+         * Number of memory planes per frame; more than one only for
+         * multi-planar formats such as NV12M.
+         */
+        unsigned int num_planes() const;
+
+        /*
+         * Views (no copy) of the colour planes of the frame currently held,
+         * e.g. Y and interleaved UV for NV12 / NV12M, or a single CV_8UC2
+         * plane for UYVY. Strides follow the driver's bytesperline. Formats
+         * without PixelFormatTraits (other than the NV12M family) come out as
+         * a byte-wide view of each memory plane. The views are only valid
+         * until the frame is released.
+         */
+        int get_frame_planes(std::vector<cv::Mat> &planes);
+
+        /*
+         * Zero-copy frame handle: dequeues a frame into 'frame' (and its colour
+         * planes into 'planes', as get_frame_planes() does) backed directly by
+         * the V4L2 buffer. The buffer goes back to the driver once the last
+         * copy of those cv::Mat headers is released, so several frames can be
+         * held at once and from any thread; Mat::clone() gives an ordinary
+         * copy. Every frame held is a buffer the driver cannot fill: see the
+         * starvation counters in get_stats(). Returns 1 on timeout or when
+         * interrupted by request_stop(). Not for
+         * IO_METHOD_READ, nor together with helper_get_cam_frame().
+         */
+        int acquire_frame(cv::Mat &frame, std::vector<cv::Mat> *planes = NULL,
+                          int timeout_ms = 2000);
+
+        /*
+         * Switches resolution / format without closing the device. Safe to
+         * call while another thread captures (start_thread() or
+         * CameraReactor): waits for the frame in use to be released, stops
+         * the stream, renegotiates and restarts it. USERPTR and dma-buf
+         * buffers are kept when they are large enough for the new format.
+         * The previous format is restored on failure. switch_ms, if given,
+         * receives how long the stream was stopped.
+         */
+        int helper_change_cam_res(unsigned int width, unsigned int height,
+                                  unsigned int format, double *switch_ms = NULL);
+        bool is_reconfiguring();
+
+        /*
+         * Region of interest, cropped at the sensor (VIDIOC_S_SELECTION, or
+         * VIDIOC_S_CROP on older drivers) so that only the region crosses the
+         * bus and gets converted. An empty rectangle selects the full frame.
+         *
+         * With helper_init_cam() the frames are width x height; give the size
+         * of the region for 1:1, or a smaller size to have the device bin or
+         * scale. set_roi() makes the frames the size of the new region; a
+         * region of unchanged size is moved without restarting the stream
+         * where the driver allows it. get_roi() is the rectangle the driver
+         * settled on.
+         */
+        int set_roi(const cv::Rect &roi, double *switch_ms = NULL);
+        cv::Rect get_roi() const;
+
+        /*
+         * Controls (VIDIOC_*_EXT_CTRLS). The controls of the device are
+         * queried once (VIDIOC_QUERY_EXT_CTRL) when it is initialised and
+         * values are checked against that map before reaching the driver.
+         *
+         * set_controls() applies a batch right away and atomically: the whole
+         * batch is tried first, so either all of it is set or none.
+         * queue_controls() never blocks: the batch is handed to the thread
+         * driving the camera, which applies everything queued so far in one
+         * call between two frames: after helper_release_cam_frame(), or
+         * before acquire_frame() dequeues the next one (the 'ring' path).
+         */
+        const std::map<__u32, struct v4l2_query_ext_ctrl> &control_map() const;
+        int find_control(const char *name, __u32 *id) const;
+        int get_controls(std::vector<ControlValue> &values);
+        int set_controls(const std::vector<ControlValue> &values);
+        int queue_controls(const std::vector<ControlValue> &values);
+};
 
-        //int helper_change_cam_res(unsigned int width, unsigned int height, unsigned int format, enum io_method io_meth);
-        //int helper_ctrl(unsigned int, int,int*);
-        //int helper_queryctrl(unsigned int,struct v4l2_queryctrl* );
-};
\ No newline at end of file
+#endif
@@ -0,0 +1,108 @@
+/*
+ * opencv_v4l2 - yuv_convert.hpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+// UYVY to BGR conversion with hand-vectorized kernels picked at runtime.
+
+#ifndef YUV_CONVERT_HPP
+#define YUV_CONVERT_HPP
+
+#include <opencv2/opencv.hpp>
+
+class StripePool;
+
+enum yuv_matrix {
+    YUV_BT601 = 0,      /* SD, and what cv::COLOR_YUV2BGR_UYVY assumes */
+    YUV_BT709           /* HD */
+};
+
+enum yuv_range {
+    YUV_RANGE_LIMITED = 0,  /* Y 16-235, Cb/Cr 16-240 */
+    YUV_RANGE_FULL          /* 0-255, e.g. JPEG-style sensors */
+};
+
+enum yuv_isa {
+    YUV_ISA_AUTO = -1,  /* the best one the CPU supports */
+    YUV_ISA_SCALAR = 0,
+    YUV_ISA_SSE41,
+    YUV_ISA_AVX2,
+    YUV_ISA_AVX512,     /* AVX-512F + BW */
+    YUV_ISA_NEON,
+    YUV_ISA_COUNT
+};
+
+/*
+ * The best kernel for this CPU (CPUID on x86, HWCAP on arm64), detected once.
+ */
+enum yuv_isa yuv_best_isa();
+bool yuv_isa_supported(enum yuv_isa isa);
+const char *yuv_isa_name(enum yuv_isa isa);
+
+/*
+ * Converts one row of 'width' pixels (even) of UYVY to BGR. All kernels use
+ * the same 20-bit fixed point arithmetic and give identical results; with
+ * YUV_BT601 / YUV_RANGE_LIMITED they are also identical to
+ * cv::cvtColor(COLOR_YUV2BGR_UYVY).
+ */
+void uyvy_to_bgr_row(const unsigned char *src, unsigned char *dst, unsigned int width,
+                     enum yuv_matrix matrix = YUV_BT601,
+                     enum yuv_range range = YUV_RANGE_LIMITED,
+                     enum yuv_isa isa = YUV_ISA_AUTO);
+
+/*
+ * Drop-in for cv::cvtColor(src, dst, COLOR_YUV2BGR_UYVY): 'src' is CV_8UC2,
+ * 'dst' is (re)allocated as CV_8UC3. Large frames are split into row
+ * stripes run on OpenCV's worker threads.
+ */
+void uyvy_to_bgr(const cv::Mat &src, cv::Mat &dst,
+                 enum yuv_matrix matrix = YUV_BT601,
+                 enum yuv_range range = YUV_RANGE_LIMITED,
+                 enum yuv_isa isa = YUV_ISA_AUTO);
+
+/* As above, with the row stripes run on 'pool' (see StripePool). */
+void uyvy_to_bgr(const cv::Mat &src, cv::Mat &dst, StripePool &pool,
+                 enum yuv_matrix matrix = YUV_BT601,
+                 enum yuv_range range = YUV_RANGE_LIMITED,
+                 enum yuv_isa isa = YUV_ISA_AUTO);
+
+/*
+ * Converts and downscales in one pass, for previews: 'dst' is 1/scale the
+ * size of 'src' (scale 2, 4 or 8; 1 is plain uyvy_to_bgr()), each pixel the
+ * box-filtered average of a scale x scale block. Chroma is averaged per
+ * output pair, keeping the 4:2:2 subsampling of the source. The source is
+ * read once and no full-size BGR frame is written, so colour conversion and
+ * writes scale with the output. The width is rounded down to an even number;
+ * what is left past the last whole block is dropped.
+ */
+void uyvy_to_bgr_scaled(const cv::Mat &src, cv::Mat &dst, unsigned int scale,
+                        enum yuv_matrix matrix = YUV_BT601,
+                        enum yuv_range range = YUV_RANGE_LIMITED,
+                        enum yuv_isa isa = YUV_ISA_AUTO);
+void uyvy_to_bgr_scaled(const cv::Mat &src, cv::Mat &dst, unsigned int scale, StripePool &pool,
+                        enum yuv_matrix matrix = YUV_BT601,
+                        enum yuv_range range = YUV_RANGE_LIMITED,
+                        enum yuv_isa isa = YUV_ISA_AUTO);
+
+/*
+ * YUYV (CV_8UC2) and NV16 (a CV_8UC1 luma plane and a CV_8UC2 Cb/Cr plane
+ * of the same height) to BGR. Each row is repacked to UYVY in a row buffer
+ * and converted by the kernels of uyvy_to_bgr(), on 'pool' when given.
+ */
+void yuyv_to_bgr(const cv::Mat &src, cv::Mat &dst, StripePool *pool = NULL,
+                 enum yuv_matrix matrix = YUV_BT601,
+                 enum yuv_range range = YUV_RANGE_LIMITED,
+                 enum yuv_isa isa = YUV_ISA_AUTO);
+void nv16_to_bgr(const cv::Mat &y, const cv::Mat &uv, cv::Mat &dst, StripePool *pool = NULL,
+                 enum yuv_matrix matrix = YUV_BT601,
+                 enum yuv_range range = YUV_RANGE_LIMITED,
+                 enum yuv_isa isa = YUV_ISA_AUTO);
+
+/*
+ * The same repacking into a whole UYVY frame 'dst', for uyvy_to_bgr_scaled().
+ */
+void yuyv_to_uyvy(const cv::Mat &src, cv::Mat &dst, StripePool *pool = NULL);
+void nv16_to_uyvy(const cv::Mat &y, const cv::Mat &uv, cv::Mat &dst, StripePool *pool = NULL);
+
+#endif
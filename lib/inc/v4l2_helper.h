@@ -22,23 +22,127 @@ extern "C" {
 enum io_method {
 	IO_METHOD_READ = 1,
 	IO_METHOD_MMAP,
-	IO_METHOD_USERPTR
+	IO_METHOD_USERPTR,
+	IO_METHOD_DMABUF
 };
 
-/**
- * FIXME: All the state for the library is maintained via global variables.
- * So, it's not possible to use this library to access multiple devices
- * simultaneously. This is done to simplify the process of assessment.
+/*
+ * All functions return 0 on success and ERR ( a negative value) in case of failure.
+ */
+
+/*
+ * Handle-based API.
  *
- * Hint: To access multiple devices at the same time using this application,
- * the public helper functions can be made to accept a new structure, that holds
- * the global state, as parameter.
+ * helper_open() initialises a device and returns an opaque handle holding
+ * all of its state (NULL on failure). Each handle is independent, so a single
+ * process can stream from multiple devices simultaneously. A handle must not
+ * be used from more than one thread at a time.
  */
+struct helper_cam;
 
 /*
- * All functions return 0 on success and ERR ( a negative value) in case of failure.
+ * num_buffers is the number of buffers queued to the driver. More buffers
+ * absorb longer processing stalls at the cost of latency and memory; 0 selects
+ * the default of 4. The driver may adjust the count.
+ */
+struct helper_cam *helper_open(const char* devname, unsigned int width, unsigned int height, unsigned int format, enum io_method io_meth, unsigned int num_buffers);
+
+int helper_cam_get_frame(struct helper_cam *cam, unsigned char** pointer_to_cam_data, int *size);
+
+/*
+ * "Latest frame" variant of helper_cam_get_frame() for closed-loop use: waits
+ * for a frame as usual, then drains every other frame that is already ready
+ * without blocking, requeueing all but the newest. The number of frames
+ * skipped this way is stored in 'skipped' (may be NULL) and summed up in the
+ * stats. Release the frame with helper_cam_release_frame() as usual, also
+ * when ERR is returned because a skipped buffer could not be requeued: the
+ * frame is then still held.
+ */
+int helper_cam_get_latest_frame(struct helper_cam *cam, unsigned char** pointer_to_cam_data, int *size, unsigned int *skipped);
+
+int helper_cam_release_frame(struct helper_cam *cam);
+
+/*
+ * Opens a device with IO_METHOD_DMABUF, importing the given dma-buf fds as
+ * capture buffers (V4L2_MEMORY_DMABUF). The fds are duplicated, so the caller
+ * keeps ownership of its own, and one buffer is queued per fd. If dmabuf_fds is
+ * NULL, the default number of memfd-backed buffers is allocated through
+ * /dev/udmabuf instead, which is also what helper_open() does for
+ * IO_METHOD_DMABUF.
+ */
+struct helper_cam *helper_open_dmabuf(const char* devname, unsigned int width, unsigned int height, unsigned int format, const int *dmabuf_fds, unsigned int n_fds);
+
+/*
+ * Returns a dma-buf fd for the frame currently held (between get and release),
+ * so that it can be handed to another device or process without copying.
+ * MMAP buffers are exported with VIDIOC_EXPBUF on first use. The fd stays
+ * owned by the handle; dup() it to keep it beyond helper_close().
+ */
+int helper_cam_get_frame_fd(struct helper_cam *cam);
+
+/*
+ * Capture telemetry.
+ *
+ * Latencies are kept in histograms with power-of-two microsecond buckets:
+ * bucket 0 counts values below 1 us, bucket i counts [2^(i-1), 2^i) us, and
+ * the last bucket also counts everything above. All times use CLOCK_MONOTONIC.
+ *
+ * HELPER_LAT_CAPTURE_TO_DQBUF is measured from the driver timestamp and is
+ * only recorded for buffers flagged V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC. Whether
+ * the driver stamps the start (SOE) or end (EOF) of exposure is counted in
+ * ts_soe / ts_eof; with SOE the latency includes exposure and readout.
+ *
+ * The conversion stages need the application to call helper_cam_mark_converted()
+ * after it is done with the frame data and before releasing it.
+ */
+#define HELPER_HIST_BUCKETS	20
+
+enum helper_latency_stage {
+	HELPER_LAT_CAPTURE_TO_DQBUF = 0,
+	HELPER_LAT_DQBUF_TO_CONVERTED,
+	HELPER_LAT_CONVERTED_TO_RELEASE,
+	HELPER_LAT_STAGES
+};
+
+struct helper_latency_hist {
+	unsigned long long count;
+	unsigned long long sum_us;
+	unsigned long long max_us;
+	unsigned long long buckets[HELPER_HIST_BUCKETS];
+};
+
+struct helper_cam_stats {
+	unsigned long long frames;		/* frames dequeued */
+	unsigned long long dropped;		/* sequence gaps between dequeued frames */
+	unsigned long long ts_unusable;		/* frames without a monotonic timestamp */
+	unsigned long long ts_soe;		/* timestamps taken at start of exposure */
+	unsigned long long ts_eof;		/* timestamps taken at end of frame */
+	unsigned long long skipped;		/* requeued unseen by helper_cam_get_latest_frame() */
+	struct helper_latency_hist latency[HELPER_LAT_STAGES];
+};
+
+int helper_cam_mark_converted(struct helper_cam *cam);
+
+int helper_cam_get_stats(struct helper_cam *cam, struct helper_cam_stats *stats);
+
+int helper_cam_reset_stats(struct helper_cam *cam);
+
+/*
+ * Upper bound (in us) of the bucket holding the given percentile (0-100),
+ * or 0 for an empty histogram.
  */
+unsigned long long helper_latency_percentile(const struct helper_latency_hist *hist, double percentile);
 
+/*
+ * Stops streaming, frees the buffers and closes the device. The handle is
+ * freed even if an error is returned.
+ */
+int helper_close(struct helper_cam *cam);
+
+/*
+ * Single-device API. These are wrappers around the handle-based API using an
+ * internal handle, so only one device can be accessed through them at a time.
+ */
 int helper_init_cam(const char* devname, unsigned int width, unsigned int height, unsigned int format, enum io_method io_meth);
 
 int helper_get_cam_frame(unsigned char** pointer_to_cam_data, int *size);
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <fcntl.h>              /* low-level i/o */
 #include <unistd.h>
@@ -17,6 +18,7 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #include <linux/videodev2.h>
 #include "v4l2_helper.h"
@@ -24,28 +26,74 @@
 #define NUM_BUFFS	4
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
+/*
+ * dma-buf definitions for kernel headers older than 4.20 (udmabuf)
+ * and 4.6 (DMA_BUF_IOCTL_SYNC).
+ */
+#if defined(__has_include) && __has_include(<linux/udmabuf.h>)
+#include <linux/udmabuf.h>
+#else
+#define UDMABUF_FLAGS_CLOEXEC	0x01
+struct udmabuf_create {
+	__u32 memfd;
+	__u32 flags;
+	__u64 offset;
+	__u64 size;
+};
+#define UDMABUF_CREATE		_IOW('u', 0x42, struct udmabuf_create)
+#endif
+
+#if defined(__has_include) && __has_include(<linux/dma-buf.h>)
+#include <linux/dma-buf.h>
+#else
+struct dma_buf_sync {
+	__u64 flags;
+};
+#define DMA_BUF_SYNC_READ	(1 << 0)
+#define DMA_BUF_SYNC_START	(0 << 2)
+#define DMA_BUF_SYNC_END	(1 << 2)
+#define DMA_BUF_IOCTL_SYNC	_IOW('b', 0, struct dma_buf_sync)
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#define F_SEAL_SHRINK		0x0002
+#endif
+#define HELPER_MFD_ALLOW_SEALING	0x0002U
+
 
 struct buffer {
 	void   *start;
 	size_t  length;
+	int     dmabuf_fd;	/* -1 unless the buffer is (or was exported as) a dma-buf */
 };
 
-/**
- * FIXME: All the state for the library is maintained via global variables.
- * So, it's not possible to use this library to access multiple devices
- * simultaneously. This is done to simplify the process of assessment.
- *
- * Hint: To access multiple devices at the same time using this application,
- * the public helper functions can be made to accept a new structure, that holds
- * the global state, as parameter.
+/*
+ * Per-device state. Every helper function operates on one of these, so
+ * a process can stream from as many devices as it opens.
  */
+struct helper_cam {
+	enum io_method      io;
+	int                 fd;
+	struct buffer      *buffers;
+	unsigned int        n_buffers;
+	unsigned int        num_buffers;	/* queue depth requested from the driver */
+	struct v4l2_buffer  frame_buf;
+	const int          *import_fds;	/* only valid during helper_open_dmabuf() */
+	struct helper_cam_stats stats;
+	unsigned int        last_sequence;
+	char                seq_valid;
+	unsigned long long  dqbuf_us;		/* CLOCK_MONOTONIC time of the last DQBUF */
+	unsigned long long  converted_us;	/* 0 until helper_cam_mark_converted() */
+	unsigned int        n_import_fds;
+	char                is_initialised;
+	char                is_released;
+};
 
-static enum io_method   io = IO_METHOD_MMAP;
-static int              fd = -1;
-static struct buffer          *buffers;
-static unsigned int     n_buffers;
-static struct v4l2_buffer frame_buf;
-static char is_initialised = 0, is_released = 1;
+/*
+ * Handle backing the legacy global API (helper_init_cam() and friends).
+ */
+static struct helper_cam *default_cam;
 
 /**
  * Start of static (internal) helper functions
@@ -61,14 +109,144 @@ static int xioctl(int fh, unsigned long request, void *arg)
 	return r;
 }
 
-static int set_io_method(enum io_method io_meth)
+static unsigned long long monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hist_add(struct helper_latency_hist *hist, unsigned long long us)
+{
+	unsigned int bucket = 0;
+
+	while (bucket < HELPER_HIST_BUCKETS - 1 && (us >> bucket) != 0)
+		bucket++;
+
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+}
+
+/*
+ * Accounts the frame just dequeued into cam->stats.
+ */
+static void track_dequeue(struct helper_cam *cam)
+{
+	struct helper_cam_stats *st = &cam->stats;
+	const struct v4l2_buffer *b = &cam->frame_buf;
+
+	cam->dqbuf_us = monotonic_us();
+	cam->converted_us = 0;
+	st->frames++;
+
+	if (cam->seq_valid && b->sequence > cam->last_sequence + 1)
+		st->dropped += b->sequence - cam->last_sequence - 1;
+	cam->last_sequence = b->sequence;
+	cam->seq_valid = 1;
+
+	if ((b->flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE)
+		st->ts_soe++;
+	else
+		st->ts_eof++;
+
+	if ((b->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		unsigned long long ts = (unsigned long long) b->timestamp.tv_sec * 1000000 +
+			b->timestamp.tv_usec;
+
+		hist_add(&st->latency[HELPER_LAT_CAPTURE_TO_DQBUF],
+				cam->dqbuf_us > ts ? cam->dqbuf_us - ts : 0);
+	} else {
+		/* COPY or UNKNOWN timestamps can't be compared with our clock. */
+		st->ts_unusable++;
+	}
+}
+
+static enum v4l2_memory memory_type(struct helper_cam *cam)
+{
+	switch (cam->io) {
+		case IO_METHOD_USERPTR:
+			return V4L2_MEMORY_USERPTR;
+		case IO_METHOD_DMABUF:
+			return V4L2_MEMORY_DMABUF;
+		default:
+			return V4L2_MEMORY_MMAP;
+	}
+}
+
+static int dmabuf_sync(int dmabuf_fd, __u64 flags)
+{
+	struct dma_buf_sync sync;
+
+	CLEAR(sync);
+	sync.flags = flags | DMA_BUF_SYNC_READ;
+
+	return xioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+/*
+ * Allocates a memfd-backed dma-buf through /dev/udmabuf. This is used as the
+ * backing store when IO_METHOD_DMABUF is requested without external buffers.
+ */
+static int alloc_udmabuf(size_t size)
+{
+	struct udmabuf_create create;
+	int memfd, devfd, dmabuf_fd;
+
+	devfd = open("/dev/udmabuf", O_RDWR);
+	if (-1 == devfd) {
+		fprintf(stderr, "Cannot open '/dev/udmabuf': %d, %s\n",
+				errno, strerror(errno));
+		return -1;
+	}
+
+	memfd = syscall(SYS_memfd_create, "v4l2_helper", HELPER_MFD_ALLOW_SEALING);
+	if (-1 == memfd) {
+		fprintf(stderr, "Error occurred when creating memfd\n");
+		close(devfd);
+		return -1;
+	}
+
+	if (
+		-1 == ftruncate(memfd, size) ||
+		-1 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK)
+	)
+	{
+		fprintf(stderr, "Error occurred when sizing memfd\n");
+		close(memfd);
+		close(devfd);
+		return -1;
+	}
+
+	CLEAR(create);
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+
+	dmabuf_fd = xioctl(devfd, UDMABUF_CREATE, &create);
+	if (-1 == dmabuf_fd) {
+		fprintf(stderr, "Error occurred when creating udmabuf\n");
+	}
+
+	/* The dma-buf holds its own reference to the memfd pages. */
+	close(memfd);
+	close(devfd);
+	return dmabuf_fd;
+}
+
+static int set_io_method(struct helper_cam *cam, enum io_method io_meth)
 {
 	switch (io_meth)
 	{
 		case IO_METHOD_READ:
 		case IO_METHOD_MMAP:
 		case IO_METHOD_USERPTR:
-			io = io_meth;
+		case IO_METHOD_DMABUF:
+			cam->io = io_meth;
 			return 0;
 		default:
 			fprintf(stderr, "Invalid I/O method\n");
@@ -76,20 +254,21 @@ static int set_io_method(enum io_method io_meth)
 	}
 }
 
-static int stop_capturing(void)
+static int stop_capturing(struct helper_cam *cam)
 {
 	enum v4l2_buf_type type;
 	struct v4l2_requestbuffers req;
 
-	switch (io) {
+	switch (cam->io) {
 		case IO_METHOD_READ:
 			/* Nothing to do. */
 			break;
 
 		case IO_METHOD_MMAP:
 		case IO_METHOD_USERPTR:
+		case IO_METHOD_DMABUF:
 			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+			if (-1 == xioctl(cam->fd, VIDIOC_STREAMOFF, &type))
 			{
 				fprintf(stderr, "Error occurred when streaming off\n");
 				return ERR;
@@ -104,31 +283,28 @@ static int stop_capturing(void)
 	 */
 	req.count = 0;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
+	req.memory = memory_type(cam);
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-		if (EINVAL == errno) {
-			fprintf(stderr, "The device does not support "
-					"memory mapping\n");
-		}
+	if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
+		fprintf(stderr, "Error occurred when releasing buffers\n");
 		return ERR;
 	}
 
 	return 0;
 }
 
-static int start_capturing(void)
+static int start_capturing(struct helper_cam *cam)
 {
 	unsigned int i;
 	enum v4l2_buf_type type;
 
-	switch (io) {
+	switch (cam->io) {
 		case IO_METHOD_READ:
 			/* Nothing to do. */
 			break;
 
 		case IO_METHOD_MMAP:
-			for (i = 0; i < n_buffers; ++i) {
+			for (i = 0; i < cam->n_buffers; ++i) {
 				struct v4l2_buffer buf;
 
 				CLEAR(buf);
@@ -136,14 +312,14 @@ static int start_capturing(void)
 				buf.memory = V4L2_MEMORY_MMAP;
 				buf.index = i;
 
-				if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+				if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf))
 				{
 					fprintf(stderr, "Error occurred when queueing buffer\n");
 					return ERR;
 				}
 			}
 			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+			if (-1 == xioctl(cam->fd, VIDIOC_STREAMON, &type))
 			{
 				fprintf(stderr, "Error occurred when turning on stream\n");
 				return ERR;
@@ -151,24 +327,49 @@ static int start_capturing(void)
 			break;
 
 		case IO_METHOD_USERPTR:
-			for (i = 0; i < n_buffers; ++i) {
+			for (i = 0; i < cam->n_buffers; ++i) {
 				struct v4l2_buffer buf;
 
 				CLEAR(buf);
 				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 				buf.memory = V4L2_MEMORY_USERPTR;
 				buf.index = i;
-				buf.m.userptr = (unsigned long)buffers[i].start;
-				buf.length = buffers[i].length;
+				buf.m.userptr = (unsigned long)cam->buffers[i].start;
+				buf.length = cam->buffers[i].length;
+
+				if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf))
+				{
+					fprintf(stderr, "Error occurred when queueing buffer\n");
+					return ERR;
+				}
+			}
+			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			if (-1 == xioctl(cam->fd, VIDIOC_STREAMON, &type))
+			{
+				fprintf(stderr, "Error when turning on stream\n");
+				return ERR;
+			}
+			break;
+
+		case IO_METHOD_DMABUF:
+			for (i = 0; i < cam->n_buffers; ++i) {
+				struct v4l2_buffer buf;
+
+				CLEAR(buf);
+				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+				buf.memory = V4L2_MEMORY_DMABUF;
+				buf.index = i;
+				buf.m.fd = cam->buffers[i].dmabuf_fd;
+				buf.length = cam->buffers[i].length;
 
-				if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+				if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf))
 				{
 					fprintf(stderr, "Error occurred when queueing buffer\n");
 					return ERR;
 				}
 			}
 			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+			if (-1 == xioctl(cam->fd, VIDIOC_STREAMON, &type))
 			{
 				fprintf(stderr, "Error when turning on stream\n");
 				return ERR;
@@ -179,45 +380,50 @@ static int start_capturing(void)
 	return 0;
 }
 
-static int uninit_device(void)
+static int uninit_device(struct helper_cam *cam)
 {
 	unsigned int i;
 	int ret = 0;
 
-	switch (io) {
+	switch (cam->io) {
 		case IO_METHOD_READ:
-			free(buffers[0].start);
+			free(cam->buffers[0].start);
 			break;
 
 		case IO_METHOD_MMAP:
-			for (i = 0; i < n_buffers; ++i)
-				if (-1 == munmap(buffers[i].start, buffers[i].length))
+		case IO_METHOD_DMABUF:
+			for (i = 0; i < cam->n_buffers; ++i) {
+				if (-1 == munmap(cam->buffers[i].start, cam->buffers[i].length))
 					ret = ERR;
+				if (cam->buffers[i].dmabuf_fd >= 0)
+					close(cam->buffers[i].dmabuf_fd);
+			}
 			break;
 
 		case IO_METHOD_USERPTR:
-			for (i = 0; i < n_buffers; ++i)
-				free(buffers[i].start);
+			for (i = 0; i < cam->n_buffers; ++i)
+				free(cam->buffers[i].start);
 			break;
 	}
 
-	free(buffers);
+	free(cam->buffers);
 	return ret;
 }
 
-static int init_read(unsigned int buffer_size)
+static int init_read(struct helper_cam *cam, unsigned int buffer_size)
 {
-	buffers = (struct buffer *) calloc(1, sizeof(*buffers));
+	cam->buffers = (struct buffer *) calloc(1, sizeof(*cam->buffers));
 
-	if (!buffers) {
+	if (!cam->buffers) {
 		fprintf(stderr, "Out of memory\n");
 		return ERR;
 	}
 
-	buffers[0].length = buffer_size;
-	buffers[0].start = malloc(buffer_size);
+	cam->buffers[0].length = buffer_size;
+	cam->buffers[0].start = malloc(buffer_size);
+	cam->buffers[0].dmabuf_fd = -1;
 
-	if (!buffers[0].start) {
+	if (!cam->buffers[0].start) {
 		fprintf(stderr, "Out of memory\n");
 		return ERR;
 	}
@@ -225,18 +431,18 @@ static int init_read(unsigned int buffer_size)
 	return 0;
 }
 
-static int init_mmap(void)
+static int init_mmap(struct helper_cam *cam)
 {
 	struct v4l2_requestbuffers req;
 	int ret = 0;
 
 	CLEAR(req);
 
-	req.count = NUM_BUFFS;
+	req.count = cam->num_buffers;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+	if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "The device does not support "
 					"memory mapping\n");
@@ -250,38 +456,39 @@ static int init_mmap(void)
 		return ERR;
 	}
 
-	buffers = (struct buffer *) calloc(req.count, sizeof(*buffers));
+	cam->buffers = (struct buffer *) calloc(req.count, sizeof(*cam->buffers));
 
-	if (!buffers) {
+	if (!cam->buffers) {
 		fprintf(stderr, "Out of memory\n");
 		return ERR;
 	}
 
-	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+	for (cam->n_buffers = 0; cam->n_buffers < req.count; ++cam->n_buffers) {
 		int loop_err = 0;
 		struct v4l2_buffer buf;
 
 		CLEAR(buf);
 		buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory      = V4L2_MEMORY_MMAP;
-		buf.index       = n_buffers;
+		buf.index       = cam->n_buffers;
 
-		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
+		if (-1 == xioctl(cam->fd, VIDIOC_QUERYBUF, &buf))
 		{
 			fprintf(stderr, "Error occurred when querying buffer\n");
 			loop_err = 1;
 			goto LOOP_FREE_EXIT;
 		}
 
-		buffers[n_buffers].length = buf.length;
-		buffers[n_buffers].start =
+		cam->buffers[cam->n_buffers].length = buf.length;
+		cam->buffers[cam->n_buffers].dmabuf_fd = -1;
+		cam->buffers[cam->n_buffers].start =
 			mmap(NULL /* start anywhere */,
 					buf.length,
 					PROT_READ | PROT_WRITE /* required */,
 					MAP_SHARED /* recommended */,
-					fd, buf.m.offset);
+					cam->fd, buf.m.offset);
 
-		if (MAP_FAILED == buffers[n_buffers].start) {
+		if (MAP_FAILED == cam->buffers[cam->n_buffers].start) {
 			fprintf(stderr, "Error occurred when mapping memory\n");
 			loop_err = 1;
 			goto LOOP_FREE_EXIT;
@@ -292,12 +499,12 @@ LOOP_FREE_EXIT:
 		{
 			unsigned int curr_buf_to_free;
 			for (curr_buf_to_free = 0;
-				curr_buf_to_free < n_buffers;
+				curr_buf_to_free < cam->n_buffers;
 				curr_buf_to_free++)
 			{
 				if (
-					munmap(buffers[curr_buf_to_free].start,
-					buffers[curr_buf_to_free].length) != 0
+					munmap(cam->buffers[curr_buf_to_free].start,
+					cam->buffers[curr_buf_to_free].length) != 0
 				)
 				{
 					/*
@@ -306,7 +513,7 @@ LOOP_FREE_EXIT:
 					 */
 				}
 			}
-			free(buffers);
+			free(cam->buffers);
 			return ERR;
 		}
 	}
@@ -314,17 +521,17 @@ LOOP_FREE_EXIT:
 	return ret;
 }
 
-static int init_userp(unsigned int buffer_size)
+static int init_userp(struct helper_cam *cam, unsigned int buffer_size)
 {
 	struct v4l2_requestbuffers req;
 
 	CLEAR(req);
 
-	req.count  = NUM_BUFFS;
+	req.count  = cam->num_buffers;
 	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_USERPTR;
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+	if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "The device does not "
 					"support user pointer i/o\n");
@@ -332,29 +539,30 @@ static int init_userp(unsigned int buffer_size)
 		return ERR;
 	}
 
-	buffers = (struct buffer *) calloc(req.count, sizeof(*buffers));
+	cam->buffers = (struct buffer *) calloc(req.count, sizeof(*cam->buffers));
 
-	if (!buffers) {
+	if (!cam->buffers) {
 		fprintf(stderr, "Out of memory\n");
 		return ERR;
 	}
 
-	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-		buffers[n_buffers].length = buffer_size;
-		if(posix_memalign(&buffers[n_buffers].start,getpagesize(),buffer_size) != 0)
+	for (cam->n_buffers = 0; cam->n_buffers < req.count; ++cam->n_buffers) {
+		cam->buffers[cam->n_buffers].length = buffer_size;
+		cam->buffers[cam->n_buffers].dmabuf_fd = -1;
+		if(posix_memalign(&cam->buffers[cam->n_buffers].start,getpagesize(),buffer_size) != 0)
 		{
 			/*
 			 * This happens only in case of ENOMEM
 			 */
 			unsigned int curr_buf_to_free;
 			for (curr_buf_to_free = 0;
-				curr_buf_to_free < n_buffers;
+				curr_buf_to_free < cam->n_buffers;
 				curr_buf_to_free++
 			)
 			{
-				free(buffers[curr_buf_to_free].start);
+				free(cam->buffers[curr_buf_to_free].start);
 			}
-			free(buffers);
+			free(cam->buffers);
 			fprintf(stderr, "Error occurred when allocating memory for buffers\n");
 			return ERR;
 		}
@@ -363,7 +571,102 @@ static int init_userp(unsigned int buffer_size)
 	return 0;
 }
 
-static int init_device(unsigned int width, unsigned int height, unsigned int format)
+/*
+ * Imports dma-bufs into the capture queue (V4L2_MEMORY_DMABUF). The buffers
+ * are either the ones passed to helper_open_dmabuf() or memfd-backed udmabufs
+ * allocated here. Each one is also mapped for CPU access to the frame data.
+ */
+static int init_dmabuf(struct helper_cam *cam, unsigned int buffer_size)
+{
+	struct v4l2_requestbuffers req;
+	size_t page_size = getpagesize();
+	size_t alloc_size = (buffer_size + page_size - 1) & ~(page_size - 1);
+
+	CLEAR(req);
+
+	req.count  = cam->n_import_fds ? cam->n_import_fds : cam->num_buffers;
+	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_DMABUF;
+
+	if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
+		if (EINVAL == errno) {
+			fprintf(stderr, "The device does not "
+					"support dma-buf i/o\n");
+		}
+		return ERR;
+	}
+
+	/*
+	 * The driver might ask for more buffers than were handed to us. Only
+	 * queue the ones we actually have.
+	 */
+	if (cam->n_import_fds && req.count > cam->n_import_fds)
+		req.count = cam->n_import_fds;
+
+	cam->buffers = (struct buffer *) calloc(req.count, sizeof(*cam->buffers));
+
+	if (!cam->buffers) {
+		fprintf(stderr, "Out of memory\n");
+		return ERR;
+	}
+
+	for (cam->n_buffers = 0; cam->n_buffers < req.count; ++cam->n_buffers) {
+		struct buffer *b = &cam->buffers[cam->n_buffers];
+		int loop_err = 0;
+
+		if (cam->n_import_fds) {
+			off_t size = lseek(cam->import_fds[cam->n_buffers], 0, SEEK_END);
+
+			if (size < 0 || (size_t) size < buffer_size) {
+				fprintf(stderr, "dma-buf %u is too small for the frame\n",
+						cam->n_buffers);
+				loop_err = 1;
+				goto LOOP_FREE_EXIT;
+			}
+			b->length = size;
+			b->dmabuf_fd = dup(cam->import_fds[cam->n_buffers]);
+		} else {
+			b->length = alloc_size;
+			b->dmabuf_fd = alloc_udmabuf(alloc_size);
+		}
+
+		if (-1 == b->dmabuf_fd) {
+			fprintf(stderr, "Error occurred when allocating dma-buf\n");
+			loop_err = 1;
+			goto LOOP_FREE_EXIT;
+		}
+
+		b->start = mmap(NULL, b->length, PROT_READ | PROT_WRITE,
+				MAP_SHARED, b->dmabuf_fd, 0);
+
+		if (MAP_FAILED == b->start) {
+			fprintf(stderr, "Error occurred when mapping dma-buf\n");
+			close(b->dmabuf_fd);
+			loop_err = 1;
+			goto LOOP_FREE_EXIT;
+		}
+
+LOOP_FREE_EXIT:
+		if (loop_err)
+		{
+			unsigned int curr_buf_to_free;
+			for (curr_buf_to_free = 0;
+				curr_buf_to_free < cam->n_buffers;
+				curr_buf_to_free++)
+			{
+				munmap(cam->buffers[curr_buf_to_free].start,
+					cam->buffers[curr_buf_to_free].length);
+				close(cam->buffers[curr_buf_to_free].dmabuf_fd);
+			}
+			free(cam->buffers);
+			return ERR;
+		}
+	}
+
+	return 0;
+}
+
+static int init_device(struct helper_cam *cam, unsigned int width, unsigned int height, unsigned int format)
 {
 	struct v4l2_capability cap;
 	struct v4l2_cropcap cropcap;
@@ -371,7 +674,7 @@ static int init_device(unsigned int width, unsigned int height, unsigned int for
 	struct v4l2_format fmt;
 	unsigned int min;
 
-	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+	if (-1 == xioctl(cam->fd, VIDIOC_QUERYCAP, &cap)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "Given device is no V4L2 device\n");
 		}
@@ -384,7 +687,7 @@ static int init_device(unsigned int width, unsigned int height, unsigned int for
 		return ERR;
 	}
 
-	switch (io) {
+	switch (cam->io) {
 		case IO_METHOD_READ:
 			if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
 				fprintf(stderr, "Given device does not "
@@ -395,6 +698,7 @@ static int init_device(unsigned int width, unsigned int height, unsigned int for
 
 		case IO_METHOD_MMAP:
 		case IO_METHOD_USERPTR:
+		case IO_METHOD_DMABUF:
 			if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
 				fprintf(stderr, "Given device does not "
 						"support streaming i/o\n");
@@ -410,11 +714,11 @@ static int init_device(unsigned int width, unsigned int height, unsigned int for
 
 	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-	if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
+	if (0 == xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap)) {
 		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		crop.c = cropcap.defrect; /* reset to default */
 
-		if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
+		if (-1 == xioctl(cam->fd, VIDIOC_S_CROP, &crop)) {
 			switch (errno) {
 				case EINVAL:
 					/* Cropping not supported. */
@@ -436,7 +740,7 @@ static int init_device(unsigned int width, unsigned int height, unsigned int for
 	fmt.fmt.pix.pixelformat = format;
 	fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
 
-	if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
+	if (-1 == xioctl(cam->fd, VIDIOC_S_FMT, &fmt))
 	{
 		fprintf(stderr, "Error occurred when trying to set format\n");
 		return ERR;
@@ -465,37 +769,41 @@ static int init_device(unsigned int width, unsigned int height, unsigned int for
 	if (fmt.fmt.pix.sizeimage < min)
 		fmt.fmt.pix.sizeimage = min;
 
-	switch (io) {
+	switch (cam->io) {
 		case IO_METHOD_READ:
-			return init_read(fmt.fmt.pix.sizeimage);
+			return init_read(cam, fmt.fmt.pix.sizeimage);
 			break;
 
 		case IO_METHOD_MMAP:
-			return init_mmap();
+			return init_mmap(cam);
 			break;
 
 		case IO_METHOD_USERPTR:
-			return init_userp(fmt.fmt.pix.sizeimage);
+			return init_userp(cam, fmt.fmt.pix.sizeimage);
+			break;
+
+		case IO_METHOD_DMABUF:
+			return init_dmabuf(cam, fmt.fmt.pix.sizeimage);
 			break;
 	}
 
 	return 0;
 }
 
-static int close_device(void)
+static int close_device(struct helper_cam *cam)
 {
-	if (-1 == close(fd))
+	if (-1 == close(cam->fd))
 	{
 		fprintf(stderr, "Error occurred when closing device\n");
 		return ERR;
 	}
 
-	fd = -1;
+	cam->fd = -1;
 
 	return 0;
 }
 
-static int open_device(const char *dev_name)
+static int open_device(struct helper_cam *cam, const char *dev_name)
 {
 	struct stat st;
 
@@ -510,15 +818,64 @@ static int open_device(const char *dev_name)
 		return ERR;
 	}
 
-	fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+	cam->fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
 
-	if (-1 == fd) {
+	if (-1 == cam->fd) {
 		fprintf(stderr, "Cannot open '%s': %d, %s\n",
 				dev_name, errno, strerror(errno));
 		return ERR;
 	}
 
-	return fd;
+	return cam->fd;
+}
+static struct helper_cam *open_cam(const char* devname, unsigned int width, unsigned int height, unsigned int format, enum io_method io_meth, unsigned int num_buffers, const int *dmabuf_fds, unsigned int n_fds)
+{
+	struct helper_cam *cam = (struct helper_cam *) calloc(1, sizeof(*cam));
+
+	if (!cam) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	cam->io = IO_METHOD_MMAP;
+	cam->fd = -1;
+	cam->is_released = 1;
+	cam->num_buffers = num_buffers ? num_buffers : NUM_BUFFS;
+	cam->import_fds = dmabuf_fds;
+	cam->n_import_fds = n_fds;
+
+	if(
+		set_io_method(cam, io_meth) < 0 ||
+		open_device(cam, devname) < 0
+	)
+	{
+		fprintf(stderr, "Error occurred when initialising camera\n");
+		free(cam);
+		return NULL;
+	}
+
+	if (init_device(cam, width, height, format) < 0)
+	{
+		fprintf(stderr, "Error occurred when initialising camera\n");
+		close_device(cam);
+		free(cam);
+		return NULL;
+	}
+
+	cam->import_fds = NULL;
+	cam->n_import_fds = 0;
+
+	if (start_capturing(cam) < 0)
+	{
+		fprintf(stderr, "Error occurred when initialising camera\n");
+		uninit_device(cam);
+		close_device(cam);
+		free(cam);
+		return NULL;
+	}
+
+	cam->is_initialised = 1;
+	return cam;
 }
 /**
  * End of static (internal) helper functions
@@ -528,74 +885,61 @@ static int open_device(const char *dev_name)
 /**
  * Start of public helper functions
  */
-int helper_init_cam(const char* devname, unsigned int width, unsigned int height, unsigned int format, enum io_method io_meth)
+struct helper_cam *helper_open(const char* devname, unsigned int width, unsigned int height, unsigned int format, enum io_method io_meth, unsigned int num_buffers)
 {
-	if (is_initialised)
-	{
-		/*
-		 * The library currently doesn't support
-		 * accessing multiple devices simultaneously.
-		 * So, return an error when such access is attempted.
-		 */
-		fprintf(stderr, "Cannot use the library to initialise multiple devices, simultaneously.\n");
-		return ERR;
-	}
+	return open_cam(devname, width, height, format, io_meth, num_buffers, NULL, 0);
+}
 
-	if(
-		set_io_method(io_meth) < 0 ||
-		open_device(devname) < 0 ||
-		init_device(width,height,format) < 0 ||
-		start_capturing() < 0
-	)
-	{
-		fprintf(stderr, "Error occurred when initialising camera\n");
-		return ERR;
-	}
+struct helper_cam *helper_open_dmabuf(const char* devname, unsigned int width, unsigned int height, unsigned int format, const int *dmabuf_fds, unsigned int n_fds)
+{
+	if (!dmabuf_fds)
+		n_fds = 0;
 
-	is_initialised = 1;
-	return 0;
+	return open_cam(devname, width, height, format, IO_METHOD_DMABUF, 0, dmabuf_fds, n_fds);
 }
 
-int helper_deinit_cam()
+int helper_close(struct helper_cam *cam)
 {
-	if (!is_initialised)
+	int ret = 0;
+
+	if (!cam || !cam->is_initialised)
 	{
 		fprintf(stderr, "Error: trying to de-initialise without initialising camera\n");
 		return ERR;
 	}
 
 	/*
-	 * It's better to turn off is_initialised even if the
-	 * de-initialisation fails as it shouldn't have affect
-	 * re-initialisation a lot.
+	 * The handle is freed even if the de-initialisation fails as there
+	 * is nothing more the caller could do with it.
 	 */
-	is_initialised = 0;
+	cam->is_initialised = 0;
 
 	if(
-		stop_capturing() < 0 ||
-		uninit_device() < 0 ||
-		close_device() < 0
+		stop_capturing(cam) < 0 ||
+		uninit_device(cam) < 0 ||
+		close_device(cam) < 0
 	)
 	{
 		fprintf(stderr, "Error occurred when de-initialising camera\n");
-		return ERR;
+		ret = ERR;
 	}
 
-	return 0;
+	free(cam);
+	return ret;
 }
 
-int helper_get_cam_frame(unsigned char **pointer_to_cam_data, int *size)
+int helper_cam_get_frame(struct helper_cam *cam, unsigned char **pointer_to_cam_data, int *size)
 {
-	static unsigned char max_timeout_retries = 10;
+	static const unsigned char max_timeout_retries = 10;
 	unsigned char timeout_retries = 0;
 
-	if (!is_initialised)
+	if (!cam || !cam->is_initialised)
 	{
 		fprintf (stderr, "Error: trying to get frame without successfully initialising camera\n");
 		return ERR;
 	}
 
-	if (!is_released)
+	if (!cam->is_released)
 	{
 		fprintf (stderr, "Error: trying to get another frame without releasing already obtained frame\n");
 		return ERR;
@@ -607,13 +951,13 @@ int helper_get_cam_frame(unsigned char **pointer_to_cam_data, int *size)
 		int r;
 
 		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
+		FD_SET(cam->fd, &fds);
 
 		/* Timeout. */
 		tv.tv_sec = 2;
 		tv.tv_usec = 0;
 
-		r = select(fd + 1, &fds, NULL, NULL, &tv);
+		r = select(cam->fd + 1, &fds, NULL, NULL, &tv);
 
 		if (-1 == r) {
 			if (EINTR == errno)
@@ -631,10 +975,11 @@ int helper_get_cam_frame(unsigned char **pointer_to_cam_data, int *size)
 			}
 		}
 
-		CLEAR(frame_buf);
-		frame_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		CLEAR(cam->frame_buf);
+		cam->frame_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		cam->frame_buf.memory = memory_type(cam);
 
-		if (-1 == xioctl(fd, VIDIOC_DQBUF, &frame_buf)) {
+		if (-1 == xioctl(cam->fd, VIDIOC_DQBUF, &cam->frame_buf)) {
 			switch (errno) {
 				case EAGAIN:
 					continue;
@@ -648,36 +993,107 @@ int helper_get_cam_frame(unsigned char **pointer_to_cam_data, int *size)
 					continue;
 			}
 		}
-		*pointer_to_cam_data = (unsigned char*) buffers[frame_buf.index].start;
-		*size = frame_buf.bytesused;
+		if (IO_METHOD_DMABUF == cam->io)
+			dmabuf_sync(cam->buffers[cam->frame_buf.index].dmabuf_fd, DMA_BUF_SYNC_START);
+
+		track_dequeue(cam);
+
+		*pointer_to_cam_data = (unsigned char*) cam->buffers[cam->frame_buf.index].start;
+		*size = cam->frame_buf.bytesused;
 		break;
 		/* EAGAIN - continue select loop. */
 	}
 
-	is_released = 0;
+	cam->is_released = 0;
 	return 0;
 }
 
-int helper_release_cam_frame()
+int helper_cam_get_latest_frame(struct helper_cam *cam, unsigned char **pointer_to_cam_data, int *size, unsigned int *skipped)
 {
-	if (!is_initialised)
+	struct v4l2_buffer newer;
+	unsigned int n = 0;
+	int ret = 0;
+
+	if (helper_cam_get_frame(cam, pointer_to_cam_data, size) < 0)
+		return ERR;
+
+	/*
+	 * Keep dequeueing without waiting; each time a newer frame turns up
+	 * the one held so far goes straight back to the driver.
+	 */
+	for (;;) {
+		CLEAR(newer);
+		newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		newer.memory = memory_type(cam);
+
+		if (-1 == xioctl(cam->fd, VIDIOC_DQBUF, &newer))
+			break;	/* EAGAIN: nothing newer is ready */
+
+		if (IO_METHOD_DMABUF == cam->io)
+			dmabuf_sync(cam->buffers[cam->frame_buf.index].dmabuf_fd, DMA_BUF_SYNC_END);
+		if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &cam->frame_buf))
+		{
+			/*
+			 * Dropping the older buffer would shrink the queue for
+			 * good. Keep holding it and hand the newer one back.
+			 */
+			fprintf(stderr, "Error occurred when queueing skipped frame for re-capture\n");
+			if (IO_METHOD_DMABUF == cam->io)
+				dmabuf_sync(cam->buffers[cam->frame_buf.index].dmabuf_fd, DMA_BUF_SYNC_START);
+			/* The newer frame is skipped instead, not dropped. */
+			cam->last_sequence = newer.sequence;
+			cam->stats.frames++;
+			n++;
+			if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &newer))
+			{
+				fprintf(stderr, "Error occurred when queueing frame for re-capture\n");
+				ret = ERR;
+			}
+			break;
+		}
+
+		cam->frame_buf = newer;
+		if (IO_METHOD_DMABUF == cam->io)
+			dmabuf_sync(cam->buffers[cam->frame_buf.index].dmabuf_fd, DMA_BUF_SYNC_START);
+		track_dequeue(cam);
+		n++;
+	}
+
+	cam->stats.skipped += n;
+	*pointer_to_cam_data = (unsigned char*) cam->buffers[cam->frame_buf.index].start;
+	*size = cam->frame_buf.bytesused;
+	if (skipped)
+		*skipped = n;
+	return ret;
+}
+
+int helper_cam_release_frame(struct helper_cam *cam)
+{
+	if (!cam || !cam->is_initialised)
 	{
 		fprintf (stderr, "Error: trying to release frame without successfully initialising camera\n");
 		return ERR;
 	}
 
-	if (is_released)
+	if (cam->is_released)
 	{
 		fprintf (stderr, "Error: trying to release already released frame\n");
 		return ERR;
 	}
 
-	if (-1 == xioctl(fd, VIDIOC_QBUF, &frame_buf))
+	if (IO_METHOD_DMABUF == cam->io)
+		dmabuf_sync(cam->buffers[cam->frame_buf.index].dmabuf_fd, DMA_BUF_SYNC_END);
+
+	if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &cam->frame_buf))
 	{
 		fprintf(stderr, "Error occurred when queueing frame for re-capture\n");
 		return ERR;
 	}
 
+	if (cam->converted_us)
+		hist_add(&cam->stats.latency[HELPER_LAT_CONVERTED_TO_RELEASE],
+				monotonic_us() - cam->converted_us);
+
 	/*
 	 * We assume the frame hasn't been released if an error occurred as
 	 * we couldn't queue the frame for streaming.
@@ -685,10 +1101,148 @@ int helper_release_cam_frame()
 	 * Assuming it to be released in case an error occurs causes issues
 	 * such as the loss of a buffer, etc.
 	 */
-	is_released = 1;
+	cam->is_released = 1;
 	return 0;
 }
 
+int helper_cam_mark_converted(struct helper_cam *cam)
+{
+	if (!cam || !cam->is_initialised || cam->is_released)
+	{
+		fprintf (stderr, "Error: trying to mark a frame as converted without holding one\n");
+		return ERR;
+	}
+
+	cam->converted_us = monotonic_us();
+	hist_add(&cam->stats.latency[HELPER_LAT_DQBUF_TO_CONVERTED],
+			cam->converted_us - cam->dqbuf_us);
+	return 0;
+}
+
+int helper_cam_get_stats(struct helper_cam *cam, struct helper_cam_stats *stats)
+{
+	if (!cam || !stats)
+		return ERR;
+
+	*stats = cam->stats;
+	return 0;
+}
+
+int helper_cam_reset_stats(struct helper_cam *cam)
+{
+	if (!cam)
+		return ERR;
+
+	CLEAR(cam->stats);
+	cam->seq_valid = 0;
+	return 0;
+}
+
+unsigned long long helper_latency_percentile(const struct helper_latency_hist *hist, double percentile)
+{
+	unsigned long long seen = 0, target;
+	unsigned int i;
+
+	if (!hist || hist->count == 0)
+		return 0;
+
+	target = (unsigned long long) (hist->count * percentile / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HELPER_HIST_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			return 1ULL << i;
+	}
+	return hist->max_us;
+}
+
+int helper_cam_get_frame_fd(struct helper_cam *cam)
+{
+	struct buffer *b;
+
+	if (!cam || !cam->is_initialised || cam->is_released)
+	{
+		fprintf (stderr, "Error: trying to get a dma-buf without holding a frame\n");
+		return ERR;
+	}
+
+	b = &cam->buffers[cam->frame_buf.index];
+
+	if (IO_METHOD_MMAP == cam->io && b->dmabuf_fd < 0)
+	{
+		struct v4l2_exportbuffer expbuf;
+
+		/*
+		 * Export lazily, so MMAP users that never share frames don't
+		 * hold a dma-buf per buffer.
+		 */
+		CLEAR(expbuf);
+		expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		expbuf.index = cam->frame_buf.index;
+		expbuf.flags = O_CLOEXEC | O_RDONLY;
+
+		if (-1 == xioctl(cam->fd, VIDIOC_EXPBUF, &expbuf))
+		{
+			fprintf(stderr, "Error occurred when exporting buffer\n");
+			return ERR;
+		}
+		b->dmabuf_fd = expbuf.fd;
+	}
+
+	if (b->dmabuf_fd < 0)
+	{
+		fprintf(stderr, "Error: I/O method does not support dma-buf sharing\n");
+		return ERR;
+	}
+
+	return b->dmabuf_fd;
+}
+
+/*
+ * Single-device API, kept for existing users. These operate on an
+ * internal handle and are thin wrappers around the helper_cam_* functions.
+ */
+int helper_init_cam(const char* devname, unsigned int width, unsigned int height, unsigned int format, enum io_method io_meth)
+{
+	if (default_cam)
+	{
+		/*
+		 * The single-device API only tracks one camera.
+		 * Use helper_open() to access multiple devices simultaneously.
+		 */
+		fprintf(stderr, "Cannot use helper_init_cam to initialise multiple devices, simultaneously. Use helper_open instead.\n");
+		return ERR;
+	}
+
+	default_cam = helper_open(devname, width, height, format, io_meth, 0);
+	if (!default_cam)
+	{
+		return ERR;
+	}
+
+	return 0;
+}
+
+int helper_deinit_cam()
+{
+	int ret = helper_close(default_cam);
+
+	default_cam = NULL;
+	return ret;
+}
+
+int helper_get_cam_frame(unsigned char **pointer_to_cam_data, int *size)
+{
+	return helper_cam_get_frame(default_cam, pointer_to_cam_data, size);
+}
+
+int helper_release_cam_frame()
+{
+	return helper_cam_release_frame(default_cam);
+}
+
 /**
  * End of public helper functions
  */
@@ -0,0 +1,376 @@
+/*
+ * opencv_v4l2 - bayer.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#define BAYER_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define BAYER_NEON
+#include <arm_neon.h>
+#endif
+
+#include <bayer.hpp>
+#include <stripe_pool.hpp>
+
+/* Rows above and below a tile demosaiced along with it. */
+#define TILE_OVERLAP	2
+
+const char *bayer_demosaic_name(enum bayer_demosaic demosaic) {
+	switch (demosaic) {
+		case BAYER_BILINEAR:
+			return "bilinear";
+		case BAYER_EDGE_AWARE:
+			return "edge-aware";
+		case BAYER_SUPERPIXEL:
+			return "superpixel";
+	}
+	return "unknown";
+}
+
+size_t bayer_row_bytes(enum bayer_packing packing, unsigned int width) {
+	switch (packing) {
+		case BAYER_RAW10:
+		case BAYER_RAW12:
+			return (size_t) width * 2;
+		case BAYER_RAW10P:
+			return (size_t) width * 5 / 4;
+		case BAYER_RAW12P:
+			return (size_t) width * 3 / 2;
+		default:
+			return width;
+	}
+}
+
+unsigned int bayer_row_width(enum bayer_packing packing, size_t bytes) {
+	switch (packing) {
+		case BAYER_RAW10:
+		case BAYER_RAW12:
+			return bytes / 2;
+		case BAYER_RAW10P:
+			return bytes * 4 / 5;
+		case BAYER_RAW12P:
+			return bytes * 2 / 3;
+		default:
+			return bytes;
+	}
+}
+
+/* Right shift taking the samples of a 16-bit packing to 8 bits. */
+static unsigned int word_shift(enum bayer_packing packing) {
+	return BAYER_RAW12 == packing ? 4 : 2;
+}
+
+static void unpack_scalar(const unsigned char *src, unsigned char *dst, unsigned int width,
+	enum bayer_packing packing) {
+	unsigned int x, shift = word_shift(packing);
+
+	switch (packing) {
+		case BAYER_RAW10:
+		case BAYER_RAW12:
+			for (x = 0; x < width; x++)
+				dst[x] = std::min((src[2 * x] | src[2 * x + 1] << 8) >> shift, 255);
+			break;
+		case BAYER_RAW10P:
+			for (x = 0; x < width; x += 4)
+				memcpy(dst + x, src + x / 4 * 5, 4);
+			break;
+		case BAYER_RAW12P:
+			for (x = 0; x < width; x += 2) {
+				dst[x] = src[x / 2 * 3];
+				dst[x + 1] = src[x / 2 * 3 + 1];
+			}
+			break;
+		default:
+			memcpy(dst, src, width);
+			break;
+	}
+}
+
+#ifdef BAYER_X86
+/*
+ * Unpacking is bound by memory bandwidth: SSE already runs ~10x the scalar
+ * code on 16-bit rows, and AVX2 / AVX-512 measured no faster, so they use it.
+ */
+#define TARGET_SSE41	__attribute__((target("sse4.1")))
+
+/*
+ * High bytes of 8 samples each: 10P from 16 bytes at 0 and at 4 of a group
+ * of 20, 12P from 16 bytes at 0 and at 8 of a group of 24. The loads stay
+ * within the 16 samples' bytes, so rows can be unpacked up to their end.
+ */
+static const int8_t mask_10p[2][16] = {
+	{  0,  1,  2,  3,  5,  6,  7,  8, -1, -1, -1, -1, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1, -1, -1, -1, -1,  6,  7,  8,  9, 11, 12, 13, 14 },
+};
+static const int8_t mask_12p[2][16] = {
+	{  0,  1,  3,  4,  6,  7,  9, 10, -1, -1, -1, -1, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1, -1, -1, -1, -1,  4,  5,  7,  8, 10, 11, 13, 14 },
+};
+
+TARGET_SSE41 static unsigned int unpack_sse41(const unsigned char *src, unsigned char *dst,
+	unsigned int width, enum bayer_packing packing) {
+	unsigned int x = 0;
+
+	if (BAYER_RAW10 == packing || BAYER_RAW12 == packing) {
+		__m128i shift = _mm_cvtsi32_si128(word_shift(packing));
+
+		for (; x + 16 <= width; x += 16) {
+			__m128i a = _mm_srl_epi16(_mm_loadu_si128((const __m128i *) (src + 2 * x)), shift);
+			__m128i b = _mm_srl_epi16(_mm_loadu_si128((const __m128i *) (src + 2 * x + 16)), shift);
+
+			_mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(a, b));
+		}
+	} else if (BAYER_RAW10P == packing || BAYER_RAW12P == packing) {
+		const int8_t (*mask)[16] = BAYER_RAW10P == packing ? mask_10p : mask_12p;
+		__m128i m0 = _mm_loadu_si128((const __m128i *) mask[0]);
+		__m128i m1 = _mm_loadu_si128((const __m128i *) mask[1]);
+		unsigned int second = BAYER_RAW10P == packing ? 4 : 8;
+
+		for (; x + 16 <= width; x += 16) {
+			const unsigned char *p = src + bayer_row_bytes(packing, x);
+			__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), m0);
+			__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + second)), m1);
+
+			_mm_storeu_si128((__m128i *) (dst + x), _mm_or_si128(a, b));
+		}
+	}
+	return x;
+}
+#endif
+
+#ifdef BAYER_NEON
+static const uint8_t tbl_10p[2][8] = {
+	{  0,  1,  2,  3,  5,  6,  7,  8 },
+	{  6,  7,  8,  9, 11, 12, 13, 14 },
+};
+static const uint8_t tbl_12p[2][8] = {
+	{  0,  1,  3,  4,  6,  7,  9, 10 },
+	{  4,  5,  7,  8, 10, 11, 13, 14 },
+};
+
+static unsigned int unpack_neon(const unsigned char *src, unsigned char *dst,
+	unsigned int width, enum bayer_packing packing) {
+	unsigned int x = 0;
+
+	if (BAYER_RAW10 == packing || BAYER_RAW12 == packing) {
+		int16x8_t shift = vdupq_n_s16(-(int) word_shift(packing));
+
+		for (; x + 16 <= width; x += 16) {
+			uint16x8_t a = vshlq_u16(vld1q_u16((const uint16_t *) (src + 2 * x)), shift);
+			uint16x8_t b = vshlq_u16(vld1q_u16((const uint16_t *) (src + 2 * x + 16)), shift);
+
+			vst1q_u8(dst + x, vcombine_u8(vqmovn_u16(a), vqmovn_u16(b)));
+		}
+	} else if (BAYER_RAW10P == packing || BAYER_RAW12P == packing) {
+		const uint8_t (*tbl)[8] = BAYER_RAW10P == packing ? tbl_10p : tbl_12p;
+		uint8x8_t t0 = vld1_u8(tbl[0]), t1 = vld1_u8(tbl[1]);
+		unsigned int second = BAYER_RAW10P == packing ? 4 : 8;
+
+		for (; x + 16 <= width; x += 16) {
+			const unsigned char *p = src + bayer_row_bytes(packing, x);
+
+			vst1q_u8(dst + x, vcombine_u8(vqtbl1_u8(vld1q_u8(p), t0),
+						vqtbl1_u8(vld1q_u8(p + second), t1)));
+		}
+	}
+	return x;
+}
+#endif
+
+static void unpack_row(const unsigned char *src, unsigned char *dst, unsigned int width,
+	enum bayer_packing packing, enum yuv_isa isa) {
+	unsigned int done = 0;
+
+	switch (isa) {
+#ifdef BAYER_X86
+		case YUV_ISA_SSE41:
+		case YUV_ISA_AVX2:
+		case YUV_ISA_AVX512:
+			done = unpack_sse41(src, dst, width, packing);
+			break;
+#endif
+#ifdef BAYER_NEON
+		case YUV_ISA_NEON:
+			done = unpack_neon(src, dst, width, packing);
+			break;
+#endif
+		default:
+			break;
+	}
+	unpack_scalar(src + bayer_row_bytes(packing, done), dst + done, width - done, packing);
+}
+
+static enum yuv_isa resolve_isa(enum yuv_isa isa) {
+	if (YUV_ISA_AUTO == isa || !yuv_isa_supported(isa))
+		return yuv_best_isa();
+	return isa;
+}
+
+void bayer_unpack_row(const unsigned char *src, unsigned char *dst, unsigned int width,
+	enum bayer_packing packing, enum yuv_isa isa) {
+	unpack_row(src, dst, width, packing, resolve_isa(isa));
+}
+
+/*
+ * OpenCV names Bayer patterns after the second and third samples of the
+ * second row, V4L2 after the top-left cell: V4L2 RGGB is OpenCV's BG.
+ */
+static int demosaic_code(enum bayer_order order, enum bayer_demosaic demosaic) {
+	static const int bilinear[] = {
+		cv::COLOR_BayerBG2BGR, cv::COLOR_BayerRG2BGR, cv::COLOR_BayerGB2BGR, cv::COLOR_BayerGR2BGR,
+	};
+	static const int edge_aware[] = {
+		cv::COLOR_BayerBG2BGR_EA, cv::COLOR_BayerRG2BGR_EA, cv::COLOR_BayerGB2BGR_EA,
+		cv::COLOR_BayerGR2BGR_EA,
+	};
+
+	return BAYER_EDGE_AWARE == demosaic ? edge_aware[order] : bilinear[order];
+}
+
+/* Bilinear or edge-aware demosaicing of the row pairs in 'range'. */
+class DemosaicTiles : public cv::ParallelLoopBody {
+	private:
+		const cv::Mat &raw;
+		cv::Mat &dst;
+		cv::Mat &scratch;
+		enum bayer_packing packing;
+		int code;
+		enum yuv_isa isa;
+
+	public:
+		DemosaicTiles(const cv::Mat &raw_, cv::Mat &dst_, cv::Mat &scratch_,
+			enum bayer_packing packing_, int code_, enum yuv_isa isa_) :
+			raw(raw_), dst(dst_), scratch(scratch_), packing(packing_), code(code_), isa(isa_) {}
+
+		void operator()(const cv::Range &range) const {
+			int r0 = 2 * range.start, r1 = 2 * range.end;
+			int t0 = std::max(0, r0 - TILE_OVERLAP), t1 = std::min(dst.rows, r1 + TILE_OVERLAP);
+			bool whole = 0 == t0 && dst.rows == t1;
+			cv::Mat tile, bgr;
+
+			if (BAYER_RAW8 == packing) {
+				tile = raw.rowRange(t0, t1);
+			} else {
+				/* The whole frame reuses 'scratch'; tiles are small enough to allocate. */
+				cv::Mat &buf = whole ? scratch : tile;
+
+				buf.create(t1 - t0, dst.cols, CV_8UC1);
+				for (int y = t0; y < t1; y++)
+					unpack_row(raw.ptr(y), buf.ptr(y - t0), dst.cols, packing, isa);
+				tile = buf;
+			}
+
+			if (whole) {
+				cv::cvtColor(tile, dst, code);
+				return;
+			}
+			cv::cvtColor(tile, bgr, code);
+			cv::Mat out = dst.rowRange(r0, r1);
+			bgr.rowRange(r0 - t0, r1 - t0).copyTo(out);
+		}
+};
+
+/*
+ * Output rows in 'range' of superpixel binning: 'bin' x 'bin' cells per
+ * output pixel, their samples summed by row parity and column.
+ */
+class SuperpixelTiles : public cv::ParallelLoopBody {
+	private:
+		const cv::Mat &raw;
+		cv::Mat &dst;
+		enum bayer_packing packing;
+		unsigned int width, bin, bin_shift;
+		unsigned int ry, rx;    /* where R is in a cell; B is opposite */
+		enum yuv_isa isa;
+
+	public:
+		SuperpixelTiles(const cv::Mat &raw_, cv::Mat &dst_, enum bayer_order order,
+			enum bayer_packing packing_, unsigned int width_, unsigned int bin_shift_,
+			enum yuv_isa isa_) :
+			raw(raw_), dst(dst_), packing(packing_), width(width_), bin(1U << bin_shift_),
+			bin_shift(bin_shift_), ry(BAYER_BGGR == order || BAYER_GBRG == order),
+			rx(BAYER_BGGR == order || BAYER_GRBG == order), isa(isa_) {}
+
+		void operator()(const cv::Range &range) const {
+			const unsigned int cols = dst.cols * 2 * bin;
+			std::vector<uint16_t> acc(2 * cols);
+			/* Whole rows, as packed groups may straddle the binned width. */
+			std::vector<unsigned char> row(BAYER_RAW8 == packing ? 0 : width);
+			const unsigned int n = 1U << (2 * bin_shift);  /* cells per output pixel */
+
+			for (int oy = range.start; oy < range.end; oy++) {
+				std::fill(acc.begin(), acc.end(), 0);
+				for (unsigned int r = 0; r < 2 * bin; r++) {
+					const unsigned char *p = raw.ptr(oy * 2 * bin + r);
+					uint16_t *a = &acc[(r & 1) * cols];
+
+					if (BAYER_RAW8 != packing) {
+						unpack_row(p, row.data(), width, packing, isa);
+						p = row.data();
+					}
+					for (unsigned int x = 0; x < cols; x++)
+						a[x] += p[x];
+				}
+
+				const uint16_t *cr = &acc[ry * cols], *cb = &acc[(1 - ry) * cols];
+				unsigned char *out = dst.ptr(oy);
+
+				for (int ox = 0; ox < dst.cols; ox++) {
+					unsigned int r = 0, g = 0, b = 0;
+
+					for (unsigned int c = ox * 2 * bin; c < (ox + 1) * 2 * bin; c += 2) {
+						r += cr[c + rx];
+						g += cr[c + 1 - rx] + cb[c + rx];
+						b += cb[c + 1 - rx];
+					}
+					out[3 * ox] = (b + n / 2) >> (2 * bin_shift);
+					out[3 * ox + 1] = (g + n) >> (2 * bin_shift + 1);
+					out[3 * ox + 2] = (r + n / 2) >> (2 * bin_shift);
+				}
+			}
+		}
+};
+
+void bayer_to_bgr(const cv::Mat &raw, cv::Mat &dst, enum bayer_order order,
+	enum bayer_packing packing, enum bayer_demosaic demosaic, unsigned int scale,
+	StripePool *pool, cv::Mat &scratch, enum yuv_isa isa) {
+	bool words = BAYER_RAW10 == packing || BAYER_RAW12 == packing;
+	unsigned int width = words ? raw.cols : bayer_row_width(packing, raw.cols);
+	size_t bytes = bayer_row_bytes(packing, width) * raw.rows;
+
+	CV_Assert(raw.type() == (words ? CV_16UC1 : CV_8UC1) && raw.rows % 2 == 0 && width % 2 == 0);
+	CV_Assert(1 == scale || 2 == scale || 4 == scale || 8 == scale);
+	isa = resolve_isa(isa);
+
+	if (scale > 1 || BAYER_SUPERPIXEL == demosaic) {
+		unsigned int bin_shift = scale > 1 ? (2 == scale ? 0 : (4 == scale ? 1 : 2)) : 0;
+
+		dst.create(raw.rows >> (bin_shift + 1), width >> (bin_shift + 1), CV_8UC3);
+		if (dst.empty())
+			return;
+
+		SuperpixelTiles body(raw, dst, order, packing, width, bin_shift, isa);
+		if (pool)
+			pool->run(cv::Range(0, dst.rows), body, bytes);
+		else
+			body(cv::Range(0, dst.rows));
+		return;
+	}
+
+	dst.create(raw.rows, width, CV_8UC3);
+
+	DemosaicTiles body(raw, dst, scratch, packing, demosaic_code(order, demosaic), isa);
+	if (pool)
+		pool->run(cv::Range(0, raw.rows / 2), body, bytes);
+	else
+		body(cv::Range(0, raw.rows / 2));
+}
@@ -0,0 +1,176 @@
+/*
+ * opencv_v4l2 - buffer_pool.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <buffer_pool.hpp>
+
+#define DEFAULT_HUGEPAGE_SIZE	(2UL << 20)
+
+static size_t read_hugepage_size(void) {
+	size_t size = DEFAULT_HUGEPAGE_SIZE;
+	FILE *meminfo;
+	char line[128];
+	unsigned long kb;
+
+	meminfo = fopen("/proc/meminfo", "r");
+	if (!meminfo)
+		return size;
+	while (fgets(line, sizeof(line), meminfo)) {
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+			size = kb << 10;
+			break;
+		}
+	}
+	fclose(meminfo);
+	return size;
+}
+
+/*
+ * Size of the default hugetlbfs page, which is also the THP size on x86/arm64.
+ * Read once, safely from cameras being brought up in parallel.
+ */
+static size_t hugepage_size(void) {
+	static const size_t size = read_hugepage_size();
+
+	return size;
+}
+
+/*
+ * Anonymous mapping of at least 'size' bytes starting on an 'align' boundary,
+ * so that transparent hugepages can back all of it.
+ */
+static void *map_aligned(size_t size, size_t align) {
+	size_t span = size + align;
+	uintptr_t base, start;
+	void *p;
+
+	p = mmap(NULL, span, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == p)
+		return NULL;
+
+	base = (uintptr_t) p;
+	start = (base + align - 1) & ~(uintptr_t) (align - 1);
+	if (start > base)
+		munmap(p, start - base);
+	if (base + span > start + size)
+		munmap((void *) (start + size), base + span - (start + size));
+	return (void *) start;
+}
+
+/*
+ * Prefers 'node' for the pages of the mapping not faulted in yet. Other nodes
+ * are still used when it runs out of memory.
+ */
+static bool bind_node(void *start, size_t length, int node) {
+	unsigned long mask[4];
+
+	if (node < 0 || node >= (int) (sizeof(mask) * 8))
+		return false;
+	memset(mask, 0, sizeof(mask));
+	mask[node / (sizeof(mask[0]) * 8)] = 1UL << (node % (sizeof(mask[0]) * 8));
+	return 0 == syscall(SYS_mbind, start, length, MPOL_PREFERRED, mask,
+			sizeof(mask) * 8, 0);
+}
+
+int pool_alloc(struct pool_block *blk, size_t size, unsigned int flags, int numa_node) {
+	size_t page_size = getpagesize();
+	size_t huge_size = hugepage_size();
+	void *p = MAP_FAILED;
+	size_t off;
+
+	memset(blk, 0, sizeof(*blk));
+	blk->node = -1;
+
+	if (0 == flags && numa_node < 0) {
+		if (posix_memalign(&blk->start, page_size, size) != 0)
+			return -1;
+		blk->backing = POOL_BACKING_HEAP;
+		return 0;
+	}
+
+	if (flags & POOL_HUGEPAGES) {
+		/* Fails unless hugepages were reserved (vm.nr_hugepages). */
+		blk->map_length = (size + huge_size - 1) & ~(huge_size - 1);
+		p = mmap(NULL, blk->map_length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (MAP_FAILED != p) {
+			blk->backing = POOL_BACKING_HUGETLB;
+		} else {
+			p = map_aligned(blk->map_length, huge_size);
+			if (!p)
+				p = MAP_FAILED;
+#ifdef MADV_HUGEPAGE
+			else if (0 == madvise(p, blk->map_length, MADV_HUGEPAGE))
+				blk->backing = POOL_BACKING_THP;
+#endif
+			else
+				blk->backing = POOL_BACKING_PAGES;
+		}
+	}
+
+	if (MAP_FAILED == p) {
+		blk->map_length = (size + page_size - 1) & ~(page_size - 1);
+		p = mmap(NULL, blk->map_length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == p)
+			return -1;
+		blk->backing = POOL_BACKING_PAGES;
+	}
+	blk->start = p;
+
+	if (numa_node >= 0 && bind_node(p, blk->map_length, numa_node))
+		blk->node = numa_node;
+
+	/*
+	 * Touched after madvise() and mbind(), so the faults already come in
+	 * hugepage sized and from the right node.
+	 */
+	if (flags & POOL_PREFAULT) {
+		size_t stride = POOL_BACKING_HUGETLB == blk->backing ? huge_size : page_size;
+
+		for (off = 0; off < blk->map_length; off += stride)
+			((volatile unsigned char *) p)[off] = 0;
+	}
+
+	/* Mostly limited by RLIMIT_MEMLOCK, which the caller can report. */
+	if (flags & POOL_LOCK)
+		blk->locked = (0 == mlock(p, blk->map_length));
+
+	return 0;
+}
+
+void pool_free(void *start, size_t map_length) {
+	if (!start)
+		return;
+	if (map_length)
+		munmap(start, map_length);
+	else
+		free(start);
+}
+
+const char *pool_backing_name(enum pool_backing backing) {
+	switch (backing) {
+		case POOL_BACKING_HEAP:
+			return "heap";
+		case POOL_BACKING_PAGES:
+			return "base pages";
+		case POOL_BACKING_THP:
+			return "transparent hugepages";
+		case POOL_BACKING_HUGETLB:
+			return "hugetlb pages";
+	}
+	return "unknown";
+}
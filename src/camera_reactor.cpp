@@ -0,0 +1,246 @@
+/*
+ * opencv_v4l2 - camera_reactor.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <camera_reactor.hpp>
+
+#define MAX_EVENTS	16
+/* How often cameras that are switching resolution are checked on, in ms. */
+#define RECONFIG_POLL_MS	5
+
+CameraReactor::CameraReactor(unsigned int n_workers_)
+	: n_workers(n_workers_), running(false) {
+	if (n_workers == 0)
+		n_workers = std::thread::hardware_concurrency();
+	if (n_workers == 0)
+		n_workers = 1;
+}
+
+CameraReactor::~CameraReactor() {
+	stop();
+	if (epfd >= 0)
+		close(epfd);
+	if (wake_fd >= 0)
+		close(wake_fd);
+}
+
+int CameraReactor::arm(CamV4L2 *cam, int op) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = cam;
+
+	if (-1 == epoll_ctl(epfd, op, cam->get_fd(), &ev)) {
+		fprintf(stderr, "cam #%d: error occurred when arming epoll: %s\n",
+				cam->camidx, strerror(errno));
+		return ERR;
+	}
+	return 0;
+}
+
+int CameraReactor::add_camera(CamV4L2 *cam) {
+	if (running) {
+		fprintf(stderr, "Cannot add cameras to a running reactor\n");
+		return ERR;
+	}
+	if (cam->get_fd() < 0) {
+		fprintf(stderr, "cam #%d is not initialised\n", cam->camidx);
+		return ERR;
+	}
+	cams.push_back(cam);
+	return 0;
+}
+
+int CameraReactor::start() {
+	struct epoll_event ev;
+
+	if (running)
+		return 0;
+
+	if (epfd < 0) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (epfd < 0 || wake_fd < 0) {
+			fprintf(stderr, "Error occurred when creating epoll set\n");
+			return ERR;
+		}
+
+		/* A NULL data pointer marks the stop request. */
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev)) {
+			fprintf(stderr, "Error occurred when registering wakeup fd\n");
+			return ERR;
+		}
+	}
+
+	for (size_t i = 0; i < cams.size(); i++) {
+		if (arm(cams[i], EPOLL_CTL_ADD) < 0)
+			return ERR;
+	}
+
+	std::cout << "reactor: " << cams.size() << " camera(s), "
+		<< n_workers << " worker(s)" << std::endl;
+
+	quit_workers = false;
+	running = true;
+	for (unsigned int i = 0; i < n_workers; i++)
+		workers.push_back(std::thread(&CameraReactor::worker_loop, this));
+	poller = std::thread(&CameraReactor::poll_loop, this);
+	return 0;
+}
+
+void CameraReactor::stop() {
+	uint64_t one = 1;
+
+	if (!running)
+		return;
+
+	running = false;
+	if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+		/* The poller also re-checks 'running' on every wakeup. */
+	}
+	poller.join();
+
+	/*
+	 * Workers are only told to quit once the poller is gone, so every
+	 * frame it dequeued gets processed and released.
+	 */
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit_workers = true;
+		cond.notify_all();
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	workers.clear();
+
+	for (size_t i = 0; i < cams.size(); i++)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, cams[i]->get_fd(), NULL);
+}
+
+/*
+ * Whether the device still reports an error, as an event may be stale by the
+ * time it is handled.
+ */
+static bool still_failing(int fd) {
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLERR);
+}
+
+void CameraReactor::poll_loop() {
+	struct epoll_event events[MAX_EVENTS];
+	std::vector<CamV4L2*> reconfiguring;
+
+	while (running) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS,
+				reconfiguring.empty() ? -1 : RECONFIG_POLL_MS);
+
+		/* Pick up cameras again once their new stream is running. */
+		for (size_t i = 0; i < reconfiguring.size(); ) {
+			if (!reconfiguring[i]->is_reconfiguring()) {
+				arm(reconfiguring[i], EPOLL_CTL_MOD);
+				reconfiguring.erase(reconfiguring.begin() + i);
+			} else {
+				i++;
+			}
+		}
+
+		if (-1 == n) {
+			if (EINTR == errno)
+				continue;
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			CamV4L2 *cam = (CamV4L2 *) events[i].data.ptr;
+			int r;
+
+			if (!cam) {
+				uint64_t count;
+
+				/* Stop request; 'running' is re-checked by the loop. */
+				if (read(wake_fd, &count, sizeof(count)) < 0) {
+					/* Already drained. */
+				}
+				continue;
+			}
+
+			if (events[i].events & EPOLLERR) {
+				/*
+				 * The stream is off while a camera switches resolution
+				 * (CamV4L2::helper_change_cam_res); wait for it to return.
+				 */
+				if (cam->is_reconfiguring()) {
+					reconfiguring.push_back(cam);
+					continue;
+				}
+				if (still_failing(cam->get_fd())) {
+					fprintf(stderr, "cam #%d: device error, removing it from the reactor\n",
+							cam->camidx);
+					epoll_ctl(epfd, EPOLL_CTL_DEL, cam->get_fd(), NULL);
+					continue;
+				}
+			}
+
+			r = cam->try_get_frame();
+			if (r == 0) {
+				std::lock_guard<std::mutex> guard(lock);
+				ready.push_back(cam);
+				cond.notify_one();
+			} else if (r > 0) {
+				/* Spurious wakeup, wait for the next buffer. */
+				arm(cam, EPOLL_CTL_MOD);
+			} else {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, cam->get_fd(), NULL);
+			}
+		}
+	}
+}
+
+void CameraReactor::worker_loop() {
+	for (;;) {
+		CamV4L2 *cam;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (!quit_workers && ready.empty())
+				cond.wait(guard);
+			if (ready.empty())
+				return;
+			cam = ready.front();
+			ready.pop_front();
+		}
+
+		if (cam->process_frame() < 0) {
+			fprintf(stderr, "cam #%d: error occurred when processing frame\n",
+					cam->camidx);
+			epoll_ctl(epfd, EPOLL_CTL_DEL, cam->get_fd(), NULL);
+			continue;
+		}
+
+		if (running)
+			arm(cam, EPOLL_CTL_MOD);
+	}
+}
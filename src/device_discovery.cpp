@@ -0,0 +1,276 @@
+/*
+ * opencv_v4l2 - device_discovery.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <device_discovery.hpp>
+
+#define MODE_CACHE_HEADER	"# opencv_v4l2 mode cache v1"
+
+static int xioctl(int fh, unsigned long request, void *arg) {
+	int r;
+
+	do {
+		r = ioctl(fh, request, arg);
+	} while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+/* First line of a sysfs attribute, without the newline. */
+static std::string read_attr(const std::string &path) {
+	std::ifstream in(path.c_str());
+	std::string value;
+
+	std::getline(in, value);
+	return value;
+}
+
+/*
+ * Serial number and firmware revision of the USB device a node belongs to.
+ * The node's 'device' link points at a USB interface; the attributes live in
+ * the USB device directory a level or two above it.
+ */
+static void usb_identity(const char *path, VideoDevice *dev) {
+	const char *name = strrchr(path, '/');
+	char real[PATH_MAX];
+	std::string link, dir;
+
+	link = std::string("/sys/class/video4linux/") + (name ? name + 1 : path) + "/device";
+	if (!realpath(link.c_str(), real))
+		return;
+
+	dir = real;
+	for (int level = 0; level < 4 && dir.size() > 1; level++) {
+		if (access((dir + "/idVendor").c_str(), F_OK) == 0) {
+			dev->serial = read_attr(dir + "/serial");
+			dev->firmware = read_attr(dir + "/bcdDevice");
+			return;
+		}
+		dir = dir.substr(0, dir.rfind('/'));
+	}
+}
+
+int describe_device(int fd, const char *path, VideoDevice *dev) {
+	struct v4l2_capability cap;
+	unsigned int caps;
+
+	memset(&cap, 0, sizeof(cap));
+	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap))
+		return ERR;
+
+	caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+		cap.device_caps : cap.capabilities;
+	if (
+		!(caps & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)) ||
+		!(caps & V4L2_CAP_STREAMING)
+	)
+		return ERR;
+
+	dev->path = path;
+	dev->driver = (const char *) cap.driver;
+	dev->card = (const char *) cap.card;
+	dev->bus_info = (const char *) cap.bus_info;
+	dev->version = cap.version;
+	dev->caps = caps;
+	dev->serial.clear();
+	dev->firmware.clear();
+	usb_identity(path, dev);
+	return 0;
+}
+
+int query_device(const char *path, VideoDevice *dev) {
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+	int ret;
+
+	if (-1 == fd)
+		return ERR;
+	ret = describe_device(fd, path, dev);
+	close(fd);
+	return ret;
+}
+
+static int node_number(const std::string &path) {
+	return atoi(path.c_str() + strlen("/dev/video"));
+}
+
+int discover_devices(std::vector<VideoDevice> &devices) {
+	struct dirent *ent;
+	DIR *dir;
+
+	devices.clear();
+	dir = opendir("/dev");
+	if (!dir) {
+		fprintf(stderr, "Cannot list /dev: %d, %s\n", errno, strerror(errno));
+		return ERR;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		std::string path = std::string("/dev/") + ent->d_name;
+		VideoDevice dev;
+		int n;
+
+		if (sscanf(ent->d_name, "video%d", &n) != 1)
+			continue;
+		/* Nodes in use elsewhere still answer QUERYCAP; others are skipped. */
+		if (query_device(path.c_str(), &dev) == 0)
+			devices.push_back(dev);
+	}
+	closedir(dir);
+
+	std::sort(devices.begin(), devices.end(),
+		[](const VideoDevice &a, const VideoDevice &b) {
+			if (a.bus_info != b.bus_info)
+				return a.bus_info < b.bus_info;
+			return node_number(a.path) < node_number(b.path);
+		});
+	return 0;
+}
+
+int match_device(const std::vector<VideoDevice> &devices, const std::string &name) {
+	for (size_t i = 0; i < devices.size(); i++) {
+		const VideoDevice &dev = devices[i];
+
+		if (
+			(!dev.serial.empty() && dev.serial == name) ||
+			dev.bus_info == name || dev.path == name
+		)
+			return (int) i;
+	}
+	return -1;
+}
+
+std::string ModeCache::key(const VideoDevice &dev) {
+	std::ostringstream os;
+
+	os << dev.driver << '|' << std::hex << dev.version << std::dec << '|'
+		<< dev.card << '|' << dev.firmware << '|' << dev.id();
+	return os.str();
+}
+
+/*
+ * File format: the header line, then for each device a "device\t<key>" line
+ * followed by one "mode\t<fourcc>\t<width>\t<height>\t<num>\t<den>\t<compressed>"
+ * line per mode.
+ */
+int ModeCache::load() {
+	std::lock_guard<std::mutex> guard(lock);
+	std::ifstream in(path.c_str());
+	std::string line, current;
+	unsigned int lineno = 0;
+
+	entries.clear();
+	dirty = false;
+	if (!in)
+		return 0;
+
+	while (std::getline(in, line)) {
+		lineno++;
+		if (1 == lineno) {
+			if (line != MODE_CACHE_HEADER) {
+				fprintf(stderr, "%s: not a mode cache, ignored\n", path.c_str());
+				return ERR;
+			}
+			continue;
+		}
+
+		if (line.compare(0, 7, "device\t") == 0) {
+			current = line.substr(7);
+			entries[current].clear();
+		} else if (line.compare(0, 5, "mode\t") == 0 && !current.empty()) {
+			CameraMode m;
+			unsigned int compressed;
+
+			if (sscanf(line.c_str() + 5, "%x\t%u\t%u\t%u\t%u\t%u", &m.pixelformat,
+					&m.width, &m.height, &m.interval.numerator,
+					&m.interval.denominator, &compressed) != 6) {
+				fprintf(stderr, "%s:%u: malformed mode, cache ignored\n",
+						path.c_str(), lineno);
+				entries.clear();
+				return ERR;
+			}
+			m.compressed = compressed != 0;
+			entries[current].push_back(m);
+		}
+	}
+	return 0;
+}
+
+int ModeCache::save() {
+	std::lock_guard<std::mutex> guard(lock);
+	std::string tmp = path + ".tmp";
+	FILE *out;
+
+	if (!dirty)
+		return 0;
+
+	/* Written to a temporary file and renamed, so readers never see half of it. */
+	out = fopen(tmp.c_str(), "w");
+	if (!out) {
+		fprintf(stderr, "Cannot write %s: %d, %s\n", tmp.c_str(), errno, strerror(errno));
+		return ERR;
+	}
+	fprintf(out, "%s\n", MODE_CACHE_HEADER);
+	for (std::map<std::string, std::vector<CameraMode> >::const_iterator it = entries.begin();
+			it != entries.end(); ++it) {
+		fprintf(out, "device\t%s\n", it->first.c_str());
+		for (size_t i = 0; i < it->second.size(); i++) {
+			const CameraMode &m = it->second[i];
+
+			fprintf(out, "mode\t%08x\t%u\t%u\t%u\t%u\t%u\n", m.pixelformat,
+					m.width, m.height, m.interval.numerator,
+					m.interval.denominator, m.compressed ? 1 : 0);
+		}
+	}
+	if (fclose(out) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+		fprintf(stderr, "Cannot write %s: %d, %s\n", path.c_str(), errno, strerror(errno));
+		unlink(tmp.c_str());
+		return ERR;
+	}
+
+	dirty = false;
+	return 0;
+}
+
+bool ModeCache::lookup(const VideoDevice &dev, std::vector<CameraMode> &modes) const {
+	std::lock_guard<std::mutex> guard(lock);
+	std::map<std::string, std::vector<CameraMode> >::const_iterator it = entries.find(key(dev));
+
+	if (it == entries.end() || it->second.empty())
+		return false;
+	modes = it->second;
+	return true;
+}
+
+void ModeCache::store(const VideoDevice &dev, const std::vector<CameraMode> &modes) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	entries[key(dev)] = modes;
+	dirty = true;
+}
+
+std::string ModeCache::default_path() {
+	const char *dir = getenv("XDG_CACHE_HOME");
+
+	if (dir && *dir)
+		return std::string(dir) + "/opencv_v4l2_modes";
+	dir = getenv("HOME");
+	if (dir && *dir && access((std::string(dir) + "/.cache").c_str(), W_OK) == 0)
+		return std::string(dir) + "/.cache/opencv_v4l2_modes";
+	return "/tmp/opencv_v4l2_modes";
+}
@@ -0,0 +1,87 @@
+/*
+ * opencv_v4l2 - frame_copy.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <opencv2/opencv.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <frame_copy.hpp>
+
+/* Frames smaller than this are copied by the calling thread alone. */
+#define COPY_PARALLEL_MIN	(1UL << 20)
+/* Stripe size, a multiple of the page size so stripes don't share pages. */
+#define COPY_STRIPE		(256UL << 10)
+
+void stream_copy(void *dst, const void *src, size_t n) {
+#if defined(__SSE2__)
+	unsigned char *d = (unsigned char *) dst;
+	const unsigned char *s = (const unsigned char *) src;
+	size_t head = (16 - ((uintptr_t) d & 15)) & 15;
+
+	if (n < 256) {
+		memcpy(dst, src, n);
+		return;
+	}
+
+	/* Streaming stores need an aligned destination. */
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *) s);
+		__m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *) (s + 48));
+
+		_mm_stream_si128((__m128i *) d, a);
+		_mm_stream_si128((__m128i *) (d + 16), b);
+		_mm_stream_si128((__m128i *) (d + 32), c);
+		_mm_stream_si128((__m128i *) (d + 48), e);
+	}
+	memcpy(d, s, n);
+
+	/* Make the streamed data visible before the frame is handed out. */
+	_mm_sfence();
+#else
+	memcpy(dst, src, n);
+#endif
+}
+
+class CopyStripes : public cv::ParallelLoopBody {
+	private:
+		unsigned char *dst;
+		const unsigned char *src;
+		size_t n;
+
+	public:
+		CopyStripes(void *dst_, const void *src_, size_t n_)
+			: dst((unsigned char *) dst_), src((const unsigned char *) src_), n(n_) {}
+
+		void operator()(const cv::Range &range) const {
+			size_t begin = range.start * COPY_STRIPE;
+			size_t end = (size_t) range.end * COPY_STRIPE;
+
+			if (end > n)
+				end = n;
+			stream_copy(dst + begin, src + begin, end - begin);
+		}
+};
+
+void copy_frame(void *dst, const void *src, size_t n) {
+	if (n < COPY_PARALLEL_MIN) {
+		stream_copy(dst, src, n);
+		return;
+	}
+
+	cv::parallel_for_(cv::Range(0, (n + COPY_STRIPE - 1) / COPY_STRIPE),
+			CopyStripes(dst, src, n));
+}
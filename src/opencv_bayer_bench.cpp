@@ -0,0 +1,221 @@
+/*
+ * opencv_v4l2 - opencv_bayer_bench.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+/*
+ * Checks and times raw Bayer unpacking and demosaicing (see bayer.hpp). No
+ * camera is needed.
+ *
+ * 1. Unpacking: a random frame of 12-bit samples is stored in every packing
+ *    (8-bit, 10 and 12 bits in 16-bit words, MIPI 10P and 12P); each kernel
+ *    the CPU supports must unpack each of them to the same 8-bit frame. Any
+ *    difference makes the exit status non-zero.
+ * 2. Tiles: demosaicing in tiles on a StripePool must give the same frame as
+ *    demosaicing it whole, for each method and preview scale.
+ * 3. Throughput: each packing unpacked and demosaiced by each method, on the
+ *    calling thread (OpenCV's threads demosaic) and on a StripePool of all
+ *    CPUs.
+ *
+ * Usage: opencv-bayer-bench [width height [frames]]
+ */
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <time.h>
+
+#include <bayer.hpp>
+#include <stripe_pool.hpp>
+
+using namespace std;
+using namespace cv;
+
+static const char *packing_names[] = { "raw8", "raw10", "raw12", "raw10p", "raw12p" };
+
+static double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static bool same(const Mat &a, const Mat &b)
+{
+	if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type())
+		return false;
+	for (int y = 0; y < a.rows; y++) {
+		if (memcmp(a.ptr(y), b.ptr(y), a.cols * a.elemSize()))
+			return false;
+	}
+	return true;
+}
+
+/* The frame of 12-bit samples in 'packing', as bayer_to_bgr() takes it. */
+static Mat pack(const Mat &samples, enum bayer_packing packing)
+{
+	bool words = BAYER_RAW10 == packing || BAYER_RAW12 == packing;
+	Mat raw(samples.rows, words ? samples.cols : bayer_row_bytes(packing, samples.cols),
+			words ? CV_16UC1 : CV_8UC1);
+
+	for (int y = 0; y < samples.rows; y++) {
+		const uint16_t *s = samples.ptr<uint16_t>(y);
+		unsigned char *p = raw.ptr(y);
+
+		memset(p, 0, raw.cols * raw.elemSize());
+		for (int x = 0; x < samples.cols; x++) {
+			unsigned int v = s[x];
+
+			switch (packing) {
+				case BAYER_RAW8:
+					p[x] = v >> 4;
+					break;
+				case BAYER_RAW10:
+					((uint16_t *) p)[x] = v >> 2;
+					break;
+				case BAYER_RAW12:
+					((uint16_t *) p)[x] = v;
+					break;
+				case BAYER_RAW10P:
+					p[x / 4 * 5 + x % 4] = v >> 4;
+					p[x / 4 * 5 + 4] |= ((v >> 2) & 3) << (2 * (x % 4));
+					break;
+				case BAYER_RAW12P:
+					p[x / 2 * 3 + x % 2] = v >> 4;
+					p[x / 2 * 3 + 2] |= (v & 15) << (4 * (x % 2));
+					break;
+			}
+		}
+	}
+	return raw;
+}
+
+static bool check_unpack(const Mat &samples)
+{
+	Mat ref = pack(samples, BAYER_RAW8), out(ref.rows, ref.cols, CV_8UC1);
+	bool ok = true;
+
+	cout << "unpacking to 8 bits:" << endl;
+	for (int p = BAYER_RAW8; p <= BAYER_RAW12P; p++) {
+		Mat raw = pack(samples, (bayer_packing) p);
+		string sep = ":";
+
+		cout << "  " << packing_names[p];
+		for (int isa = YUV_ISA_SCALAR; isa < YUV_ISA_COUNT; isa++) {
+			bool exact;
+
+			if (!yuv_isa_supported((yuv_isa) isa))
+				continue;
+			for (int y = 0; y < raw.rows; y++)
+				bayer_unpack_row(raw.ptr(y), out.ptr(y), samples.cols, (bayer_packing) p,
+						(yuv_isa) isa);
+			exact = same(out, ref);
+			ok = ok && exact;
+			cout << sep << " " << yuv_isa_name((yuv_isa) isa) << " "
+				<< (exact ? "exact" : "DIFFERS");
+			sep = ",";
+		}
+		cout << endl;
+	}
+	return ok;
+}
+
+static bool check_tiles(const Mat &samples)
+{
+	Mat raw = pack(samples, BAYER_RAW10P), whole, tiled, scratch;
+	/* With a single thread the pool would run the frame whole. */
+	StripePool pool(max(2U, StripePool().threads()));
+	bool ok = true;
+
+	pool.start();
+	cout << "tiles on " << pool.threads() << " thread(s) against the whole frame:" << endl;
+	for (int d = BAYER_BILINEAR; d <= BAYER_SUPERPIXEL; d++) {
+		cout << "  " << bayer_demosaic_name((bayer_demosaic) d) << ":";
+		for (unsigned int scale = 1; scale <= 8; scale *= 2) {
+			bool exact;
+
+			bayer_to_bgr(raw, whole, BAYER_RGGB, BAYER_RAW10P, (bayer_demosaic) d, scale,
+					NULL, scratch);
+			bayer_to_bgr(raw, tiled, BAYER_RGGB, BAYER_RAW10P, (bayer_demosaic) d, scale,
+					&pool, scratch);
+			exact = same(whole, tiled);
+			ok = ok && exact;
+			cout << " 1/" << scale << " " << (exact ? "exact" : "DIFFERS");
+		}
+		cout << endl;
+	}
+	return ok;
+}
+
+static double time_demosaic(const Mat &raw, enum bayer_packing packing,
+	enum bayer_demosaic demosaic, StripePool *pool, unsigned int frames)
+{
+	Mat bgr, scratch;
+	double t0 = 0;
+
+	/* The first round allocates the output. */
+	for (unsigned int i = 0; i <= frames; i++) {
+		if (1 == i)
+			t0 = now_ms();
+		bayer_to_bgr(raw, bgr, BAYER_RGGB, packing, demosaic, 1, pool, scratch);
+	}
+	return (now_ms() - t0) / frames;
+}
+
+static void compare_throughput(const Mat &samples, unsigned int frames)
+{
+	StripePool pool;
+
+	pool.start();
+	cout << "demosaicing, ms per frame, whole frame / tiles on " << pool.threads()
+		<< " thread(s):" << endl;
+	for (int p = BAYER_RAW8; p <= BAYER_RAW12P; p++) {
+		Mat raw = pack(samples, (bayer_packing) p);
+		string sep = ":";
+
+		cout << "  " << packing_names[p];
+		for (int d = BAYER_BILINEAR; d <= BAYER_SUPERPIXEL; d++) {
+			cout << sep << " " << bayer_demosaic_name((bayer_demosaic) d) << " "
+				<< time_demosaic(raw, (bayer_packing) p, (bayer_demosaic) d, NULL, frames)
+				<< " / "
+				<< time_demosaic(raw, (bayer_packing) p, (bayer_demosaic) d, &pool, frames);
+			sep = ",";
+		}
+		cout << endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int width = 4224, height = 3156, frames = 20;
+	bool ok;
+
+	try {
+		if (argc >= 3) {
+			width = stoi(argv[1]);
+			height = stoi(argv[2]);
+		}
+		if (argc >= 4)
+			frames = stoi(argv[3]);
+	} catch (exception const &ex) {
+		cerr << "Usage: " << argv[0] << " [width height [frames]]" << endl;
+		return EXIT_FAILURE;
+	}
+	if (width == 0 || width % 4 || height == 0 || height % 2 || frames == 0) {
+		cerr << "Usage: " << argv[0] << " [width height [frames]] (width a multiple of 4, even height)" << endl;
+		return EXIT_FAILURE;
+	}
+
+	Mat samples(height, width, CV_16UC1);
+
+	randu(samples, Scalar::all(0), Scalar::all(4096));
+	cout << "best kernel for this CPU: " << yuv_isa_name(yuv_best_isa()) << endl;
+	ok = check_unpack(samples);
+	ok = check_tiles(samples) && ok;
+	compare_throughput(samples, frames);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,124 @@
+/*
+ * opencv_v4l2 - opencv_pool_bench.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+/*
+ * Compares UYVY -> BGR conversion out of capture buffers allocated the default
+ * way (posix_memalign) and through the hugepage pool (set_buffer_pool). No
+ * camera is needed: the buffers are filled by the CPU once, standing in for
+ * the first frames the driver writes, then converted round robin like the
+ * capture loop does.
+ *
+ * Usage: opencv-pool-bench [width height [frames]]
+ */
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include <buffer_pool.hpp>
+
+using namespace std;
+using namespace cv;
+
+#define NUM_BUFFERS	4
+
+static double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct bench_result {
+	double fill_ms;		/* per buffer, includes the page faults */
+	double convert_ms;	/* per frame */
+};
+
+static int run(unsigned int flags, unsigned int width, unsigned int height,
+	unsigned int frames, struct bench_result *res)
+{
+	size_t size = (size_t) width * height * 2;
+	vector<struct pool_block> blocks(NUM_BUFFERS);
+	Mat bgr;
+	double t0;
+	unsigned int i;
+
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		if (pool_alloc(&blocks[i], size, flags) != 0) {
+			cerr << "Out of memory" << endl;
+			return -1;
+		}
+	}
+	cout << "  " << pool_backing_name(blocks[0].backing)
+		<< (blocks[0].locked ? ", locked" : "") << endl;
+
+	t0 = now_ms();
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		Mat uyvy(height, width, CV_8UC2, blocks[i].start);
+
+		randu(uyvy, Scalar::all(0), Scalar::all(255));
+	}
+	res->fill_ms = (now_ms() - t0) / NUM_BUFFERS;
+
+	/* Warm up the destination and OpenCV's own state. */
+	cvtColor(Mat(height, width, CV_8UC2, blocks[0].start), bgr, COLOR_YUV2BGR_UYVY);
+
+	t0 = now_ms();
+	for (i = 0; i < frames; i++) {
+		Mat uyvy(height, width, CV_8UC2, blocks[i % NUM_BUFFERS].start);
+
+		cvtColor(uyvy, bgr, COLOR_YUV2BGR_UYVY);
+	}
+	res->convert_ms = (now_ms() - t0) / frames;
+
+	for (i = 0; i < NUM_BUFFERS; i++)
+		pool_free(blocks[i].start, blocks[i].map_length);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int width = 4224, height = 3156, frames = 200;
+	struct bench_result heap, pool;
+
+	try {
+		if (argc >= 3) {
+			width = stoi(argv[1]);
+			height = stoi(argv[2]);
+		}
+		if (argc >= 4)
+			frames = stoi(argv[3]);
+	} catch (exception const &ex) {
+		cerr << "Usage: " << argv[0] << " [width height [frames]]" << endl;
+		return EXIT_FAILURE;
+	}
+	if (width == 0 || height == 0 || frames == 0) {
+		cerr << "Usage: " << argv[0] << " [width height [frames]]" << endl;
+		return EXIT_FAILURE;
+	}
+
+	cout << width << "x" << height << " UYVY, " << NUM_BUFFERS << " buffers, "
+		<< frames << " frames" << endl;
+
+	cout << "default allocation:" << endl;
+	if (run(0, width, height, frames, &heap) < 0)
+		return EXIT_FAILURE;
+	cout << "pool allocation:" << endl;
+	if (run(POOL_HUGEPAGES | POOL_PREFAULT | POOL_LOCK, width, height, frames, &pool) < 0)
+		return EXIT_FAILURE;
+
+	cout << "first touch per buffer: " << heap.fill_ms << " ms -> "
+		<< pool.fill_ms << " ms" << endl;
+	cout << "conversion per frame:   " << heap.convert_ms << " ms -> "
+		<< pool.convert_ms << " ms ("
+		<< (heap.convert_ms - pool.convert_ms) * 100.0 / heap.convert_ms
+		<< "% faster)" << endl;
+	return EXIT_SUCCESS;
+}
@@ -9,7 +9,13 @@
 #include <iostream>
 #include <sys/time.h>
 #include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <thread>
 #include "v4l2_helper.h"
+#include <triple_buffer.hpp>
+#include <yuv_convert.hpp>
+#include <stripe_pool.hpp>
 
 using namespace std;
 using namespace cv;
@@ -23,6 +29,153 @@ unsigned int GetTickCount()
         return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
+static void print_stats(const struct helper_cam_stats *stats)
+{
+	static const char *names[HELPER_LAT_STAGES] = {
+		"capture -> dqbuf", "dqbuf -> converted", "converted -> release"
+	};
+
+	cout << "frames = " << stats->frames << ", dropped = " << stats->dropped;
+	if (stats->skipped)
+		cout << ", skipped for newer = " << stats->skipped;
+	if (stats->ts_unusable)
+		cout << ", without monotonic timestamp = " << stats->ts_unusable;
+	if (stats->ts_soe)
+		cout << " (start-of-exposure timestamps)";
+	cout << endl;
+
+	for (int i = 0; i < HELPER_LAT_STAGES; i++) {
+		const struct helper_latency_hist *h = &stats->latency[i];
+
+		if (h->count == 0)
+			continue;
+		cout << "    " << names[i] << ": mean " << h->sum_us / h->count
+			<< " us, p50 < " << helper_latency_percentile(h, 50)
+			<< " us, p99 < " << helper_latency_percentile(h, 99)
+			<< " us, max " << h->max_us << " us" << endl;
+	}
+}
+
+/*
+ * Captures and converts frames until an error occurs or 'quit' is set. With
+ * a mailbox, every converted frame is published to it for display. With a
+ * stripe pool, conversion runs on it and its timing is printed with the fps.
+ */
+static void capture_loop(struct helper_cam *cam, unsigned int width, unsigned int height,
+	bool latest, StripePool *pool, TripleBuffer<Mat> *mailbox, atomic<bool> *quit)
+{
+	unsigned int start, end, fps = 0;
+	unsigned char* ptr_cam_frame;
+	int bytes_used;
+	struct helper_cam_stats stats;
+	unsigned long long last_dropped = 0;
+
+	/*
+	 * 1. As we re-use the matrix across loops for increased performance in case of higher resolutions
+	 *    we construct it with the common parameters: rows (height), columns (width), type of data in
+	 *    matrix.
+	 *
+	 *    Re-using the matrix is possible as the resolution of the frame doesn't change dynamically
+	 *    in the middle of obtaining frames from the camera. If resolutions change in the middle we
+	 *    would have to re-construct the matrix accordingly.
+	 *
+	 * 2. Other formats: To use formats other than UYVY the 3rd parameter must be modified accordingly
+	 *    to pass a valid OpenCV array type for the new pixelformat[2].
+	 *
+	 * [2]: https://docs.opencv.org/3.4.2/d3/d63/classcv_1_1Mat.html#a2ec3402f7d165ca34c7fd6e8498a62ca
+	 */
+	int savecnt = 0;
+	Mat yuyv_frame = Mat(height, width, CV_8UC2), preview;
+	start = GetTickCount();
+	while(!quit || !*quit) {
+		/*
+		 * Helper function to access camera data
+		 */
+		if (latest) {
+			if (helper_cam_get_latest_frame(cam, &ptr_cam_frame, &bytes_used, NULL) < 0)
+				break;
+		} else if (helper_cam_get_frame(cam, &ptr_cam_frame, &bytes_used) < 0) {
+			break;
+		}
+
+		/*
+		 * It's easy to re-use the matrix for our case (V4L2 user pointer) by changing the
+		 * member 'data' to point to the data obtained from the V4L2 helper.
+		 */
+		yuyv_frame.data = ptr_cam_frame;
+		if(yuyv_frame.empty()) {
+			cout << "Img load failed" << endl;
+			break;
+		}
+
+		/*
+		 * 1. We do not use the cv::cuda::cvtColor (along with cv::cuda::GpuMat matrices) for color
+		 *    space conversion as cv::cuda::cvtColor does not support color space conversion from
+		 *    UYVY to BGR (at least in OpenCV 3.3.1 and OpenCV 3.4.2).
+		 *
+		 *    The performance might differ for higher resolutions if it did support the color
+		 *    conversion.
+		 *
+		 * 2. The conversion uses the vectorized kernels of yuv_convert, which give the same result
+		 *    as cv::cvtColor(COLOR_YUV2BGR_UYVY) but run faster on a single core. To use formats
+		 *    other than UYVY, call cv::cvtColor with the corresponding color conversion code[3].
+		 *
+		 * [3]: https://docs.opencv.org/3.4.2/d7/d1b/group__imgproc__misc.html#ga4e0972be5de079fed4e3a10e24ef5ef0
+		 */
+		Mat &converted = mailbox ? mailbox->write_slot() : preview;
+
+		if (pool)
+			uyvy_to_bgr(yuyv_frame, converted, *pool);
+		else
+			uyvy_to_bgr(yuyv_frame, converted);
+		helper_cam_mark_converted(cam);
+
+		if (savecnt % 300 == 0) {
+			std::string savepath = "../log/0/";
+			imwrite(savepath + std::to_string(savecnt / 300) + ".png", converted);
+		}
+		savecnt++;
+
+		/*
+		 * Helper function to release camera data. This must be called for every
+		 * call to helper_cam_get_frame()
+		 */
+		if (helper_cam_release_frame(cam) < 0)
+		{
+			break;
+		}
+
+		if (mailbox)
+			mailbox->publish();
+
+		fps++;
+		end = GetTickCount();
+		if ((end - start) >= 1000) {
+			helper_cam_get_stats(cam, &stats);
+			cout << (mailbox ? "capture fps = " : "fps = ") << fps << ", dropped = " << stats.dropped - last_dropped << endl ;
+			last_dropped = stats.dropped;
+			if (pool)
+				pool->print_last_job(cout);
+			fps = 0;
+			start = end;
+		}
+
+		/*
+		 * Releasing the Matrix is not required.
+		 *
+		 * 1. release() is called by default in the destructor.
+		 * 2. The cv::Mat documentation says:
+		 * "If the matrix header points to an external data set (see Mat::Mat),
+		 * the reference counter is NULL, and the method has no effect in this case."
+		 * yuyv_frame.release();
+		 */
+	}
+
+	/* Also stops the display loop when capture fails. */
+	if (quit)
+		*quit = true;
+}
+
 /*
  * Other formats: To use pixel formats other than UYVY, see related comments (comments with
  * prefix 'Other formats') in corresponding places.
@@ -32,23 +185,41 @@ int main(int argc, char **argv)
 	unsigned int width, height;
 	static const char* default_videodev = "/dev/video0";
 	const char *videodev;
-	unsigned int start, end, fps = 0;
-	unsigned char* ptr_cam_frame;
-	int bytes_used;
+	struct helper_cam_stats stats;
+	bool latest = false;
+	unique_ptr<StripePool> pool;
 
 	/*
 	 * Re-using the frame matrix(ces) instead of creating new ones (i.e., declaring 'Mat frame'
 	 * (and cuda::GpuMat gpu_frame) outside the 'while (1)' loop instead of declaring it
 	 * within the loop) improves the performance for higher resolutions.
 	 */
-	Mat yuyv_frame, preview;
 #if defined(ENABLE_DISPLAY) && defined(ENABLE_GL_DISPLAY) && defined(ENABLE_GPU_UPLOAD)
 	cuda::GpuMat gpu_frame;
 #endif
 
-	if (argc == 4) {
+	if (argc >= 4 && argc <= 6) {
 		videodev = argv[1];
 
+		/*
+		 * 'latest' always processes the newest frame available, skipping
+		 * the ones that queued up meanwhile, for minimum latency.
+		 * 'stripes' converts each frame in row stripes on a pool of threads
+		 * pinned one per CPU, instead of on the capture thread alone.
+		 */
+		for (int i = 4; i < argc; i++) {
+			string opt = argv[i];
+
+			if (opt == "latest") {
+				latest = true;
+			} else if (opt == "stripes") {
+				pool.reset(new StripePool());
+			} else {
+				cerr << "Unknown option: " << opt << " (expected 'latest' or 'stripes')\n";
+				return EXIT_FAILURE;
+			}
+		}
+
 		/*
 		 * Courtesy: https://stackoverflow.com/a/2797823
 		 */
@@ -73,8 +244,9 @@ int main(int argc, char **argv)
 			return EXIT_FAILURE;
 		}
 	} else {
-		cout << "Note: This program accepts (only) three arguments.\n";
+		cout << "Note: This program accepts three to five arguments.\n";
 		cout << "First arg: device file path, Second arg: width, Third arg: height\n";
+		cout << "Options: 'latest' (skip to the newest frame), 'stripes' (convert on all CPUs)\n";
 		cout << "No arguments given. Assuming default values.\n";
 		cout << "Device file path: " << default_videodev << "; Width: 640; Height: 480\n";
 		videodev = default_videodev;
@@ -95,9 +267,12 @@ int main(int argc, char **argv)
 	 *
 	 * [1]: https://linuxtv.org/downloads/v4l-dvb-apis/uapi/v4l/pixfmt-v4l2.html#c.v4l2_pix_format
 	 */
-	if (helper_init_cam(videodev, width, height, V4L2_PIX_FMT_UYVY, IO_METHOD_USERPTR) < 0) {
+	struct helper_cam *cam = helper_open(videodev, width, height, V4L2_PIX_FMT_UYVY, IO_METHOD_USERPTR, 0);
+	if (!cam) {
 		return EXIT_FAILURE;
 	}
+	if (pool)
+		pool->start();
 
 #ifdef ENABLE_DISPLAY
 	/*
@@ -110,65 +285,23 @@ int main(int argc, char **argv)
 	namedWindow("OpenCV V4L2");
 	#endif
 	cout << "Note: Click 'Esc' key to exit the window.\n";
-#endif
 
 	/*
-	 * 1. As we re-use the matrix across loops for increased performance in case of higher resolutions
-	 *    we construct it with the common parameters: rows (height), columns (width), type of data in
-	 *    matrix.
-	 *
-	 *    Re-using the matrix is possible as the resolution of the frame doesn't change dynamically
-	 *    in the middle of obtaining frames from the camera. If resolutions change in the middle we
-	 *    would have to re-construct the matrix accordingly.
-	 *
-	 * 2. Other formats: To use formats other than UYVY the 3rd parameter must be modified accordingly
-	 *    to pass a valid OpenCV array type for the new pixelformat[2].
-	 *
-	 * [2]: https://docs.opencv.org/3.4.2/d3/d63/classcv_1_1Mat.html#a2ec3402f7d165ca34c7fd6e8498a62ca
+	 * imshow() and waitKey() take far longer than a frame period at high
+	 * resolutions, so the display loop runs here on the main thread and
+	 * capture / conversion on a thread of their own. The converted frames
+	 * go through a triple-buffered mailbox: capture always writes a free
+	 * slot, display always shows the latest complete one, and neither waits
+	 * for the other. Frames that arrive faster than they can be shown are
+	 * simply not displayed, rather than holding up capture.
 	 */
-	int savecnt = 0;
-	yuyv_frame = Mat(height, width, CV_8UC2);
-	start = GetTickCount();
-	while(1) {
-		/*
-		 * Helper function to access camera data
-		 */
-		if (helper_get_cam_frame(&ptr_cam_frame, &bytes_used) < 0) {
-			break;
-		}
-
-		/*
-		 * It's easy to re-use the matrix for our case (V4L2 user pointer) by changing the
-		 * member 'data' to point to the data obtained from the V4L2 helper.
-		 */
-		yuyv_frame.data = ptr_cam_frame;
-		if(yuyv_frame.empty()) {
-			cout << "Img load failed" << endl;
-			break;
-		}
-
-		/*
-		 * 1. We do not use the cv::cuda::cvtColor (along with cv::cuda::GpuMat matrices) for color
-		 *    space conversion as cv::cuda::cvtColor does not support color space conversion from
-		 *    UYVY to BGR (at least in OpenCV 3.3.1 and OpenCV 3.4.2).
-		 *
-		 *    The performance might differ for higher resolutions if it did support the color
-		 *    conversion.
-		 *
-		 * 2. Other formats: To use formats other than UYVY, the third parameter of cv::cvtColor must
-		 *    be modified to the corresponding color converison code[3].
-		 *
-		 * [3]: https://docs.opencv.org/3.4.2/d7/d1b/group__imgproc__misc.html#ga4e0972be5de079fed4e3a10e24ef5ef0
-		 */
-		cvtColor(yuyv_frame, preview, COLOR_YUV2BGR_UYVY);
-		
-		if (savecnt % 300 == 0) {
-			std::string savepath = "../log/0/";
-			imwrite(savepath + std::to_string(savecnt / 300) + ".png", preview);
-		}
-		savecnt++;
+	TripleBuffer<Mat> mailbox;
+	atomic<bool> quit(false);
+	thread capture(capture_loop, cam, width, height, latest, pool.get(), &mailbox, &quit);
+	unsigned int start = GetTickCount(), end, shown = 0;
 
-#ifdef ENABLE_DISPLAY
+	while (!quit) {
+		if (mailbox.take_latest()) {
 	/*
 	 * It is possible to use a GpuMat for display (imshow) only
 	 * when window is created with OpenGL support. So,
@@ -177,53 +310,40 @@ int main(int argc, char **argv)
 	 * Ref: https://docs.opencv.org/3.4.2/d7/dfc/group__highgui.html#ga453d42fe4cb60e5723281a89973ee563
 	 */
 	#if (defined ENABLE_GL_DISPLAY) && (defined ENABLE_GPU_UPLOAD)
-		/*
-		 * Uploading the frame matrix to a cv::cuda::GpuMat and using it to display (via cv::imshow) also
-		 * contributes to better and consistent performance.
-		 */
-		gpu_frame.upload(preview);
-		imshow("OpenCV V4L2", gpu_frame);
+			/*
+			 * Uploading the frame matrix to a cv::cuda::GpuMat and using it to display (via cv::imshow) also
+			 * contributes to better and consistent performance.
+			 */
+			gpu_frame.upload(mailbox.read_slot());
+			imshow("OpenCV V4L2", gpu_frame);
 	#else
-		imshow("OpenCV V4L2", preview);
+			imshow("OpenCV V4L2", mailbox.read_slot());
 	#endif
-#endif
-
-		/*
-		 * Helper function to release camera data. This must be called for every
-		 * call to helper_get_cam_frame()
-		 */
-		if (helper_release_cam_frame() < 0)
-		{
-			break;
+			shown++;
 		}
 
-#ifdef ENABLE_DISPLAY
-		if(waitKey(1) == 27) break;
-#endif
+		if(waitKey(1) == 27) quit = true;
 
-		fps++;
 		end = GetTickCount();
 		if ((end - start) >= 1000) {
-			cout << "fps = " << fps << endl ;
-			fps = 0;
+			cout << "display fps = " << shown << endl;
+			shown = 0;
 			start = end;
 		}
+	}
+	capture.join();
+#else
+	capture_loop(cam, width, height, latest, pool.get(), NULL, NULL);
+#endif
 
-		/*
-		 * Releasing the Matrix is not required.
-		 *
-		 * 1. release() is called by default in the destructor.
-		 * 2. The cv::Mat documentation says:
-		 * "If the matrix header points to an external data set (see Mat::Mat),
-		 * the reference counter is NULL, and the method has no effect in this case."
-		 * yuyv_frame.release();
-		 */
+	if (helper_cam_get_stats(cam, &stats) == 0) {
+		print_stats(&stats);
 	}
 
 	/*
 	 * Helper function to free allocated resources and close the camera device.
 	 */
-	if (helper_deinit_cam() < 0)
+	if (helper_close(cam) < 0)
 	{
 		return EXIT_FAILURE;
 	}
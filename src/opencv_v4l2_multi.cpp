@@ -10,46 +10,179 @@
 #include <vector>
 #include <sys/time.h>
 #include <cstdlib>
+#include <memory>
+#include <thread>
+#include <sstream>
 // #include "v4l2_helper.h"
 #include <v4l2_util.hpp>
+#include <device_discovery.hpp>
+#include <stripe_pool.hpp>
+#include <pixel_format.hpp>
+#ifdef ENABLE_REACTOR
+#include <camera_reactor.hpp>
+#endif
 
 using namespace std;
 using namespace cv;
 
 
+/* Frames the 'ring' option lets queue up between capture and processing. */
+#define RING_CAPACITY	2
+
+/* Options given after width and height. */
+struct cam_options {
+	string placement;	/* "pin", "rt" or empty */
+	bool copy_out = false;
+	bool latest = false;
+	bool ring = false;
+	unsigned int scale = 1;	/* preview downscaling factor */
+	enum bayer_demosaic demosaic = BAYER_BILINEAR;
+	vector<__u32> formats;	/* in order of preference; empty for the cheapest */
+	StripePool *pool = NULL;	/* shared by all cameras, for 'stripes' */
+	vector<string> devices;	/* serial numbers, bus_info or paths; empty for any */
+	ModeCache *mode_cache = NULL;
+};
+
 int init_cam(int camidx, CamV4L2* device, 
 	const char* devname, int width, int height, 
-	bool enable_display_) {
+	bool enable_display_, const cam_options &opts) {
 	const char *videodev;
 	videodev = devname;
+	const string &placement = opts.placement;
+
+	/*
+	 * 'pin' keeps each camera thread on a CPU of its own (CPU 0 is left
+	 * to interrupts when there are enough), 'rt' also makes it SCHED_FIFO
+	 * so background load can't preempt capture.
+	 */
+	if (placement == "pin" || placement == "rt") {
+		ThreadPlacement pl;
+		int ncpus = thread::hardware_concurrency();
+
+		if (ncpus < 1)
+			ncpus = 1;
+		pl.cpus.push_back(ncpus > 1 ? 1 + camidx % (ncpus - 1) : 0);
+		if (placement == "rt") {
+			pl.policy = SCHED_FIFO;
+			pl.priority = 50;
+		}
+		device->set_thread_placement(pl);
+	}
+
+	/*
+	 * 'copy' requeues every buffer as soon as it is copied, rather than
+	 * after conversion, to compare the copy against buffer starvation.
+	 */
+	device->set_copy_out(opts.copy_out);
+	/* 'latest' skips frames that queued up while the last one was processed. */
+	device->set_latest_frame(opts.latest);
+	/* 'scale=N' converts straight to a 1/N size preview. */
+	if (device->set_preview_scale(opts.scale) < 0)
+		return EXIT_FAILURE;
+	device->set_stripe_pool(opts.pool);
+	/* 'demosaic=' picks how raw Bayer frames are turned into BGR. */
+	device->set_demosaic(opts.demosaic);
 
-	if (device->helper_init_cam(camidx, videodev, 
-		width, height, V4L2_PIX_FMT_UYVY, IO_METHOD_USERPTR, enable_display_) < 0) {
+	/*
+	 * Large frames are converted faster out of hugepages. Falls back to
+	 * ordinary pages when none are available.
+	 */
+	device->set_buffer_pool(POOL_HUGEPAGES | POOL_PREFAULT | POOL_LOCK);
+
+	/*
+	 * The size is picked from the modes the camera lists, at its highest
+	 * frame rate; those come from the mode cache once the camera was seen.
+	 * 'fmt=any' leaves the list empty, so select_mode() ranks the formats
+	 * with PixelFormatTraits by cost and skips all others (MJPEG, RGB...);
+	 * 'fmt=NAME,...' takes the first of the named ones the camera offers.
+	 */
+	ModeConstraints constraints;
+	constraints.min_width = constraints.max_width = width;
+	constraints.min_height = constraints.max_height = height;
+	constraints.formats = opts.formats;
+	device->set_mode_cache(opts.mode_cache);
+
+	/*
+	 * 'ring' holds up to RING_CAPACITY + 2 frames outside the driver (see
+	 * CamV4L2::start_thread(FrameRing*)): RING_CAPACITY waiting, one being
+	 * written and one being processed. Keep one more for the driver to fill.
+	 */
+	if (device->helper_init_cam(camidx, videodev, constraints,
+		IO_METHOD_USERPTR, enable_display_,
+		opts.ring ? RING_CAPACITY + 3 : 0) < 0) {
 		cout << "video #" << camidx << " not initialized properly" << endl;
 		return EXIT_FAILURE;
 	}
-	else {
-		return 0;
+
+	/*
+	 * Bring-up ends with the first frame, so that the camera is known to
+	 * stream and its time to first frame is measured. The frame is dropped.
+	 */
+	unsigned char *data;
+	int size;
+	if (device->helper_get_cam_frame(&data, &size) != 0 ||
+		device->helper_release_cam_frame() < 0) {
+		cout << "video #" << camidx << " delivered no frame" << endl;
+		device->helper_deinit_cam();
+		return EXIT_FAILURE;
 	}
+	return 0;
 }
 
 /*
- * Other formats: To use pixel formats other than UYVY, see related comments (comments with
- * prefix 'Other formats') in corresponding places.
+ * Processing side of the 'ring' option: converts the frames the capture
+ * thread publishes, on a thread of its own, until the ring is closed.
+ */
+static void process_ring(int camidx, FrameRing *ring, const PixelFormatOps *ops,
+	ConvertParams params)
+{
+	Mat preview, scratch;
+	unsigned int start = 0, fps = 0;
+	uint64_t last_overwritten = 0;
+
+	for (;;) {
+		FrameSlot *slot = ring->acquire(100);
+		struct timeval tv;
+		unsigned int now;
+
+		if (!slot) {
+			if (ring->is_closed())
+				break;
+			continue;
+		}
+		ops->to_bgr(slot->planes, preview, params, scratch);
+		ring->release();
+
+		fps++;
+		gettimeofday(&tv, NULL);
+		now = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		if (now - start >= 1000) {
+			if (start)
+				cout << "cam #" << camidx << ": processed fps = " << fps
+					<< ", overwritten = " << ring->overwritten() - last_overwritten << endl;
+			last_overwritten = ring->overwritten();
+			fps = 0;
+			start = now;
+		}
+	}
+}
+
+/*
+ * Other formats: The 'fmt=' option picks any format with PixelFormatTraits (see
+ * pixel_format.hpp); UYVY is the default.
  */
 int main(int argc, char **argv)
 {
-	vector<const char*> devname_list;
-	devname_list.push_back("/dev/video0");
-	// devname_list.push_back("/dev/video1");	// seems to be broken
-	devname_list.push_back("/dev/video2");
-	devname_list.push_back("/dev/video3");
-	devname_list.push_back("/dev/video4");
-	devname_list.push_back("/dev/video5");
+	vector<string> devname_list;
+	vector<VideoDevice> found;
 
 	bool enable_display = false;	
 	int N;
 	unsigned int width, height;
+	cam_options opts;
+	unique_ptr<StripePool> stripe_pool;
+
+	opts.formats.push_back(V4L2_PIX_FMT_UYVY);
 
 #ifdef ENABLE_DISPLAY
 	enable_display = true;
@@ -59,7 +192,7 @@ int main(int argc, char **argv)
 // 	vector<cuda::GpuMat> gpu_frame(N);
 // #endif
 
-	if (argc == 4) {
+	if (argc >= 4 && argc <= 13) {
 		string N_str = argv[1];
 		string width_str = argv[2];
 		string height_str = argv[3];
@@ -86,22 +219,188 @@ int main(int argc, char **argv)
 			cerr << "Width or Height out of range\n";
 			return EXIT_FAILURE;
 		}
+
+		for (int i = 4; i < argc; i++) {
+			string opt = argv[i];
+
+			if (opt == "pin" || opt == "rt") {
+				opts.placement = opt;
+			} else if (opt == "copy") {
+				opts.copy_out = true;
+			} else if (opt == "latest") {
+				opts.latest = true;
+			} else if (opt == "ring") {
+				opts.ring = true;
+			} else if (opt == "stripes") {
+				stripe_pool.reset(new StripePool());
+				opts.pool = stripe_pool.get();
+			} else if (opt.compare(0, 6, "scale=") == 0) {
+				opts.scale = atoi(opt.c_str() + 6);
+				if (opts.scale != 1 && opts.scale != 2 && opts.scale != 4 && opts.scale != 8) {
+					cerr << "Invalid preview scale: " << opt.substr(6) << " (expected 1, 2, 4 or 8)\n";
+					return EXIT_FAILURE;
+				}
+			} else if (opt.compare(0, 4, "fmt=") == 0) {
+				stringstream names(opt.substr(4));
+				string name;
+
+				/* An empty list lets mode selection rank all of them. */
+				opts.formats.clear();
+				while (opt != "fmt=any" && getline(names, name, ',')) {
+					const PixelFormatOps *ops = find_pixel_format(name.c_str());
+
+					if (!ops) {
+						cerr << "Unknown pixel format: " << name << " (expected";
+						for (size_t f = 0; f < pixel_formats().size(); f++)
+							cerr << (f ? ", " : " ") << pixel_formats()[f].name;
+						cerr << " or any)\n";
+						return EXIT_FAILURE;
+					}
+					opts.formats.push_back(ops->fourcc);
+				}
+			} else if (opt.compare(0, 9, "demosaic=") == 0) {
+				string method = opt.substr(9);
+
+				if (method == "bilinear") {
+					opts.demosaic = BAYER_BILINEAR;
+				} else if (method == "ea") {
+					opts.demosaic = BAYER_EDGE_AWARE;
+				} else if (method == "superpixel") {
+					opts.demosaic = BAYER_SUPERPIXEL;
+				} else {
+					cerr << "Invalid demosaic method: " << method << " (expected bilinear, ea or superpixel)\n";
+					return EXIT_FAILURE;
+				}
+			} else if (opt.compare(0, 4, "dev=") == 0) {
+				stringstream names(opt.substr(4));
+				string name;
+
+				while (getline(names, name, ','))
+					opts.devices.push_back(name);
+			} else {
+				cerr << "Unknown option: " << opt << " (expected 'pin', 'rt', 'copy', 'latest', 'ring', 'stripes', 'scale=', 'fmt=', 'demosaic=' or 'dev=')\n";
+				return EXIT_FAILURE;
+			}
+		}
 	} else {
-		cout << "Note: This program accepts (only) three arguments.\n";
-		cout << "First arg: device file path, Second arg: width, Third arg: height\n";
+		cout << "Note: This program accepts three to twelve arguments.\n";
+		cout << "First arg: number of cameras, Second arg: width, Third arg: height\n";
+		cout << "Options: 'pin' (one CPU per camera) or 'rt' (also SCHED_FIFO), 'copy' (copy-out mode),\n";
+		cout << "'latest' (skip to the newest frame), 'ring' (separate capture and processing threads),\n";
+		cout << "'stripes' (convert in row stripes on all CPUs), 'scale=2|4|8' (preview at 1/2, 1/4 or 1/8 size),\n";
+		cout << "'fmt=NAME,NAME,...|any' (pixel formats to prefer, e.g. yuyv,nv12; any: the cheapest to convert),\n";
+		cout << "'dev=ID,ID,...' (cameras by serial number, bus_info or device path),\n";
+		cout << "'demosaic=bilinear|ea|superpixel' (for raw Bayer)\n";
 		cout << "No arguments given. Assuming default values. Width: 640; Height: 480\n";
 		N = 1;
 		width = 640;
 		height = 480;
 	}
 
+	/*
+	 * Cameras are found by probing the /dev/video* nodes, so device numbers
+	 * and nodes that can't capture (e.g. UVC metadata nodes) don't matter.
+	 * 'dev=' picks cameras by serial number or the port they are on.
+	 */
+	if (discover_devices(found) < 0) {
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < found.size(); i++) {
+		cout << found[i].path << ": " << found[i].card << " (" << found[i].bus_info;
+		if (!found[i].serial.empty())
+			cout << ", serial " << found[i].serial;
+		cout << ")" << endl;
+	}
+	if (!opts.devices.empty()) {
+		bool missing = false;
+
+		for (size_t i = 0; i < opts.devices.size(); i++) {
+			int match = match_device(found, opts.devices[i]);
+
+			if (match < 0) {
+				cerr << "No capture device matches " << opts.devices[i] << endl;
+				missing = true;
+			} else {
+				devname_list.push_back(found[match].path);
+			}
+		}
+		if (missing) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		for (size_t i = 0; i < found.size(); i++)
+			devname_list.push_back(found[i].path);
+	}
+	if ((int) devname_list.size() < N) {
+		cerr << N << " camera(s) requested, " << devname_list.size() << " available" << endl;
+		return EXIT_FAILURE;
+	}
+
+	/* Warm starts take the modes from here instead of probing them. */
+	ModeCache mode_cache(ModeCache::default_path());
+	mode_cache.load();
+	opts.mode_cache = &mode_cache;
+
 	vector<CamV4L2> multicam;
 	multicam.resize(N);
+
+	/*
+	 * Each camera is brought up on a thread of its own: open, format
+	 * negotiation, buffer allocation and STREAMON mostly wait on the driver
+	 * and take hundreds of ms per camera. Failures are collected and
+	 * reported together once all of them are done.
+	 */
+	vector<int> init_status(N, 0);
+	vector<thread> initializers;
+	struct timeval init_start, init_end;
+
+	gettimeofday(&init_start, NULL);
+	for (int idx = 0; idx < N; idx++) {
+		const char *devname = devname_list.at(idx).c_str();
+
+		initializers.push_back(thread([&, idx, devname] {
+			init_status[idx] = init_cam(idx, &multicam.at(idx), devname,
+					width, height, enable_display, opts);
+		}));
+	}
+	for (size_t i = 0; i < initializers.size(); i++) {
+		initializers[i].join();
+	}
+	gettimeofday(&init_end, NULL);
+	mode_cache.save();
+
+	int init_failed = 0;
 	for (int idx = 0; idx < N; idx++) {
-		init_cam(idx, &multicam.at(idx), devname_list.at(idx), width, height, enable_display);
+		if (init_status[idx] != 0) {
+			cerr << "Camera #" << idx << " (" << devname_list.at(idx) << ") failed to start" << endl;
+			init_failed++;
+		} else {
+			multicam.at(idx).get_startup_timing().print(cout, idx);
+		}
+	}
+	cout << N - init_failed << " of " << N << " camera(s) started in "
+		<< (init_end.tv_sec - init_start.tv_sec) * 1000.0 +
+		   (init_end.tv_usec - init_start.tv_usec) / 1000.0 << " ms" << endl;
+	if (init_failed) {
+		/*
+		 * Failed cameras are already closed: helper_init_cam() undoes a
+		 * partial bring-up itself and init_cam() de-initialises a camera
+		 * that delivered no frame. Only the ones that started are left.
+		 */
+		for (int idx = 0; idx < N; idx++) {
+			if (init_status[idx] == 0)
+				multicam.at(idx).helper_deinit_cam();
+		}
+		return EXIT_FAILURE;
 	}
 
-	cout << "Initialized Cameras 0~5" << endl;
+	/*
+	 * With 'stripes', every camera converts its frames in row stripes on
+	 * one pool of threads pinned to a CPU each, instead of on its own
+	 * thread alone.
+	 */
+	if (stripe_pool)
+		stripe_pool->start();
 
 // #ifdef ENABLE_DISPLAY
 // 	/*
@@ -120,13 +419,64 @@ int main(int argc, char **argv)
 // 	cout << "Note: Click 'Esc' key to exit the window.\n";
 // #endif
 
+#ifdef ENABLE_REACTOR
+	/*
+	 * All cameras are serviced by one epoll thread which hands the dequeued
+	 * frames to a pool of workers, instead of one blocking thread per camera.
+	 */
+	CameraReactor reactor;
+	for (int idx = 0; idx < N; idx++) {
+		reactor.add_camera(&multicam.at(idx));
+	}
+	if (reactor.start() < 0) {
+		return EXIT_FAILURE;
+	}
+#else
+	/*
+	 * With 'ring', each camera thread only captures; the frames are handed
+	 * over through a lock-free ring to a processing thread per camera,
+	 * dropping the oldest when processing falls behind.
+	 */
+	vector<unique_ptr<FrameRing> > rings;
+	vector<thread> processors;
+	vector<const PixelFormatOps *> cam_ops;
+	for (int idx = 0; opts.ring && idx < N; idx++) {
+		cam_ops.push_back(find_pixel_format(multicam.at(idx).current_mode().pixelformat));
+		if (!cam_ops.back()) {
+			cerr << "cam #" << idx << ": no conversion for its pixel format" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+	ConvertParams params;
+
+	params.scale = opts.scale;
+	params.pool = opts.pool;
+	params.demosaic = opts.demosaic;
 	for (int idx = 0; idx < N; idx++) {
-		multicam.at(idx).running = true;
 		// multicam.at(idx).run_thread();
-		multicam.at(idx).start_thread();
+		if (opts.ring) {
+			rings.push_back(unique_ptr<FrameRing>(
+				new FrameRing(RING_CAPACITY, FrameRing::RING_OVERWRITE)));
+			multicam.at(idx).start_thread(rings.back().get());
+			processors.push_back(thread(process_ring, idx, rings.back().get(), cam_ops[idx],
+						params));
+		} else {
+			multicam.at(idx).start_thread();
+		}
 	}
+#endif
 
-	while(waitKey(1) != 27) {
+	bool failed = false;
+	while(!failed && waitKey(1) != 27) {
+#ifndef ENABLE_REACTOR
+		/* A camera that failed shuts the others down too. */
+		for (int idx = 0; idx < N; idx++) {
+			if (!multicam.at(idx).is_running()) {
+				cerr << "Camera #" << idx << " stopped, shutting down" << endl;
+				failed = true;
+			}
+		}
+#endif
 
 // #ifdef ENABLE_DISPLAY
 // 	#if (defined ENABLE_GL_DISPLAY) && (defined ENABLE_GPU_UPLOAD)
@@ -150,10 +500,28 @@ int main(int argc, char **argv)
 // #endif
 	}
 
+#ifdef ENABLE_REACTOR
+	reactor.stop();
+#else
+	/* Wake all the capture threads first, then wait for them. */
+	for (int idx = 0; idx < N; idx++) {
+		multicam.at(idx).request_stop();
+	}
 	for (int idx = 0; idx < N; idx++) {
 		multicam.at(idx).stop_thread();
 	}
+	/* The rings are closed by the capture threads; let them drain. */
+	for (size_t i = 0; i < processors.size(); i++) {
+		processors[i].join();
+	}
+#endif
 	
+	for (int idx = 0; idx < N; idx++) {
+		multicam.at(idx).get_stats().print(cout, idx);
+	}
+	if (stripe_pool)
+		stripe_pool->print_last_job(cout);
+
 	/*
 	 * Helper function to free allocated resources and close the camera device.
 	 */
@@ -161,7 +529,7 @@ int main(int argc, char **argv)
 	for (int idx = 0; idx < N; idx++) {
 		deinit = deinit || (multicam.at(idx).helper_deinit_cam() < 0);
 	}
-	if (deinit) {
+	if (deinit || failed) {
 		return EXIT_FAILURE;
 	}
 
@@ -0,0 +1,279 @@
+/*
+ * opencv_v4l2 - opencv_yuv_bench.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+/*
+ * Checks and times the UYVY -> BGR kernels of yuv_convert against cvtColor.
+ * No camera is needed.
+ *
+ * 1. Bit-exactness: every combination of Y, U and V is converted by each
+ *    kernel the CPU supports, for each matrix and range, and compared with
+ *    the scalar kernel; BT.601 limited range is also compared with
+ *    cvtColor(COLOR_YUV2BGR_UYVY). Any difference makes the exit status
+ *    non-zero.
+ * 2. Throughput: a random frame of the given size is converted repeatedly
+ *    by cvtColor and by each kernel, on one thread and on all of OpenCV's.
+ * 3. Previews: 1/2, 1/4 and 1/8 size BGR frames made in one pass by
+ *    uyvy_to_bgr_scaled() against full-size conversion followed by resize().
+ * 4. Scaling: conversion in row stripes on a StripePool of 1 to N pinned
+ *    threads, with the time the stripes took.
+ *
+ * Usage: opencv-yuv-bench [width height [frames]]
+ */
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <time.h>
+
+#include <yuv_convert.hpp>
+#include <stripe_pool.hpp>
+
+using namespace std;
+using namespace cv;
+
+static const char *matrix_names[] = { "BT.601", "BT.709" };
+static const char *range_names[] = { "limited", "full" };
+
+static double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Pixels differing between two BGR frames. */
+static size_t count_diff(const Mat &a, const Mat &b)
+{
+	size_t n = 0;
+
+	for (int y = 0; y < a.rows; y++) {
+		const unsigned char *pa = a.ptr(y), *pb = b.ptr(y);
+
+		for (int x = 0; x < a.cols * 3; x += 3) {
+			if (pa[x] != pb[x] || pa[x + 1] != pb[x + 1] || pa[x + 2] != pb[x + 2])
+				n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * One row per (U, V) pair; along the row the first luma sample counts up
+ * and the second down, so every Y, U, V combination appears.
+ */
+static Mat all_combinations()
+{
+	Mat uyvy(256 * 256, 512, CV_8UC2);
+
+	for (int row = 0; row < uyvy.rows; row++) {
+		unsigned char *p = uyvy.ptr(row);
+
+		for (int i = 0; i < 256; i++, p += 4) {
+			p[0] = row >> 8;
+			p[1] = i;
+			p[2] = row & 0xff;
+			p[3] = 255 - i;
+		}
+	}
+	return uyvy;
+}
+
+static bool check_exact()
+{
+	Mat uyvy = all_combinations(), ref, out;
+	bool ok = true;
+
+	cout << "bit-exactness over all Y/U/V combinations:" << endl;
+	for (int m = YUV_BT601; m <= YUV_BT709; m++) {
+		for (int r = YUV_RANGE_LIMITED; r <= YUV_RANGE_FULL; r++) {
+			const char *sep = " ";
+
+			cout << "  " << matrix_names[m] << " " << range_names[r] << ":";
+			uyvy_to_bgr(uyvy, ref, (yuv_matrix) m, (yuv_range) r, YUV_ISA_SCALAR);
+
+			if (YUV_BT601 == m && YUV_RANGE_LIMITED == r) {
+				size_t n;
+
+				cvtColor(uyvy, out, COLOR_YUV2BGR_UYVY);
+				n = count_diff(ref, out);
+				cout << sep << "cvtColor " << (n ? to_string(n) + " px differ" : "same");
+				ok = ok && n == 0;
+				sep = ", ";
+			}
+
+			for (int isa = YUV_ISA_SCALAR + 1; isa < YUV_ISA_COUNT; isa++) {
+				size_t n;
+
+				if (!yuv_isa_supported((yuv_isa) isa))
+					continue;
+				uyvy_to_bgr(uyvy, out, (yuv_matrix) m, (yuv_range) r, (yuv_isa) isa);
+				n = count_diff(ref, out);
+				cout << sep << yuv_isa_name((yuv_isa) isa) << " "
+					<< (n ? to_string(n) + " px differ" : "same");
+				ok = ok && n == 0;
+				sep = ", ";
+			}
+			cout << endl;
+		}
+	}
+	return ok;
+}
+
+/* ms per frame for cvtColor (isa < 0) or one of the kernels. */
+static double time_convert(const Mat &uyvy, int isa, unsigned int frames)
+{
+	Mat bgr;
+	double t0;
+
+	/* Warm up the destination and OpenCV's own state. */
+	if (isa < 0)
+		cvtColor(uyvy, bgr, COLOR_YUV2BGR_UYVY);
+	else
+		uyvy_to_bgr(uyvy, bgr, YUV_BT601, YUV_RANGE_LIMITED, (yuv_isa) isa);
+
+	t0 = now_ms();
+	for (unsigned int i = 0; i < frames; i++) {
+		if (isa < 0)
+			cvtColor(uyvy, bgr, COLOR_YUV2BGR_UYVY);
+		else
+			uyvy_to_bgr(uyvy, bgr, YUV_BT601, YUV_RANGE_LIMITED, (yuv_isa) isa);
+	}
+	return (now_ms() - t0) / frames;
+}
+
+static void compare_throughput(unsigned int width, unsigned int height, unsigned int frames)
+{
+	Mat uyvy(height, width, CV_8UC2);
+	int threads = getNumThreads();
+
+	randu(uyvy, Scalar::all(0), Scalar::all(255));
+	cout << "throughput, " << width << "x" << height << ", " << frames
+		<< " frames, ms per frame (1 thread / " << threads << " threads):" << endl;
+
+	for (int isa = -1; isa < YUV_ISA_COUNT; isa++) {
+		double single, all;
+
+		if (isa >= 0 && !yuv_isa_supported((yuv_isa) isa))
+			continue;
+		setNumThreads(1);
+		single = time_convert(uyvy, isa, frames);
+		setNumThreads(threads);
+		all = time_convert(uyvy, isa, frames);
+		cout << "  " << (isa < 0 ? "cvtColor" : yuv_isa_name((yuv_isa) isa))
+			<< ": " << single << " / " << all << endl;
+	}
+}
+
+/* ms per frame for a 1/scale preview, fused or converted then resized. */
+static double time_preview(const Mat &uyvy, unsigned int scale, bool fused, unsigned int frames)
+{
+	Mat bgr, small;
+	double t0 = 0;
+
+	for (unsigned int i = 0; i <= frames; i++) {
+		/* The first round only warms up. */
+		if (1 == i)
+			t0 = now_ms();
+		if (fused) {
+			uyvy_to_bgr_scaled(uyvy, small, scale);
+		} else {
+			uyvy_to_bgr(uyvy, bgr);
+			resize(bgr, small, Size(bgr.cols / scale, bgr.rows / scale), 0, 0, INTER_AREA);
+		}
+	}
+	return (now_ms() - t0) / frames;
+}
+
+static void compare_preview(unsigned int width, unsigned int height, unsigned int frames)
+{
+	Mat uyvy(height, width, CV_8UC2);
+	int threads = getNumThreads();
+
+	randu(uyvy, Scalar::all(0), Scalar::all(255));
+	cout << "previews, ms per frame, fused / convert + resize (1 thread; "
+		<< threads << " threads):" << endl;
+
+	for (unsigned int scale = 2; scale <= 8; scale *= 2) {
+		double fused1, split1, fused, split;
+
+		setNumThreads(1);
+		fused1 = time_preview(uyvy, scale, true, frames);
+		split1 = time_preview(uyvy, scale, false, frames);
+		setNumThreads(threads);
+		fused = time_preview(uyvy, scale, true, frames);
+		split = time_preview(uyvy, scale, false, frames);
+		cout << "  1/" << scale << ": " << fused1 << " / " << split1 << "; "
+			<< fused << " / " << split << endl;
+	}
+}
+
+static void compare_scaling(unsigned int width, unsigned int height, unsigned int frames)
+{
+	Mat uyvy(height, width, CV_8UC2), bgr;
+	unsigned int cpus = StripePool().threads();
+	double single = 0;
+
+	randu(uyvy, Scalar::all(0), Scalar::all(255));
+	cout << "scaling on a stripe pool, ms per frame:" << endl;
+
+	for (unsigned int n = 1; n <= cpus; n++) {
+		StripePool pool(n);
+		vector<StripeTiming> stripes;
+		uint64_t wall_us, busy_us = 0, max_us = 0;
+		double t0, ms;
+
+		pool.start();
+		uyvy_to_bgr(uyvy, bgr, pool);
+		t0 = now_ms();
+		for (unsigned int i = 0; i < frames; i++)
+			uyvy_to_bgr(uyvy, bgr, pool);
+		ms = (now_ms() - t0) / frames;
+		if (1 == n)
+			single = ms;
+
+		pool.last_job(stripes, &wall_us);
+		for (size_t i = 0; i < stripes.size(); i++) {
+			uint64_t us = stripes[i].end_us - stripes[i].start_us;
+
+			busy_us += us;
+			max_us = max(max_us, us);
+		}
+		cout << "  " << n << " thread(s): " << ms << " (x" << single / ms << "), "
+			<< stripes.size() << " stripe(s), stripe mean " << busy_us / stripes.size() / 1000.0
+			<< " / max " << max_us / 1000.0 << endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int width = 4224, height = 3156, frames = 50;
+	bool ok;
+
+	try {
+		if (argc >= 3) {
+			width = stoi(argv[1]);
+			height = stoi(argv[2]);
+		}
+		if (argc >= 4)
+			frames = stoi(argv[3]);
+	} catch (exception const &ex) {
+		cerr << "Usage: " << argv[0] << " [width height [frames]]" << endl;
+		return EXIT_FAILURE;
+	}
+	if (width == 0 || width % 2 || height == 0 || frames == 0) {
+		cerr << "Usage: " << argv[0] << " [width height [frames]] (even width)" << endl;
+		return EXIT_FAILURE;
+	}
+
+	cout << "best kernel for this CPU: " << yuv_isa_name(yuv_best_isa()) << endl;
+	ok = check_exact();
+	compare_throughput(width, height, frames);
+	compare_preview(width, height, frames);
+	compare_scaling(width, height, frames);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,143 @@
+/*
+ * opencv_v4l2 - pixel_format.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <strings.h>
+
+#include <pixel_format.hpp>
+#include <yuv_convert.hpp>
+#include <stripe_pool.hpp>
+
+static cv::Size scaled_size(const cv::Mat &m, unsigned int scale) {
+	return cv::Size(m.cols / scale, m.rows / scale);
+}
+
+void PixelFormatTraits<V4L2_PIX_FMT_UYVY>::to_bgr(const std::vector<cv::Mat> &planes,
+	cv::Mat &bgr, const ConvertParams &params, cv::Mat &) {
+	if (params.pool)
+		uyvy_to_bgr_scaled(planes[0], bgr, params.scale, *params.pool);
+	else
+		uyvy_to_bgr_scaled(planes[0], bgr, params.scale);
+}
+
+/*
+ * YUYV and NV16 are converted row by row through the UYVY kernels; for a
+ * scaled preview the frame is repacked to UYVY first, which costs a pass
+ * over the source but keeps the fused convert-and-downscale kernel.
+ */
+void PixelFormatTraits<V4L2_PIX_FMT_YUYV>::to_bgr(const std::vector<cv::Mat> &planes,
+	cv::Mat &bgr, const ConvertParams &params, cv::Mat &scratch) {
+	if (1 == params.scale) {
+		yuyv_to_bgr(planes[0], bgr, params.pool);
+		return;
+	}
+	yuyv_to_uyvy(planes[0], scratch, params.pool);
+	PixelFormatTraits<V4L2_PIX_FMT_UYVY>::to_bgr(std::vector<cv::Mat>(1, scratch), bgr, params,
+			scratch);
+}
+
+void PixelFormatTraits<V4L2_PIX_FMT_NV16>::to_bgr(const std::vector<cv::Mat> &planes,
+	cv::Mat &bgr, const ConvertParams &params, cv::Mat &scratch) {
+	if (1 == params.scale) {
+		nv16_to_bgr(planes[0], planes[1], bgr, params.pool);
+		return;
+	}
+	nv16_to_uyvy(planes[0], planes[1], scratch, params.pool);
+	PixelFormatTraits<V4L2_PIX_FMT_UYVY>::to_bgr(std::vector<cv::Mat>(1, scratch), bgr, params,
+			scratch);
+}
+
+/* OpenCV's own kernels; they run on its threads rather than the pool. */
+void PixelFormatTraits<V4L2_PIX_FMT_NV12>::to_bgr(const std::vector<cv::Mat> &planes,
+	cv::Mat &bgr, const ConvertParams &params, cv::Mat &scratch) {
+	if (1 == params.scale) {
+		cv::cvtColorTwoPlane(planes[0], planes[1], bgr, cv::COLOR_YUV2BGR_NV12);
+		return;
+	}
+	cv::cvtColorTwoPlane(planes[0], planes[1], scratch, cv::COLOR_YUV2BGR_NV12);
+	cv::resize(scratch, bgr, scaled_size(scratch, params.scale), 0, 0, cv::INTER_AREA);
+}
+
+/* Grey frames are downscaled before they triple in size. */
+void PixelFormatTraits<V4L2_PIX_FMT_GREY>::to_bgr(const std::vector<cv::Mat> &planes,
+	cv::Mat &bgr, const ConvertParams &params, cv::Mat &scratch) {
+	if (1 == params.scale) {
+		cv::cvtColor(planes[0], bgr, cv::COLOR_GRAY2BGR);
+		return;
+	}
+	cv::resize(planes[0], scratch, scaled_size(planes[0], params.scale), 0, 0, cv::INTER_AREA);
+	cv::cvtColor(scratch, bgr, cv::COLOR_GRAY2BGR);
+}
+
+void PixelFormatTraits<V4L2_PIX_FMT_Y16>::to_bgr(const std::vector<cv::Mat> &planes,
+	cv::Mat &bgr, const ConvertParams &params, cv::Mat &scratch) {
+	if (1 == params.scale) {
+		planes[0].convertTo(scratch, CV_8U, 1.0 / 256);
+	} else {
+		cv::resize(planes[0], scratch, scaled_size(planes[0], params.scale), 0, 0, cv::INTER_AREA);
+		scratch.convertTo(scratch, CV_8U, 1.0 / 256);
+	}
+	cv::cvtColor(scratch, bgr, cv::COLOR_GRAY2BGR);
+}
+
+/* Same order as format_cost() in v4l2_util.cpp ranks them. */
+static std::vector<PixelFormatOps> make_table() {
+	std::vector<PixelFormatOps> table;
+
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_GREY> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_UYVY> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_YUYV> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_Y16> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_NV12> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_NV16> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SRGGB8> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SBGGR8> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGRBG8> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGBRG8> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SRGGB10> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SBGGR10> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGRBG10> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGBRG10> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SRGGB12> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SBGGR12> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGRBG12> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGBRG12> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SRGGB10P> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SBGGR10P> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGRBG10P> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGBRG10P> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SRGGB12P> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SBGGR12P> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGRBG12P> >());
+	table.push_back(pixel_format_ops<PixelFormatTraits<V4L2_PIX_FMT_SGBRG12P> >());
+	return table;
+}
+
+const std::vector<PixelFormatOps> &pixel_formats() {
+	static const std::vector<PixelFormatOps> table = make_table();
+
+	return table;
+}
+
+const PixelFormatOps *find_pixel_format(__u32 fourcc) {
+	const std::vector<PixelFormatOps> &table = pixel_formats();
+
+	for (size_t i = 0; i < table.size(); i++) {
+		if (table[i].fourcc == fourcc)
+			return &table[i];
+	}
+	return NULL;
+}
+
+const PixelFormatOps *find_pixel_format(const char *name) {
+	const std::vector<PixelFormatOps> &table = pixel_formats();
+
+	for (size_t i = 0; i < table.size(); i++) {
+		if (0 == strcasecmp(table[i].name, name))
+			return &table[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,273 @@
+/*
+ * opencv_v4l2 - stripe_pool.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+#include <stripe_pool.hpp>
+
+/* Assumed when the L2 size can't be found out. */
+#define DEFAULT_L2_SIZE		(512UL << 10)
+
+static uint64_t monotonic_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* glibc knows it on x86; elsewhere sysfs (e.g. "1024K") does. */
+static size_t read_l2_size() {
+	long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	char buf[32];
+	FILE *f;
+
+	if (size > 0)
+		return size;
+
+	f = fopen("/sys/devices/system/cpu/cpu0/cache/index2/size", "r");
+	if (!f)
+		return DEFAULT_L2_SIZE;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return DEFAULT_L2_SIZE;
+	}
+	fclose(f);
+
+	char *end;
+	size = strtol(buf, &end, 10);
+	if (size <= 0)
+		return DEFAULT_L2_SIZE;
+	if ('K' == *end)
+		size <<= 10;
+	else if ('M' == *end)
+		size <<= 20;
+	return size;
+}
+
+static size_t l2_size() {
+	static const size_t size = read_l2_size();
+
+	return size;
+}
+
+StripePool::StripePool(unsigned int n_threads_, bool pin_)
+	: n_threads(n_threads_), pin(pin_), next_stripe(0), stripes_left(0) {
+	cpu_set_t allowed;
+
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		}
+	}
+	if (n_threads == 0)
+		n_threads = cpus.empty() ? std::thread::hardware_concurrency() : cpus.size();
+	if (n_threads == 0)
+		n_threads = 1;
+}
+
+StripePool::~StripePool() {
+	stop();
+}
+
+int StripePool::start() {
+	if (!workers.empty())
+		return 0;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = false;
+	}
+	/* Worker 0 is whoever calls run(). */
+	for (unsigned int i = 1; i < n_threads; i++)
+		workers.push_back(std::thread(&StripePool::worker_loop, this, i));
+
+	std::cout << "stripe pool: " << n_threads << " thread(s)";
+	if (pin && !cpus.empty() && n_threads > 1) {
+		std::cout << ", workers on CPU ";
+		for (unsigned int i = 1; i < n_threads; i++)
+			std::cout << (i > 1 ? "," : "") << cpus[i % cpus.size()];
+	}
+	std::cout << ", L2 " << (l2_size() >> 10) << " KiB" << std::endl;
+	return 0;
+}
+
+void StripePool::stop() {
+	std::lock_guard<std::mutex> job(run_lock);
+
+	if (workers.empty())
+		return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+		work_cond.notify_all();
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	workers.clear();
+}
+
+unsigned int StripePool::threads() const {
+	return n_threads;
+}
+
+unsigned int StripePool::stripes_for(size_t bytes, int n_rows) const {
+	size_t per_stripe = l2_size() / 2;
+	size_t n = (bytes * 5 / 2 + per_stripe - 1) / per_stripe;
+
+	if (n > n_threads)
+		n = (n + n_threads - 1) / n_threads * n_threads;
+	if (n > (size_t) n_rows)
+		n = n_rows;
+	return n < 1 ? 1 : n;
+}
+
+void StripePool::worker_loop(unsigned int idx) {
+	uint64_t seen = 0;
+
+	/* Pinned quietly; start() prints where the workers went. */
+	if (pin && !cpus.empty()) {
+		cpu_set_t set;
+		int err;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpus[idx % cpus.size()], &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err)
+			fprintf(stderr, "stripe worker %u: cannot pin thread: %s\n", idx, strerror(err));
+	}
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (!quit && generation == seen)
+				work_cond.wait(guard);
+			if (quit)
+				return;
+			seen = generation;
+			active++;
+		}
+
+		work(idx);
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			active--;
+			if (0 == active)
+				done_cond.notify_all();
+		}
+	}
+}
+
+/* Takes stripes of the current job until none are left. */
+void StripePool::work(unsigned int idx) {
+	unsigned int s;
+
+	while ((s = next_stripe.fetch_add(1)) < n_stripes) {
+		StripeTiming &t = timings[s];
+		int len = rows.end - rows.start;
+
+		t.worker = idx;
+		t.cpu = sched_getcpu();
+		t.start_us = monotonic_us() - job_start_us;
+		(*body)(cv::Range(rows.start + (int) ((int64_t) len * s / n_stripes),
+				rows.start + (int) ((int64_t) len * (s + 1) / n_stripes)));
+		t.end_us = monotonic_us() - job_start_us;
+
+		if (stripes_left.fetch_sub(1) == 1) {
+			std::lock_guard<std::mutex> guard(lock);
+			done_cond.notify_all();
+		}
+	}
+}
+
+void StripePool::run(const cv::Range &range, const cv::ParallelLoopBody &body_,
+	size_t bytes, unsigned int stripes) {
+	std::lock_guard<std::mutex> job(run_lock);
+
+	if (0 == stripes)
+		stripes = stripes_for(bytes, range.end - range.start);
+	if (stripes > (unsigned int) (range.end - range.start))
+		stripes = range.end - range.start;
+	if (stripes <= 1 || workers.empty()) {
+		uint64_t t0 = monotonic_us();
+		StripeTiming t;
+
+		body_(range);
+		job_us = monotonic_us() - t0;
+		t.worker = 0;
+		t.cpu = sched_getcpu();
+		t.start_us = 0;
+		t.end_us = job_us;
+		timings.assign(1, t);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		/* Workers late for the previous job must be out of it first. */
+		while (active)
+			done_cond.wait(guard);
+		body = &body_;
+		rows = range;
+		n_stripes = stripes;
+		timings.resize(stripes);
+		job_start_us = monotonic_us();
+		stripes_left = stripes;
+		next_stripe = 0;
+		generation++;
+		work_cond.notify_all();
+	}
+
+	work(0);
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		while (stripes_left.load() != 0)
+			done_cond.wait(guard);
+	}
+	job_us = monotonic_us() - job_start_us;
+}
+
+void StripePool::last_job(std::vector<StripeTiming> &stripes, uint64_t *wall_us) {
+	std::lock_guard<std::mutex> job(run_lock);
+
+	stripes = timings;
+	if (wall_us)
+		*wall_us = job_us;
+}
+
+void StripePool::print_last_job(std::ostream &os) {
+	std::vector<StripeTiming> stripes;
+	uint64_t wall_us, busy_us = 0, max_us = 0;
+
+	last_job(stripes, &wall_us);
+	if (stripes.empty())
+		return;
+	for (size_t i = 0; i < stripes.size(); i++) {
+		uint64_t us = stripes[i].end_us - stripes[i].start_us;
+
+		busy_us += us;
+		max_us = std::max(max_us, us);
+	}
+
+	os << "stripe pool: " << wall_us / 1000.0 << " ms per frame, " << stripes.size()
+		<< " stripe(s) on " << n_threads << " thread(s), stripe mean "
+		<< busy_us / stripes.size() / 1000.0 << " ms, max " << max_us / 1000.0
+		<< " ms, threads busy " << (wall_us ? 100 * busy_us / (wall_us * n_threads) : 0)
+		<< "%" << std::endl;
+}
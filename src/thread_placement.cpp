@@ -0,0 +1,153 @@
+/*
+ * opencv_v4l2 - thread_placement.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <thread_placement.hpp>
+
+int cpu_node(int cpu) {
+	char path[64];
+	struct dirent *ent;
+	DIR *dir;
+	int node = -1;
+
+	/* The node shows up as a 'nodeN' link in the CPU's sysfs directory. */
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)) != NULL) {
+		if (sscanf(ent->d_name, "node%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dir);
+	return node;
+}
+
+int placement_node(const ThreadPlacement &pl) {
+	if (pl.numa_node >= 0)
+		return pl.numa_node;
+	if (!pl.cpus.empty())
+		return cpu_node(pl.cpus[0]);
+	return -1;
+}
+
+static const char *policy_name(int policy) {
+	switch (policy) {
+		case SCHED_FIFO:
+			return "SCHED_FIFO";
+		case SCHED_RR:
+			return "SCHED_RR";
+		case SCHED_OTHER:
+			return "SCHED_OTHER";
+	}
+	return "unknown policy";
+}
+
+std::string placement_string(const ThreadPlacement &pl) {
+	std::string s;
+	size_t i;
+
+	if (pl.cpus.empty())
+		s = "any CPU";
+	for (i = 0; i < pl.cpus.size(); i++) {
+		s += i ? "," : "CPU ";
+		s += std::to_string(pl.cpus[i]);
+	}
+	s += ", ";
+	s += policy_name(pl.policy);
+	if (SCHED_OTHER != pl.policy)
+		s += "/" + std::to_string(pl.priority);
+	return s;
+}
+
+int placement_validate(const ThreadPlacement &pl, const char *who) {
+	cpu_set_t allowed;
+	struct stat st;
+	char path[64];
+	int ret = 0;
+	size_t i;
+
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		fprintf(stderr, "%s: cannot read the CPU affinity: %s\n", who, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < pl.cpus.size(); i++) {
+		int cpu = pl.cpus[i];
+
+		if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+			fprintf(stderr, "%s: CPU %d is not online or not allowed\n", who, cpu);
+			ret = -1;
+		}
+	}
+
+	if (SCHED_OTHER != pl.policy && SCHED_FIFO != pl.policy && SCHED_RR != pl.policy) {
+		fprintf(stderr, "%s: unsupported scheduling policy %d\n", who, pl.policy);
+		ret = -1;
+	} else if (SCHED_OTHER != pl.policy && (
+			pl.priority < sched_get_priority_min(pl.policy) ||
+			pl.priority > sched_get_priority_max(pl.policy))) {
+		fprintf(stderr, "%s: priority %d out of range for %s (%d-%d)\n", who,
+				pl.priority, policy_name(pl.policy),
+				sched_get_priority_min(pl.policy),
+				sched_get_priority_max(pl.policy));
+		ret = -1;
+	}
+
+	if (pl.numa_node >= 0) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", pl.numa_node);
+		if (stat(path, &st) != 0) {
+			fprintf(stderr, "%s: NUMA node %d does not exist\n", who, pl.numa_node);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int placement_apply(const ThreadPlacement &pl, const char *who) {
+	ThreadPlacement applied = pl;
+	struct sched_param param;
+	int err;
+	size_t i;
+
+	if (!pl.cpus.empty()) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		for (i = 0; i < pl.cpus.size(); i++)
+			CPU_SET(pl.cpus[i], &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			fprintf(stderr, "%s: cannot pin thread: %s\n", who, strerror(err));
+			return -1;
+		}
+	}
+
+	if (SCHED_OTHER != pl.policy) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = pl.priority;
+		err = pthread_setschedparam(pthread_self(), pl.policy, &param);
+		if (err) {
+			fprintf(stderr, "%s: cannot use %s: %s, staying on SCHED_OTHER\n",
+					who, policy_name(pl.policy), strerror(err));
+			applied.policy = SCHED_OTHER;
+		}
+	}
+
+	printf("%s: thread on %s\n", who, placement_string(applied).c_str());
+	return 0;
+}
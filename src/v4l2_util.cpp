@@ -2,24 +2,118 @@
 #include <stdlib.h>
 // #include <string.h>
 #include <iostream>
+#include <algorithm>
 
+#include <strings.h>
 #include <fcntl.h>              /* low-level i/o */
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 
 #include <linux/videodev2.h>
 #include <v4l2_util.hpp>
+#include <frame_copy.hpp>
+#include <device_discovery.hpp>
+#include <yuv_convert.hpp>
+#include <stripe_pool.hpp>
+#include <pixel_format.hpp>
 
 #define NUM_BUFFS	4
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
+/*
+ * Adaptive queue depth: the depth is re-evaluated once per window. It shrinks
+ * after ADAPT_SHRINK_WINDOWS consecutive windows without drops in which every
+ * frame was dequeued within one frame period of its capture.
+ */
+#define ADAPT_WINDOW_MS		1000
+#define ADAPT_SHRINK_WINDOWS	5
+
+/*
+ * dma-buf definitions for kernel headers older than 4.20 (udmabuf)
+ * and 4.6 (DMA_BUF_IOCTL_SYNC).
+ */
+#if defined(__has_include) && __has_include(<linux/udmabuf.h>)
+#include <linux/udmabuf.h>
+#else
+#define UDMABUF_FLAGS_CLOEXEC	0x01
+struct udmabuf_create {
+	__u32 memfd;
+	__u32 flags;
+	__u64 offset;
+	__u64 size;
+};
+#define UDMABUF_CREATE		_IOW('u', 0x42, struct udmabuf_create)
+#endif
+
+#if defined(__has_include) && __has_include(<linux/dma-buf.h>)
+#include <linux/dma-buf.h>
+#else
+struct dma_buf_sync {
+	__u64 flags;
+};
+#define DMA_BUF_SYNC_READ	(1 << 0)
+#define DMA_BUF_SYNC_START	(0 << 2)
+#define DMA_BUF_SYNC_END	(1 << 2)
+#define DMA_BUF_IOCTL_SYNC	_IOW('b', 0, struct dma_buf_sync)
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#define F_SEAL_SHRINK		0x0002
+#endif
+#define HELPER_MFD_ALLOW_SEALING	0x0002U
+
+/*
+ * Colour planes of the formats that keep each of them in a memory plane of
+ * its own. Formats in a single memory plane get their views from their
+ * PixelFormatTraits instead. Chroma planes are subsampled by h_div x v_div.
+ */
+struct plane_desc {
+	unsigned char cn, h_div, v_div;
+};
+
+struct plane_layout {
+	__u32 fourcc;
+	unsigned int n_planes;
+	struct plane_desc planes[3];
+};
+
+static const struct plane_layout plane_layouts[] = {
+	{ V4L2_PIX_FMT_NV12M,   2, { {1, 1, 1}, {2, 2, 2} } },
+	{ V4L2_PIX_FMT_NV21M,   2, { {1, 1, 1}, {2, 2, 2} } },
+	{ V4L2_PIX_FMT_NV16M,   2, { {1, 1, 1}, {2, 2, 1} } },
+	{ V4L2_PIX_FMT_NV61M,   2, { {1, 1, 1}, {2, 2, 1} } },
+	{ V4L2_PIX_FMT_YUV420M, 3, { {1, 1, 1}, {1, 2, 2}, {1, 2, 2} } },
+	{ V4L2_PIX_FMT_YVU420M, 3, { {1, 1, 1}, {1, 2, 2}, {1, 2, 2} } },
+};
+
+static const struct plane_layout *find_plane_layout(__u32 fourcc) {
+	size_t i;
+
+	for (i = 0; i < sizeof(plane_layouts) / sizeof(plane_layouts[0]); i++) {
+		if (plane_layouts[i].fourcc == fourcc)
+			return &plane_layouts[i];
+	}
+	return NULL;
+}
+
 //=====================================================
 
+static uint64_t monotonic_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 unsigned int GetTickCount() {
     struct timeval tv;
     if(gettimeofday(&tv, NULL) != 0)
@@ -38,12 +132,162 @@ int CamV4L2::xioctl(int fh, unsigned long request, void *arg) {
 	return r;
 }
 
+enum v4l2_memory CamV4L2::memory_type(void) {
+	switch (io) {
+		case IO_METHOD_USERPTR:
+			return V4L2_MEMORY_USERPTR;
+		case IO_METHOD_DMABUF:
+			return V4L2_MEMORY_DMABUF;
+		default:
+			return V4L2_MEMORY_MMAP;
+	}
+}
+
+int CamV4L2::dmabuf_sync(int dmabuf_fd, __u64 flags) {
+	struct dma_buf_sync sync;
+
+	CLEAR(sync);
+	sync.flags = flags | DMA_BUF_SYNC_READ;
+
+	return xioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+void CamV4L2::sync_buffer(unsigned int index, __u64 flags) {
+	unsigned int p;
+
+	for (p = 0; p < n_planes; p++)
+		dmabuf_sync(buffers[index * n_planes + p].dmabuf_fd, flags);
+}
+
+size_t CamV4L2::plane_size(unsigned int plane) const {
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type))
+		return cur_fmt.fmt.pix_mp.plane_fmt[plane].sizeimage;
+	return cur_fmt.fmt.pix.sizeimage;
+}
+
+unsigned int CamV4L2::plane_bytesperline(unsigned int plane) const {
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type))
+		return cur_fmt.fmt.pix_mp.plane_fmt[plane].bytesperline;
+	return cur_fmt.fmt.pix.bytesperline;
+}
+
+/*
+ * Queues buffer 'index' (again) with the memory recorded for it in 'buffers'.
+ */
+int CamV4L2::queue_buffer(unsigned int index) {
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct buffer *b = &buffers[index * n_planes];
+	unsigned int p;
+
+	CLEAR(buf);
+	CLEAR(planes);
+	buf.type = buf_type;
+	buf.memory = memory_type();
+	buf.index = index;
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+		buf.m.planes = planes;
+		buf.length = n_planes;
+		for (p = 0; p < n_planes; p++) {
+			if (IO_METHOD_USERPTR == io)
+				planes[p].m.userptr = (unsigned long) b[p].start;
+			else if (IO_METHOD_DMABUF == io)
+				planes[p].m.fd = b[p].dmabuf_fd;
+			if (IO_METHOD_MMAP != io)
+				planes[p].length = b[p].length;
+		}
+	} else if (IO_METHOD_USERPTR == io) {
+		buf.m.userptr = (unsigned long) b->start;
+		buf.length = b->length;
+	} else if (IO_METHOD_DMABUF == io) {
+		buf.m.fd = b->dmabuf_fd;
+		buf.length = b->length;
+	}
+
+	if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+		return -1;
+
+	note_queued();
+	return 0;
+}
+
+/*
+ * Book-keeping for buffers handed back to the driver: ends a starvation
+ * period (see dequeue_buffer).
+ */
+void CamV4L2::note_queued(void) {
+	if (n_queued++ == 0 && starve_start_us) {
+		stats.starved_us += monotonic_us() - starve_start_us;
+		starve_start_us = 0;
+	}
+}
+
+/* Largest number of frames the application held at once. */
+void CamV4L2::note_held(void) {
+	unsigned int held = handles_out + (is_released ? 0 : 1);
+
+	if (held > stats.held_max)
+		stats.held_max = held;
+}
+
+/*
+ * Allocates a memfd-backed dma-buf through /dev/udmabuf. This is used as the
+ * backing store when IO_METHOD_DMABUF is requested without external buffers.
+ */
+int CamV4L2::alloc_udmabuf(size_t size) {
+	struct udmabuf_create create;
+	int memfd, devfd, dmabuf_fd;
+
+	devfd = open("/dev/udmabuf", O_RDWR);
+	if (-1 == devfd) {
+		fprintf(stderr, "Cannot open '/dev/udmabuf': %d, %s\n",
+				errno, strerror(errno));
+		return -1;
+	}
+
+	memfd = syscall(SYS_memfd_create, "v4l2_util", HELPER_MFD_ALLOW_SEALING);
+	if (-1 == memfd) {
+		fprintf(stderr, "Error occurred when creating memfd\n");
+		close(devfd);
+		return -1;
+	}
+
+	if (
+		-1 == ftruncate(memfd, size) ||
+		-1 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK)
+	)
+	{
+		fprintf(stderr, "Error occurred when sizing memfd\n");
+		close(memfd);
+		close(devfd);
+		return -1;
+	}
+
+	CLEAR(create);
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+
+	dmabuf_fd = xioctl(devfd, UDMABUF_CREATE, &create);
+	if (-1 == dmabuf_fd) {
+		fprintf(stderr, "Error occurred when creating udmabuf\n");
+	}
+
+	/* The dma-buf holds its own reference to the memfd pages. */
+	close(memfd);
+	close(devfd);
+	return dmabuf_fd;
+}
+
 int CamV4L2::set_io_method(enum io_method io_meth) {
 	switch (io_meth)
 	{
 		case IO_METHOD_READ:
 		case IO_METHOD_MMAP:
 		case IO_METHOD_USERPTR:
+		case IO_METHOD_DMABUF:
 			io = io_meth;
 			return 0;
 		default:
@@ -63,7 +307,8 @@ int CamV4L2::stop_capturing(void) {
 
 		case IO_METHOD_MMAP:
 		case IO_METHOD_USERPTR:
-			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		case IO_METHOD_DMABUF:
+			type = buf_type;
 			if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
 			{
 				fprintf(stderr, "Error occurred when streaming off\n");
@@ -78,14 +323,11 @@ int CamV4L2::stop_capturing(void) {
 	 * Request to clear the buffers. This helps with changing resolution.
 	 */
 	req.count = 0;
-	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
+	req.type = buf_type;
+	req.memory = memory_type();
 
 	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-		if (EINVAL == errno) {
-			fprintf(stderr, "The device does not support "
-					"memory mapping\n");
-		}
+		fprintf(stderr, "Error occurred when releasing buffers\n");
 		return ERR;
 	}
 
@@ -102,49 +344,22 @@ int CamV4L2::start_capturing(void) {
 			break;
 
 		case IO_METHOD_MMAP:
-			for (i = 0; i < n_buffers; ++i) {
-				struct v4l2_buffer buf;
-
-				CLEAR(buf);
-				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-				buf.memory = V4L2_MEMORY_MMAP;
-				buf.index = i;
-
-				if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-				{
-					fprintf(stderr, "Error occurred when queueing buffer\n");
-					return ERR;
-				}
-			}
-			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-			{
-				fprintf(stderr, "Error occurred when turning on stream\n");
-				return ERR;
-			}
-			break;
-
 		case IO_METHOD_USERPTR:
+		case IO_METHOD_DMABUF:
+			/* Fresh queue, nothing is held by the driver yet. */
+			n_queued = 0;
+			starve_start_us = 0;
 			for (i = 0; i < n_buffers; ++i) {
-				struct v4l2_buffer buf;
-
-				CLEAR(buf);
-				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-				buf.memory = V4L2_MEMORY_USERPTR;
-				buf.index = i;
-				buf.m.userptr = (unsigned long)buffers[i].start;
-				buf.length = buffers[i].length;
-
-				if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+				if (-1 == queue_buffer(i))
 				{
 					fprintf(stderr, "Error occurred when queueing buffer\n");
 					return ERR;
 				}
 			}
-			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			type = buf_type;
 			if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
 			{
-				fprintf(stderr, "Error when turning on stream\n");
+				fprintf(stderr, "Error occurred when turning on stream\n");
 				return ERR;
 			}
 			break;
@@ -157,24 +372,34 @@ int CamV4L2::uninit_device(void) {
 	unsigned int i;
 	int ret = 0;
 
+	if (!buffers)
+		return 0;
+
 	switch (io) {
 		case IO_METHOD_READ:
 			free(buffers[0].start);
 			break;
 
 		case IO_METHOD_MMAP:
-			for (i = 0; i < n_buffers; ++i)
+		case IO_METHOD_DMABUF:
+			for (i = 0; i < n_buffers * n_planes; ++i) {
 				if (-1 == munmap(buffers[i].start, buffers[i].length))
 					ret = ERR;
+				if (buffers[i].dmabuf_fd >= 0)
+					close(buffers[i].dmabuf_fd);
+			}
 			break;
 
 		case IO_METHOD_USERPTR:
-			for (i = 0; i < n_buffers; ++i)
-				free(buffers[i].start);
+			for (i = 0; i < n_buffers * n_planes; ++i)
+				pool_free(buffers[i].start, buffers[i].pool_length);
 			break;
 	}
 
+	/* A failed re-initialisation must not free them a second time. */
 	free(buffers);
+	buffers = NULL;
+	n_buffers = 0;
 	return ret;
 }
 
@@ -188,6 +413,7 @@ int CamV4L2::init_read(unsigned int buffer_size) {
 
 	buffers[0].length = buffer_size;
 	buffers[0].start = malloc(buffer_size);
+	buffers[0].dmabuf_fd = -1;
 
 	if (!buffers[0].start) {
 		fprintf(stderr, "Out of memory\n");
@@ -203,8 +429,8 @@ int CamV4L2::init_mmap(void) {
 
 	CLEAR(req);
 
-	req.count = NUM_BUFFS;
-	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.count = num_buffs;
+	req.type = buf_type;
 	req.memory = V4L2_MEMORY_MMAP;
 
 	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
@@ -221,7 +447,7 @@ int CamV4L2::init_mmap(void) {
 		return ERR;
 	}
 
-	buffers = (struct buffer *) calloc(req.count, sizeof(*buffers));
+	buffers = (struct buffer *) calloc(req.count * n_planes, sizeof(*buffers));
 
 	if (!buffers) {
 		fprintf(stderr, "Out of memory\n");
@@ -231,11 +457,18 @@ int CamV4L2::init_mmap(void) {
 	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
 		int loop_err = 0;
 		struct v4l2_buffer buf;
+		struct v4l2_plane planes[VIDEO_MAX_PLANES];
+		unsigned int p;
 
 		CLEAR(buf);
-		buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		CLEAR(planes);
+		buf.type        = buf_type;
 		buf.memory      = V4L2_MEMORY_MMAP;
 		buf.index       = n_buffers;
+		if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+			buf.m.planes = planes;
+			buf.length = n_planes;
+		}
 
 		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
 		{
@@ -244,18 +477,31 @@ int CamV4L2::init_mmap(void) {
 			goto LOOP_FREE_EXIT;
 		}
 
-		buffers[n_buffers].length = buf.length;
-		buffers[n_buffers].start =
-			mmap(NULL /* start anywhere */,
-					buf.length,
-					PROT_READ | PROT_WRITE /* required */,
-					MAP_SHARED /* recommended */,
-					fd, buf.m.offset);
+		for (p = 0; p < n_planes; p++) {
+			struct buffer *b = &buffers[n_buffers * n_planes + p];
+			off_t offset;
 
-		if (MAP_FAILED == buffers[n_buffers].start) {
-			fprintf(stderr, "Error occurred when mapping memory\n");
-			loop_err = 1;
-			goto LOOP_FREE_EXIT;
+			if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+				b->length = planes[p].length;
+				offset = planes[p].m.mem_offset;
+			} else {
+				b->length = buf.length;
+				offset = buf.m.offset;
+			}
+			b->dmabuf_fd = -1;
+			b->start =
+				mmap(NULL /* start anywhere */,
+						b->length,
+						PROT_READ | PROT_WRITE /* required */,
+						MAP_SHARED /* recommended */,
+						fd, offset);
+
+			if (MAP_FAILED == b->start) {
+				fprintf(stderr, "Error occurred when mapping memory\n");
+				b->start = NULL;
+				loop_err = 1;
+				goto LOOP_FREE_EXIT;
+			}
 		}
 
 LOOP_FREE_EXIT:
@@ -263,10 +509,11 @@ LOOP_FREE_EXIT:
 		{
 			unsigned int curr_buf_to_free;
 			for (curr_buf_to_free = 0;
-				curr_buf_to_free < n_buffers;
+				curr_buf_to_free < (n_buffers + 1) * n_planes;
 				curr_buf_to_free++)
 			{
 				if (
+					buffers[curr_buf_to_free].start &&
 					munmap(buffers[curr_buf_to_free].start,
 					buffers[curr_buf_to_free].length) != 0
 				)
@@ -278,6 +525,8 @@ LOOP_FREE_EXIT:
 				}
 			}
 			free(buffers);
+			buffers = NULL;
+			n_buffers = 0;
 			return ERR;
 		}
 	}
@@ -285,13 +534,14 @@ LOOP_FREE_EXIT:
 	return ret;
 }
 
-int CamV4L2::init_userp(unsigned int buffer_size) {
+int CamV4L2::init_userp(void) {
 	struct v4l2_requestbuffers req;
+	unsigned int i;
 
 	CLEAR(req);
 
-	req.count  = NUM_BUFFS;
-	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.count  = num_buffs;
+	req.type   = buf_type;
 	req.memory = V4L2_MEMORY_USERPTR;
 
 	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
@@ -302,44 +552,163 @@ int CamV4L2::init_userp(unsigned int buffer_size) {
 		return ERR;
 	}
 
-	buffers = (struct buffer *) calloc(req.count, sizeof(*buffers));
+	buffers = (struct buffer *) calloc(req.count * n_planes, sizeof(*buffers));
 
 	if (!buffers) {
 		fprintf(stderr, "Out of memory\n");
 		return ERR;
 	}
 
-	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-		buffers[n_buffers].length = buffer_size;
-		if(posix_memalign(&buffers[n_buffers].start,getpagesize(),buffer_size) != 0)
+	for (i = 0; i < req.count * n_planes; ++i) {
+		struct pool_block blk;
+
+		buffers[i].length = plane_size(i % n_planes);
+		buffers[i].dmabuf_fd = -1;
+		if (pool_alloc(&blk, buffers[i].length, pool_flags, buffer_node) != 0)
 		{
 			/*
 			 * This happens only in case of ENOMEM
 			 */
 			unsigned int curr_buf_to_free;
 			for (curr_buf_to_free = 0;
-				curr_buf_to_free < n_buffers;
+				curr_buf_to_free < i;
 				curr_buf_to_free++
 			)
 			{
-				free(buffers[curr_buf_to_free].start);
+				pool_free(buffers[curr_buf_to_free].start,
+						buffers[curr_buf_to_free].pool_length);
 			}
 			free(buffers);
+			buffers = NULL;
+			n_buffers = 0;
 			fprintf(stderr, "Error occurred when allocating memory for buffers\n");
 			return ERR;
 		}
+		buffers[i].start = blk.start;
+		buffers[i].pool_length = blk.map_length;
+
+		/* The first buffer tells how the pool options fared. */
+		if (0 == i && (pool_flags || buffer_node >= 0))
+			fprintf(stderr, "cam #%d: capture buffers on %s%s%s\n", camidx,
+					pool_backing_name(blk.backing),
+					(pool_flags & POOL_LOCK) && !blk.locked ?
+					", not locked (see RLIMIT_MEMLOCK)" : "",
+					buffer_node >= 0 && blk.node < 0 ?
+					", not bound to the NUMA node" : "");
 	}
+	n_buffers = req.count;
 
 	return 0;
 }
 
-int CamV4L2::init_device(unsigned int width, 
-    unsigned int height, unsigned int format) {
+/*
+ * Imports dma-bufs into the capture queue (V4L2_MEMORY_DMABUF). The buffers
+ * are either the ones given to set_dmabuf_fds() or memfd-backed udmabufs
+ * allocated here. Each one is also mapped for CPU access to the frame data.
+ */
+int CamV4L2::init_dmabuf(void) {
+	struct v4l2_requestbuffers req;
+	size_t page_size = getpagesize();
+	unsigned int n_import_bufs = import_fds.size() / n_planes;
+	unsigned int i;
+
+	if (import_fds.size() % n_planes) {
+		fprintf(stderr, "Expected %u dma-buf(s) per buffer\n", n_planes);
+		return ERR;
+	}
+
+	CLEAR(req);
+
+	req.count  = n_import_bufs ? n_import_bufs : num_buffs;
+	req.type   = buf_type;
+	req.memory = V4L2_MEMORY_DMABUF;
+
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+		if (EINVAL == errno) {
+			fprintf(stderr, "The device does not "
+					"support dma-buf i/o\n");
+		}
+		return ERR;
+	}
+
+	/*
+	 * The driver might ask for more buffers than were handed to us. Only
+	 * queue the ones we actually have.
+	 */
+	if (n_import_bufs && req.count > n_import_bufs)
+		req.count = n_import_bufs;
+
+	buffers = (struct buffer *) calloc(req.count * n_planes, sizeof(*buffers));
+
+	if (!buffers) {
+		fprintf(stderr, "Out of memory\n");
+		return ERR;
+	}
+
+	for (i = 0; i < req.count * n_planes; ++i) {
+		struct buffer *b = &buffers[i];
+		size_t buffer_size = plane_size(i % n_planes);
+		int loop_err = 0;
+
+		if (n_import_bufs) {
+			off_t size = lseek(import_fds[i], 0, SEEK_END);
+
+			if (size < 0 || (size_t) size < buffer_size) {
+				fprintf(stderr, "dma-buf %u is too small for the frame\n", i);
+				loop_err = 1;
+				goto LOOP_FREE_EXIT;
+			}
+			b->length = size;
+			b->dmabuf_fd = dup(import_fds[i]);
+		} else {
+			b->length = (buffer_size + page_size - 1) & ~(page_size - 1);
+			b->dmabuf_fd = alloc_udmabuf(b->length);
+		}
+
+		if (-1 == b->dmabuf_fd) {
+			fprintf(stderr, "Error occurred when allocating dma-buf\n");
+			loop_err = 1;
+			goto LOOP_FREE_EXIT;
+		}
+
+		b->start = mmap(NULL, b->length, PROT_READ | PROT_WRITE,
+				MAP_SHARED, b->dmabuf_fd, 0);
+
+		if (MAP_FAILED == b->start) {
+			fprintf(stderr, "Error occurred when mapping dma-buf\n");
+			close(b->dmabuf_fd);
+			loop_err = 1;
+			goto LOOP_FREE_EXIT;
+		}
+
+LOOP_FREE_EXIT:
+		if (loop_err)
+		{
+			unsigned int curr_buf_to_free;
+			for (curr_buf_to_free = 0;
+				curr_buf_to_free < i;
+				curr_buf_to_free++)
+			{
+				munmap(buffers[curr_buf_to_free].start,
+					buffers[curr_buf_to_free].length);
+				close(buffers[curr_buf_to_free].dmabuf_fd);
+			}
+			free(buffers);
+			buffers = NULL;
+			n_buffers = 0;
+			return ERR;
+		}
+	}
+	n_buffers = req.count;
+
+	return 0;
+}
+
+/*
+ * Queries the device capabilities and picks the buffer type to use.
+ */
+int CamV4L2::query_caps(unsigned int *caps) {
 	struct v4l2_capability cap;
-	struct v4l2_cropcap cropcap;
-	struct v4l2_crop crop;
-	struct v4l2_format fmt;
-	unsigned int min;
 
 	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
 		if (EINVAL == errno) {
@@ -349,62 +718,114 @@ int CamV4L2::init_device(unsigned int width,
 		return ERR;
 	}
 
-	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+	*caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+		cap.device_caps : cap.capabilities;
+
+	/*
+	 * Many SoC / ISP drivers only implement the multi-planar API. Use it
+	 * when the single-planar one isn't available.
+	 */
+	if (*caps & V4L2_CAP_VIDEO_CAPTURE) {
+		buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	} else if (*caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+		buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	} else {
 		fprintf(stderr, "Given device is no video capture device\n");
 		return ERR;
 	}
 
-	switch (io) {
-		case IO_METHOD_READ:
-			if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-				fprintf(stderr, "Given device does not "
-						"support read i/o\n");
-				return ERR;
-			}
-			break;
+	return 0;
+}
 
-		case IO_METHOD_MMAP:
-		case IO_METHOD_USERPTR:
-			if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-				fprintf(stderr, "Given device does not "
-						"support streaming i/o\n");
-				return ERR;
-			}
-			break;
-	}
+/*
+ * Sets the sensor crop to 'roi', or resets it to the default rectangle when
+ * 'roi' is empty. Uses the selection API and falls back to VIDIOC_S_CROP on
+ * drivers that don't implement it. The rectangle the driver settled on is
+ * kept in cur_roi.
+ */
+int CamV4L2::set_crop(const cv::Rect &roi) {
+	struct v4l2_selection sel;
+	struct v4l2_cropcap cropcap;
+	struct v4l2_crop crop;
 
+	/* Selections and crops use the single-planar type for both APIs. */
+	CLEAR(sel);
+	sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+
+	if (0 == xioctl(fd, VIDIOC_G_SELECTION, &sel)) {
+		if (roi.area() > 0) {
+			sel.r.left = roi.x;
+			sel.r.top = roi.y;
+			sel.r.width = roi.width;
+			sel.r.height = roi.height;
+		}
+		sel.target = V4L2_SEL_TGT_CROP;
 
-	/* Select video input, video standard and tune here. */
+		if (-1 == xioctl(fd, VIDIOC_S_SELECTION, &sel)) {
+			if (roi.area() > 0)
+				fprintf(stderr, "cam #%d: error occurred when setting the crop selection\n", camidx);
+			return ERR;
+		}
+		cur_roi = cv::Rect(sel.r.left, sel.r.top, sel.r.width, sel.r.height);
+		return 0;
+	}
 
 	CLEAR(cropcap);
-
 	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-	if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
-		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		crop.c = cropcap.defrect; /* reset to default */
+	if (-1 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
+		/* Cropping not supported. */
+		cur_roi = cv::Rect();
+		return ERR;
+	}
 
-		if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
-			switch (errno) {
-				case EINVAL:
-					/* Cropping not supported. */
-					break;
-				default:
-					/* Errors ignored. */
-					break;
-			}
-		}
-	} else {
-		/* Errors ignored. */
+	CLEAR(crop);
+	crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	crop.c = cropcap.defrect; /* reset to default */
+	if (roi.area() > 0) {
+		crop.c.left = roi.x;
+		crop.c.top = roi.y;
+		crop.c.width = roi.width;
+		crop.c.height = roi.height;
+	}
+
+	if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
+		if (roi.area() > 0)
+			fprintf(stderr, "cam #%d: error occurred when setting the crop\n", camidx);
+		return ERR;
 	}
 
+	/* The driver may have adjusted the rectangle. */
+	if (0 == xioctl(fd, VIDIOC_G_CROP, &crop))
+		cur_roi = cv::Rect(crop.c.left, crop.c.top, crop.c.width, crop.c.height);
+	return 0;
+}
+
+/*
+ * Negotiates the format with VIDIOC_S_FMT. No buffers may be allocated.
+ */
+int CamV4L2::set_format(unsigned int width, unsigned int height, unsigned int format) {
+	struct v4l2_format fmt;
+	struct v4l2_streamparm parm;
+	unsigned int min, p, planes;
+	unsigned int got_width, got_height, got_format;
+	const PixelFormatOps *ops;
+
 	CLEAR(fmt);
 
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width       = width;
-	fmt.fmt.pix.height      = height;
-	fmt.fmt.pix.pixelformat = format;
-	fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+	fmt.type = buf_type;
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+		fmt.fmt.pix_mp.width       = width;
+		fmt.fmt.pix_mp.height      = height;
+		fmt.fmt.pix_mp.pixelformat = format;
+		fmt.fmt.pix_mp.field       = V4L2_FIELD_ANY;
+	} else {
+		fmt.fmt.pix.width       = width;
+		fmt.fmt.pix.height      = height;
+		fmt.fmt.pix.pixelformat = format;
+		fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+	}
 
 	if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
 	{
@@ -414,42 +835,174 @@ int CamV4L2::init_device(unsigned int width,
 
 	/* Note VIDIOC_S_FMT may change width and height. */
 
-	printf("pixfmt = %c %c %c %c \n", (fmt.fmt.pix.pixelformat & 0x000000ff) , (fmt.fmt.pix.pixelformat & 0x0000ff00) >>8 , (fmt.fmt.pix.pixelformat & 0x00ff0000) >>16, (fmt.fmt.pix.pixelformat & 0xff000000) >>24 );
-	printf("width = %d height = %d\n",fmt.fmt.pix.width,fmt.fmt.pix.height);
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+		got_width = fmt.fmt.pix_mp.width;
+		got_height = fmt.fmt.pix_mp.height;
+		got_format = fmt.fmt.pix_mp.pixelformat;
+		planes = fmt.fmt.pix_mp.num_planes;
+	} else {
+		got_width = fmt.fmt.pix.width;
+		got_height = fmt.fmt.pix.height;
+		got_format = fmt.fmt.pix.pixelformat;
+		planes = 1;
+	}
 
-	if (
-		fmt.fmt.pix.width != width ||
-		fmt.fmt.pix.height != height ||
-		fmt.fmt.pix.pixelformat != format
-	)
+	printf("pixfmt = %c %c %c %c \n", (got_format & 0x000000ff) , (got_format & 0x0000ff00) >>8 , (got_format & 0x00ff0000) >>16, (got_format & 0xff000000) >>24 );
+	printf("width = %d height = %d\n",got_width,got_height);
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type))
+		printf("planes = %u (multi-planar API)\n", planes);
+
+	if (got_format != format)
+	{
+		fprintf(stderr, "Error: The device does not support the requested format!\n");
+		return ERR;
+	}
+
+	/* A driver adjusted size is usable; the frames follow cur_mode. */
+	if (got_width != width || got_height != height)
 	{
-		fprintf(stderr, "Warning: The current format does not match requested format/resolution!\n");
+		fprintf(stderr, "Warning: Requested %ux%u, the driver chose %ux%u\n",
+				width, height, got_width, got_height);
+	}
+
+	if (planes < 1 || planes > VIDEO_MAX_PLANES) {
+		fprintf(stderr, "Driver reported an invalid number of planes\n");
 		return ERR;
 	}
 
+	/*
+	 * Formats kept in a single memory plane convert through their traits,
+	 * whichever buffer type the driver uses.
+	 */
+	ops = 1 == planes ? find_pixel_format(got_format) : NULL;
+
 	/* Buggy driver paranoia. */
-	min = fmt.fmt.pix.width * 2;
-	if (fmt.fmt.pix.bytesperline < min)
-		fmt.fmt.pix.bytesperline = min;
-	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-	if (fmt.fmt.pix.sizeimage < min)
-		fmt.fmt.pix.sizeimage = min;
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+		/* Plane heights depend on the format; only catch empty planes. */
+		for (p = 0; p < planes; p++) {
+			if (fmt.fmt.pix_mp.plane_fmt[p].sizeimage == 0) {
+				fprintf(stderr, "Driver reported an empty plane\n");
+				return ERR;
+			}
+		}
+		if (ops) {
+			struct v4l2_plane_pix_format *pf = &fmt.fmt.pix_mp.plane_fmt[0];
+
+			min = ops->min_bytesperline(got_width);
+			if (pf->bytesperline < min)
+				pf->bytesperline = min;
+			min = ops->min_sizeimage(pf->bytesperline, got_height);
+			if (pf->sizeimage < min)
+				pf->sizeimage = min;
+		}
+	} else {
+		/* Formats without traits are taken to be 16 bits per pixel. */
+		min = ops ? ops->min_bytesperline(fmt.fmt.pix.width) : fmt.fmt.pix.width * 2;
+		if (fmt.fmt.pix.bytesperline < min)
+			fmt.fmt.pix.bytesperline = min;
+		min = ops ? ops->min_sizeimage(fmt.fmt.pix.bytesperline, fmt.fmt.pix.height) :
+			fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+		if (fmt.fmt.pix.sizeimage < min)
+			fmt.fmt.pix.sizeimage = min;
+	}
+
+	/* Kept for allocating more buffers later on (VIDIOC_CREATE_BUFS). */
+	cur_fmt = fmt;
+	n_planes = planes;
+	pix_ops = ops;
+	cur_mode.pixelformat = got_format;
+	cur_mode.width = got_width;
+	cur_mode.height = got_height;
+	cur_mode.interval.numerator = cur_mode.interval.denominator = 0;
+
+	CLEAR(parm);
+	parm.type = buf_type;
+	if (0 == xioctl(fd, VIDIOC_G_PARM, &parm))
+		cur_mode.interval = parm.parm.capture.timeperframe;
+
+	return 0;
+}
+
+int CamV4L2::init_device(unsigned int width, 
+    unsigned int height, unsigned int format, const cv::Rect &roi,
+    struct v4l2_fract interval) {
+	unsigned int caps;
+	uint64_t t0 = monotonic_us();
+	int ret = 0;
+
+	if (query_caps(&caps) < 0)
+		return ERR;
+
+	switch (io) {
+		case IO_METHOD_READ:
+			if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+				fprintf(stderr, "Read i/o is not supported "
+						"with multi-planar devices\n");
+				return ERR;
+			}
+			if (!(caps & V4L2_CAP_READWRITE)) {
+				fprintf(stderr, "Given device does not "
+						"support read i/o\n");
+				return ERR;
+			}
+			break;
+
+		case IO_METHOD_MMAP:
+		case IO_METHOD_USERPTR:
+		case IO_METHOD_DMABUF:
+			if (!(caps & V4L2_CAP_STREAMING)) {
+				fprintf(stderr, "Given device does not "
+						"support streaming i/o\n");
+				return ERR;
+			}
+			break;
+	}
+
+
+	/* Select video input, video standard and tune here. */
+
+	/*
+	 * Crop before setting the format, the ratio between the two decides
+	 * the scaling. Without an ROI the crop is reset to the default and
+	 * errors are ignored, as many devices can't crop.
+	 */
+	if (set_crop(roi) < 0 && roi.area() > 0)
+		return ERR;
+
+	if (set_format(width, height, format) < 0)
+		return ERR;
+
+	/*
+	 * The frame rate goes with the format and must be set before buffers
+	 * are requested. Not every driver lets it be set; it keeps its
+	 * default then, which cur_mode reports.
+	 */
+	if (interval.numerator)
+		set_frame_interval(interval);
+
+	startup.format_ms = (monotonic_us() - t0) / 1000.0;
+	t0 = monotonic_us();
 
 	switch (io) {
 		case IO_METHOD_READ:
-			return init_read(fmt.fmt.pix.sizeimage);
+			ret = init_read(cur_fmt.fmt.pix.sizeimage);
 			break;
 
 		case IO_METHOD_MMAP:
-			return init_mmap();
+			ret = init_mmap();
 			break;
 
 		case IO_METHOD_USERPTR:
-			return init_userp(fmt.fmt.pix.sizeimage);
+			ret = init_userp();
+			break;
+
+		case IO_METHOD_DMABUF:
+			ret = init_dmabuf();
 			break;
 	}
 
-	return 0;
+	startup.alloc_ms = (monotonic_us() - t0) / 1000.0;
+	return ret;
 }
 
 int CamV4L2::close_device(void) {
@@ -461,16 +1014,25 @@ int CamV4L2::close_device(void) {
 
 	fd = -1;
 
+	if (wake_fd >= 0)
+		close(wake_fd);
+	wake_fd = -1;
+
 	return 0;
 }
 
-int CamV4L2::helper_init_cam(int idx, const char* devname, 
-    unsigned int width, unsigned int height, 
-    unsigned int format, enum io_method io_meth, bool enable_display_) {
-	
+/*
+ * Opens the device; the format is negotiated by the caller before start_cam().
+ */
+int CamV4L2::open_cam(int idx, const char* devname, enum io_method io_meth,
+    bool enable_display_, unsigned int num_buffers) {
+	uint64_t t0 = monotonic_us();
+
 	camidx = idx;
+	dev_path = devname;
+	num_buffs = num_buffers ? num_buffers : NUM_BUFFS;
 	enable_display = enable_display_;
-	running = false;
+	*running = false;
     if (is_initialised)
 	{
 		/*
@@ -485,16 +1047,42 @@ int CamV4L2::helper_init_cam(int idx, const char* devname,
 	std::cout << "--- Camera #" << camidx << "(" << devname << ") ---------------" << std::endl;
 	if(
 		set_io_method(io_meth) < 0 ||
-		open_device(devname) < 0 ||
-		init_device(width,height,format) < 0 ||
-		start_capturing() < 0
+		open_device(devname) < 0
 	)
 	{
-		fprintf(stderr, "Error occurred when initialising camera\n");
 		return ERR;
 	}
+	startup.reset();
+	startup.open_ms = (monotonic_us() - t0) / 1000.0;
+
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_fd < 0) {
+		fprintf(stderr, "cam #%d: error occurred when creating wakeup fd\n", camidx);
+		return ERR;
+	}
+
+	/* Checked now rather than once the capture thread is started. */
+	std::string who = "cam #" + std::to_string(camidx);
+	if (placement_validate(placement, who.c_str()) < 0)
+		return ERR;
+	buffer_node = placement_node(placement);
+	if (buffer_node >= 0)
+		std::cout << who << ": " << placement_string(placement)
+			<< ", buffers on NUMA node " << buffer_node << std::endl;
+
+	return 0;
+}
+
+int CamV4L2::start_cam(void) {
+	uint64_t t0 = monotonic_us();
+
+	if (start_capturing() < 0)
+		return ERR;
+	streamon_us = monotonic_us();
+	startup.streamon_ms = (streamon_us - t0) / 1000.0;
 
-	yuyv_frame = cv::Mat(height, width, CV_8UC2);
+	/* Errors ignored, the device may not have any controls. */
+	query_controls();
 
 	if (enable_display) {
 		std::string savepath_ = "../log/";
@@ -504,193 +1092,2027 @@ int CamV4L2::helper_init_cam(int idx, const char* devname,
 	// 	cv::namedWindow(winname);
 	}
 
+	start = GetTickCount();
 	is_initialised = 1;
 	return 0;
 }
 
-int CamV4L2::helper_get_cam_frame(
-    unsigned char** pointer_to_cam_data, int *size) {
-    static unsigned char max_timeout_retries = 10;
-	unsigned char timeout_retries = 0;
+/*
+ * Undoes a helper_init_cam() that failed after opening the device: stops the
+ * stream if it got that far, frees the buffers and closes the device and the
+ * wakeup fd, so the object can be initialised again or dropped.
+ */
+void CamV4L2::abort_init(void) {
+	enum v4l2_buf_type type = buf_type;
+
+	if (is_initialised)
+		return;
+
+	if (fd >= 0 && IO_METHOD_READ != io)
+		xioctl(fd, VIDIOC_STREAMOFF, &type);	/* may not be streaming yet */
+	uninit_device();
+
+	if (fd >= 0) {
+		close_device();
+	} else if (wake_fd >= 0) {
+		close(wake_fd);
+		wake_fd = -1;
+	}
+}
 
-	if (!is_initialised)
+int CamV4L2::helper_init_cam(int idx, const char* devname, 
+    unsigned int width, unsigned int height, 
+    unsigned int format, enum io_method io_meth, bool enable_display_,
+    unsigned int num_buffers, const cv::Rect &roi) {
+	if(
+		open_cam(idx, devname, io_meth, enable_display_, num_buffers) < 0 ||
+		init_device(width,height,format,roi) < 0 ||
+		start_cam() < 0
+	)
 	{
-		fprintf (stderr, "Error: trying to get frame without successfully initialising camera\n");
+		fprintf(stderr, "Error occurred when initialising camera\n");
+		abort_init();
 		return ERR;
 	}
 
-	if (!is_released)
+	return 0;
+}
+
+int CamV4L2::helper_init_cam(int idx, const char* devname,
+    const ModeConstraints &constraints, enum io_method io_meth,
+    bool enable_display_, unsigned int num_buffers) {
+	std::vector<CameraMode> modes;
+	CameraMode best;
+
+	if(
+		open_cam(idx, devname, io_meth, enable_display_, num_buffers) < 0 ||
+		enumerate_modes(modes) < 0
+	)
+		goto fail;
+
+	if (
+		select_mode(modes, constraints, &best) < 0 &&
+		(probe_size_modes(modes, constraints) == 0 ||
+		select_mode(modes, constraints, &best) < 0)
+	)
 	{
-		fprintf (stderr, "Error: trying to get another frame without releasing already obtained frame\n");
+		fprintf(stderr, "cam #%d: none of the %zu modes meets the constraints\n",
+				camidx, modes.size());
+		goto fail;
+	}
+
+	printf("selected %c%c%c%c %ux%u @ %.2f fps\n",
+			best.pixelformat & 0xff, (best.pixelformat >> 8) & 0xff,
+			(best.pixelformat >> 16) & 0xff, (best.pixelformat >> 24) & 0xff,
+			best.width, best.height, best.fps());
+
+	if (init_device(best.width, best.height, best.pixelformat, cv::Rect(), best.interval) < 0)
+		goto fail;
+
+	/* What the driver kept, which may be another rate than the one listed. */
+	if (best.interval.numerator) {
+		double diff = cur_mode.fps() - best.fps();
+
+		if (cur_mode.fps() == 0)
+			printf("cam #%d: frame rate unknown, the driver does not report it\n", camidx);
+		else if (diff < -0.001 * best.fps() || diff > 0.001 * best.fps())
+			fprintf(stderr, "cam #%d: streaming at %.2f fps, not the %.2f fps selected\n",
+					camidx, cur_mode.fps(), best.fps());
+	}
+
+	if (start_cam() < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	fprintf(stderr, "Error occurred when initialising camera\n");
+	abort_init();
+	return ERR;
+}
+
+/*
+ * Rough cost of converting a pixel format to BGR, used when the caller
+ * doesn't give an order of preference. Only formats with PixelFormatTraits
+ * are ranked; the others (compressed ones included) can't be converted by
+ * process_frame() and get -1, so they are only taken when asked for.
+ */
+static int format_cost(const CameraMode &mode) {
+	if (mode.compressed || !find_pixel_format(mode.pixelformat))
+		return -1;
+
+	switch (mode.pixelformat) {
+		case V4L2_PIX_FMT_GREY:
+			return 1;
+		case V4L2_PIX_FMT_UYVY:
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_Y16:
+			return 2;
+		case V4L2_PIX_FMT_NV12:
+		case V4L2_PIX_FMT_NV16:
+		case V4L2_PIX_FMT_SRGGB8:
+		case V4L2_PIX_FMT_SBGGR8:
+		case V4L2_PIX_FMT_SGRBG8:
+		case V4L2_PIX_FMT_SGBRG8:
+			return 3;
+	}
+
+	/* Bayer with more than 8 bits: unpacked before demosaicing. */
+	return 4;
+}
+
+/*
+ * Sizes tried within the range of stepwise / continuous frame sizes, in
+ * addition to the smallest and largest one.
+ */
+static const unsigned int common_sizes[][2] = {
+	{ 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 },
+};
+
+void CamV4L2::add_size_modes(std::vector<CameraMode> &modes,
+    const struct v4l2_fmtdesc &fmtdesc, unsigned int width, unsigned int height) {
+	struct v4l2_frmivalenum ival;
+	CameraMode mode;
+
+	mode.pixelformat = fmtdesc.pixelformat;
+	mode.width = width;
+	mode.height = height;
+	mode.compressed = fmtdesc.flags & V4L2_FMT_FLAG_COMPRESSED;
+
+	CLEAR(ival);
+	ival.pixel_format = fmtdesc.pixelformat;
+	ival.width = width;
+	ival.height = height;
+
+	for (ival.index = 0; 0 == xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival); ival.index++) {
+		if (V4L2_FRMIVAL_TYPE_DISCRETE == ival.type) {
+			mode.interval = ival.discrete;
+			modes.push_back(mode);
+		} else {
+			/* Stepwise / continuous: the shortest interval is the one we want. */
+			mode.interval = ival.stepwise.min;
+			modes.push_back(mode);
+			return;
+		}
+	}
+
+	/* The driver doesn't enumerate intervals; the frame rate is unknown. */
+	if (ival.index == 0) {
+		mode.interval.numerator = mode.interval.denominator = 0;
+		modes.push_back(mode);
+	}
+}
+
+int CamV4L2::enumerate_modes(std::vector<CameraMode> &modes) {
+	struct v4l2_fmtdesc fmtdesc;
+	unsigned int caps;
+	VideoDevice dev;
+	bool known = false;
+
+	modes.clear();
+	if (fd < 0 || query_caps(&caps) < 0)
 		return ERR;
+
+	if (mode_cache) {
+		known = describe_device(fd, dev_path.c_str(), &dev) == 0;
+		if (known && mode_cache->lookup(dev, modes)) {
+			std::cout << "cam #" << camidx << ": " << modes.size()
+				<< " modes of " << dev.card << " taken from the mode cache" << std::endl;
+			return 0;
+		}
 	}
 
-	for (;;) {
-		fd_set fds;
-		struct timeval tv;
-		int r;
+	CLEAR(fmtdesc);
+	fmtdesc.type = buf_type;
 
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
+	for (fmtdesc.index = 0; 0 == xioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc); fmtdesc.index++) {
+		struct v4l2_frmsizeenum size;
 
-		/* Timeout. */
-		tv.tv_sec = 2;
-		tv.tv_usec = 0;
+		CLEAR(size);
+		size.pixel_format = fmtdesc.pixelformat;
 
-		r = select(fd + 1, &fds, NULL, NULL, &tv);
+		for (size.index = 0; 0 == xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size); size.index++) {
+			const struct v4l2_frmsize_stepwise &sw = size.stepwise;
+			size_t i;
 
-		if (-1 == r) {
-			if (EINTR == errno)
+			if (V4L2_FRMSIZE_TYPE_DISCRETE == size.type) {
+				add_size_modes(modes, fmtdesc, size.discrete.width, size.discrete.height);
 				continue;
-		}
+			}
 
-		if (0 == r) {
-			fprintf(stderr, "select timeout\n");
-			timeout_retries++;
+			add_size_modes(modes, fmtdesc, sw.min_width, sw.min_height);
+			for (i = 0; i < sizeof(common_sizes) / sizeof(common_sizes[0]); i++) {
+				unsigned int w = common_sizes[i][0], h = common_sizes[i][1];
 
-			if (timeout_retries == max_timeout_retries)
-			{
-				fprintf(stderr, "Could not get frame after multiple retries\n");
-				return ERR;
+				if (
+					w > sw.min_width && w < sw.max_width &&
+					h > sw.min_height && h < sw.max_height &&
+					(w - sw.min_width) % (sw.step_width ? sw.step_width : 1) == 0 &&
+					(h - sw.min_height) % (sw.step_height ? sw.step_height : 1) == 0
+				)
+					add_size_modes(modes, fmtdesc, w, h);
 			}
+			add_size_modes(modes, fmtdesc, sw.max_width, sw.max_height);
+			break;
+		}
+	}
+
+	if (modes.empty()) {
+		fprintf(stderr, "cam #%d: the device did not list any modes\n", camidx);
+		return ERR;
+	}
+
+	if (known)
+		mode_cache->store(dev, modes);
+	return 0;
+}
+
+/*
+ * Stepwise / continuous frame sizes are only listed at a few points of their
+ * range (see enumerate_modes()). When none of those meets the constraints,
+ * the size they ask for is tried with VIDIOC_TRY_FMT in each format listed,
+ * and added with its frame intervals where the driver keeps it as it is.
+ * The mode cache is left alone. Returns the number of modes added.
+ */
+size_t CamV4L2::probe_size_modes(std::vector<CameraMode> &modes,
+    const ModeConstraints &constraints) {
+	unsigned int width = constraints.max_width ? constraints.max_width : constraints.min_width;
+	unsigned int height = constraints.max_height ? constraints.max_height : constraints.min_height;
+	std::vector<__u32> tried;
+	size_t i, listed = modes.size();
+
+	if (!width || !height)
+		return 0;
+
+	for (i = 0; i < listed; i++) {
+		const CameraMode m = modes[i];
+		struct v4l2_format fmt;
+		struct v4l2_fmtdesc fmtdesc;
+		bool kept;
+
+		if (std::find(tried.begin(), tried.end(), m.pixelformat) != tried.end())
+			continue;
+		tried.push_back(m.pixelformat);
+
+		CLEAR(fmt);
+		fmt.type = buf_type;
+		if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+			fmt.fmt.pix_mp.width = width;
+			fmt.fmt.pix_mp.height = height;
+			fmt.fmt.pix_mp.pixelformat = m.pixelformat;
+			fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+		} else {
+			fmt.fmt.pix.width = width;
+			fmt.fmt.pix.height = height;
+			fmt.fmt.pix.pixelformat = m.pixelformat;
+			fmt.fmt.pix.field = V4L2_FIELD_ANY;
 		}
 
-		CLEAR(frame_buf);
-		frame_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (-1 == xioctl(fd, VIDIOC_TRY_FMT, &fmt))
+			continue;
+
+		if (V4L2_TYPE_IS_MULTIPLANAR(buf_type))
+			kept = fmt.fmt.pix_mp.width == width && fmt.fmt.pix_mp.height == height &&
+				fmt.fmt.pix_mp.pixelformat == m.pixelformat;
+		else
+			kept = fmt.fmt.pix.width == width && fmt.fmt.pix.height == height &&
+				fmt.fmt.pix.pixelformat == m.pixelformat;
+		if (!kept)
+			continue;
+
+		CLEAR(fmtdesc);
+		fmtdesc.pixelformat = m.pixelformat;
+		fmtdesc.flags = m.compressed ? V4L2_FMT_FLAG_COMPRESSED : 0;
+		add_size_modes(modes, fmtdesc, width, height);
+	}
 
-		if (-1 == xioctl(fd, VIDIOC_DQBUF, &frame_buf)) {
-			switch (errno) {
-				case EAGAIN:
-					continue;
+	if (modes.size() > listed)
+		std::cout << "cam #" << camidx << ": " << width << "x" << height
+			<< " is not listed, the driver accepts it in " << modes.size() - listed
+			<< " more mode(s)" << std::endl;
+	return modes.size() - listed;
+}
+
+int CamV4L2::select_mode(const std::vector<CameraMode> &modes,
+    const ModeConstraints &constraints, CameraMode *best) {
+	int best_rank = -1;
+	size_t i;
+
+	for (i = 0; i < modes.size(); i++) {
+		const CameraMode &m = modes[i];
+		int rank;
+
+		if (
+			m.width < constraints.min_width ||
+			m.height < constraints.min_height ||
+			(constraints.max_width && m.width > constraints.max_width) ||
+			(constraints.max_height && m.height > constraints.max_height) ||
+			m.fps() < constraints.min_fps
+		)
+			continue;
+
+		if (constraints.formats.empty()) {
+			rank = format_cost(m);
+			if (rank < 0)
+				continue;
+		} else {
+			std::vector<__u32>::const_iterator it = std::find(constraints.formats.begin(),
+					constraints.formats.end(), m.pixelformat);
 
-				case EIO:
-					/* Could ignore EIO, see spec. */
+			if (it == constraints.formats.end())
+				continue;
+			rank = it - constraints.formats.begin();
+		}
 
-					/* fall through */
+		if (best_rank >= 0) {
+			/* Frame rates within 0.1% are treated as the same. */
+			double diff = m.fps() - best->fps();
 
-				default:
+			if (diff < -0.001 * best->fps())
+				continue;
+			if (diff <= 0.001 * best->fps()) {
+				if (rank > best_rank)
+					continue;
+				if (rank == best_rank &&
+					(uint64_t) m.width * m.height <= (uint64_t) best->width * best->height)
 					continue;
 			}
 		}
-		*pointer_to_cam_data = (unsigned char*) buffers[frame_buf.index].start;
+
+		*best = m;
+		best_rank = rank;
+	}
+
+	return best_rank >= 0 ? 0 : ERR;
+}
+
+int CamV4L2::set_frame_interval(struct v4l2_fract interval) {
+	struct v4l2_streamparm parm;
+
+	CLEAR(parm);
+	parm.type = buf_type;
+
+	if (
+		-1 == xioctl(fd, VIDIOC_G_PARM, &parm) ||
+		!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)
+	)
+	{
+		fprintf(stderr, "cam #%d: the driver does not support setting the frame rate\n", camidx);
+		return ERR;
+	}
+
+	parm.parm.capture.timeperframe = interval;
+	if (-1 == xioctl(fd, VIDIOC_S_PARM, &parm))
+	{
+		fprintf(stderr, "cam #%d: error occurred when setting the frame rate\n", camidx);
+		return ERR;
+	}
+
+	/* The driver may round the interval. */
+	cur_mode.interval = parm.parm.capture.timeperframe;
+	printf("frame rate = %.2f fps\n", cur_mode.fps());
+	return 0;
+}
+
+CameraMode CamV4L2::current_mode() const {
+	return cur_mode;
+}
+
+/*
+ * Makes a single attempt at dequeueing a filled buffer into 'buf'.
+ * Returns 0 when a buffer was obtained and 1 when none is ready yet.
+ * Called with cfg_lock held.
+ */
+int CamV4L2::dequeue_buffer(struct v4l2_buffer *buf, struct v4l2_plane *planes) {
+	if (reconfiguring)
+		return 1;
+
+	CLEAR(*buf);
+	memset(planes, 0, VIDEO_MAX_PLANES * sizeof(*planes));
+	buf->type = buf_type;
+	buf->memory = memory_type();
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+		buf->m.planes = planes;
+		buf->length = n_planes;
+	}
+
+	if (-1 == xioctl(fd, VIDIOC_DQBUF, buf)) {
+		switch (errno) {
+			case EAGAIN:
+				return 1;
+
+			case EIO:
+				/* Could ignore EIO, see spec. */
+
+				/* fall through */
+
+			default:
+				return 1;
+		}
+	}
+	if (IO_METHOD_DMABUF == io)
+		sync_buffer(buf->index, DMA_BUF_SYNC_START);
+
+	/* The driver has no buffer left to fill: frames get dropped. */
+	if (n_queued > 0 && --n_queued == 0) {
+		stats.starved++;
+		starve_start_us = monotonic_us();
+	}
+
+	track_dequeue(*buf);
+	return 0;
+}
+
+/*
+ * Makes a single attempt at dequeueing a filled buffer.
+ * Returns 0 when a frame was obtained and 1 when none is ready yet.
+ */
+int CamV4L2::dequeue_frame(unsigned char** pointer_to_cam_data, int *size) {
+	std::lock_guard<std::mutex> guard(*cfg_lock);
+
+	if (dequeue_buffer(&frame_buf, frame_planes) != 0)
+		return 1;
+
+	last_skipped = 0;
+	if (latest_frame)
+		drain_to_latest();
+
+	if (copy_out && copy_out_frame() < 0) {
+		return_buffer(frame_buf.index);
+		return 1;
+	}
+
+	/* With several planes, this is the first one (see get_frame_planes). */
+	*pointer_to_cam_data = (unsigned char*) (copy_out ? copy_bufs :
+			&buffers[frame_buf.index * n_planes])->start;
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+		*pointer_to_cam_data += frame_planes[0].data_offset;
+		*size = frame_planes[0].bytesused - frame_planes[0].data_offset;
+	} else {
 		*size = frame_buf.bytesused;
-		break;
-		/* EAGAIN - continue select loop. */
 	}
 
 	is_released = 0;
+	note_held();
 	return 0;
 }
 
-void CamV4L2::start_thread() {
-	runner = std::thread(&CamV4L2::run_thread, this);
+/*
+ * Latest-frame mode: dequeues whatever else is ready without waiting, giving
+ * each older frame back to the driver. Called with cfg_lock held.
+ */
+void CamV4L2::drain_to_latest(void) {
+	struct v4l2_buffer newer;
+	struct v4l2_plane newer_planes[VIDEO_MAX_PLANES];
+
+	while (dequeue_buffer(&newer, newer_planes) == 0) {
+		return_buffer(frame_buf.index);
+
+		frame_buf = newer;
+		memcpy(frame_planes, newer_planes, sizeof(frame_planes));
+		if (V4L2_TYPE_IS_MULTIPLANAR(buf_type))
+			frame_buf.m.planes = frame_planes;
+		last_skipped++;
+		stats.skipped++;
+	}
 }
 
-void CamV4L2::stop_thread() {
-	running = false;
-	runner.join();
+/*
+ * Copy-out mode: copies the frame just dequeued into copy_bufs and gives the
+ * buffer straight back to the driver, so it never waits for the conversion.
+ * Called with cfg_lock held.
+ */
+int CamV4L2::copy_out_frame(void) {
+	uint64_t t0 = monotonic_us();
+	unsigned int p;
+
+	for (p = 0; p < n_planes; p++) {
+		const struct buffer *b = &buffers[frame_buf.index * n_planes + p];
+		size_t used = V4L2_TYPE_IS_MULTIPLANAR(buf_type) ?
+			frame_planes[p].bytesused : frame_buf.bytesused;
+
+		if (used == 0 || used > b->length)
+			used = b->length;
+
+		/* Grown on demand, e.g. after a switch to a larger format. */
+		if (copy_bufs[p].length < b->length) {
+			struct pool_block blk;
+
+			pool_free(copy_bufs[p].start, copy_bufs[p].pool_length);
+			memset(&copy_bufs[p], 0, sizeof(copy_bufs[p]));
+			if (pool_alloc(&blk, b->length, pool_flags, buffer_node) != 0) {
+				fprintf(stderr, "cam #%d: out of memory for the copy-out buffer\n", camidx);
+				return ERR;
+			}
+			copy_bufs[p].start = blk.start;
+			copy_bufs[p].length = b->length;
+			copy_bufs[p].pool_length = blk.map_length;
+			copy_bufs[p].dmabuf_fd = -1;
+		}
+
+		copy_frame(copy_bufs[p].start, b->start, used);
+	}
+
+	stats.copy_out.add(monotonic_us() - t0);
+	return return_buffer(frame_buf.index);
 }
 
-int CamV4L2::run_thread() {
-	std::cout << "start thread #" << camidx << std::endl;
-	start = GetTickCount();
-	while (running) {
-		if (helper_get_cam_frame(&ptr_cam_frame, &bytes_used) < 0) {
-			return -1;
-			break;
-		}
+/*
+ * Waits up to timeout_ms for the device to have a frame (or an error) to
+ * dequeue. Returns 0 when it has, 1 on timeout and 2 when woken up by
+ * request_stop().
+ */
+int CamV4L2::wait_for_frame(int timeout_ms) {
+	struct pollfd pfd[2];
+	uint64_t count;
+	int r;
 
-		/*
-			* It's easy to re-use the matrix for our case (V4L2 user pointer) by changing the
-			* member 'data' to point to the data obtained from the V4L2 helper.
-			*/
-		yuyv_frame.data = ptr_cam_frame;
-		if (yuyv_frame.empty()) {
-			std::cout << "cam #" << camidx << ": Img load failed" << std::endl;
-			return -1;
-			break;
-		}
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wake_fd;
+	pfd[1].events = POLLIN;
+	pfd[0].revents = pfd[1].revents = 0;
+
+	r = poll(pfd, wake_fd >= 0 ? 2 : 1, timeout_ms);
+	if (-1 == r)
+		return EINTR == errno ? 0 : ERR;
+	if (0 == r)
+		return 1;
+	if (pfd[1].revents & POLLIN) {
+		if (read(wake_fd, &count, sizeof(count)) < 0 && EAGAIN != errno)
+			fprintf(stderr, "cam #%d: error occurred when reading wakeup fd\n", camidx);
+		return 2;
+	}
+	return 0;
+}
 
-		/*
-			* 1. We do not use the cv::cuda::cvtColor (along with cv::cuda::GpuMat matrices) for color
-			*    space conversion as cv::cuda::cvtColor does not support color space conversion from
-			*    UYVY to BGR (at least in OpenCV 3.3.1 and OpenCV 3.4.2).
-			*
-			*    The performance might differ for higher resolutions if it did support the color
-			*    conversion.
-			*
-			* 2. Other formats: To use formats other than UYVY, the third parameter of cv::cvtColor must
-			*    be modified to the corresponding color converison code[3].
-			*
-			* [3]: https://docs.opencv.org/3.4.2/d7/d1b/group__imgproc__misc.html#ga4e0972be5de079fed4e3a10e24ef5ef0
-			*/
-		cv::cvtColor(yuyv_frame, preview, cv::COLOR_YUV2BGR_UYVY);
-		if (enable_display) {
-			// cv::imshow(winname, preview);
-			// cv::waitKey(1);
-			cv::imwrite(savepath + std::to_string(savecnt) + ".png", preview);
-			savecnt++;
-		}
-		
-		if (helper_release_cam_frame() < 0) {
-			break;
+int CamV4L2::helper_get_cam_frame(
+    unsigned char** pointer_to_cam_data, int *size) {
+    static unsigned char max_timeout_retries = 10;
+	unsigned char timeout_retries = 0;
+
+	if (!is_initialised)
+	{
+		fprintf (stderr, "Error: trying to get frame without successfully initialising camera\n");
+		return ERR;
+	}
+
+	if (!is_released)
+	{
+		fprintf (stderr, "Error: trying to get another frame without releasing already obtained frame\n");
+		return ERR;
+	}
+
+	for (;;) {
+		int r;
+
+		{
+			/* The stream is off while reconfiguring, wait for it instead. */
+			std::unique_lock<std::mutex> guard(*cfg_lock);
+			cfg_cond->wait(guard, [this] { return !reconfiguring; });
 		}
 
-		fps++;
-		end = GetTickCount();
-		if ((end - start) >= 1000) {
-			std::cout << "cam #" << camidx << " - fps = " << fps << std::endl ;
-			fps = 0;
-			start = end;
+		/* Timeout: 2 s, but a stop request ends the wait at once. */
+		r = wait_for_frame(2000);
+
+		if (2 == r)
+			return 1;
+
+		if (1 == r) {
+			fprintf(stderr, "poll timeout\n");
+			timeout_retries++;
+
+			if (timeout_retries == max_timeout_retries)
+			{
+				fprintf(stderr, "Could not get frame after multiple retries\n");
+				return ERR;
+			}
 		}
+
+		/* EAGAIN - continue select loop. */
+		if (dequeue_frame(pointer_to_cam_data, size) == 0)
+			break;
 	}
+
 	return 0;
 }
 
-int CamV4L2::helper_release_cam_frame() {
-    if (!is_initialised)
+int CamV4L2::helper_try_get_cam_frame(
+    unsigned char** pointer_to_cam_data, int *size) {
+	if (!is_initialised)
 	{
-		fprintf (stderr, "Error: trying to release frame without successfully initialising camera\n");
+		fprintf (stderr, "Error: trying to get frame without successfully initialising camera\n");
 		return ERR;
 	}
 
-	if (is_released)
+	if (!is_released)
 	{
-		fprintf (stderr, "Error: trying to release already released frame\n");
+		fprintf (stderr, "Error: trying to get another frame without releasing already obtained frame\n");
 		return ERR;
 	}
 
-	if (-1 == xioctl(fd, VIDIOC_QBUF, &frame_buf))
+	return dequeue_frame(pointer_to_cam_data, size);
+}
+
+/*
+ * Hands buffers to OpenCV as the backing store of cv::Mat headers: the buffer
+ * is queued back to the driver once the last Mat referring to it is released.
+ * Only deallocate() is ever reached for such Mats, as their UMatData is
+ * created by CamV4L2::acquire_frame() rather than by allocate().
+ */
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag access_flag_t;
+typedef cv::UMatUsageFlags usage_flag_t;
+#else
+typedef int access_flag_t;
+typedef cv::UMatUsageFlags usage_flag_t;
+#endif
+
+class FrameAllocator : public cv::MatAllocator {
+	public:
+		cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+				size_t* step, access_flag_t flags, usage_flag_t usage) const {
+			/* Copies (e.g. Mat::clone) get ordinary heap memory. */
+			return cv::Mat::getStdAllocator()->allocate(dims, sizes, type,
+					data, step, flags, usage);
+		}
+
+		bool allocate(cv::UMatData*, access_flag_t, usage_flag_t) const {
+			return false;
+		}
+
+		void deallocate(cv::UMatData* u) const {
+			if (!u)
+				return;
+			((CamV4L2 *) u->userdata)->release_handle((unsigned int) (uintptr_t) u->handle);
+			delete u;
+		}
+};
+
+static FrameAllocator frame_allocator;
+
+int CamV4L2::acquire_frame(cv::Mat &frame, std::vector<cv::Mat> *planes, int timeout_ms) {
+	struct v4l2_buffer buf;
+	struct v4l2_plane info[VIDEO_MAX_PLANES];
+	std::vector<cv::Mat> views;
+	cv::UMatData *u;
+	size_t i;
+
+	if (!is_initialised || IO_METHOD_READ == io)
 	{
-		fprintf(stderr, "Error occurred when queueing frame for re-capture\n");
+		fprintf (stderr, "Error: frame handles need an initialised, streaming camera\n");
 		return ERR;
 	}
 
 	/*
-	 * We assume the frame hasn't been released if an error occurred as
-	 * we couldn't queue the frame for streaming.
-	 *
-	 * Assuming it to be released in case an error occurs causes issues
-	 * such as the loss of a buffer, etc.
+	 * Frames held as handles are never released through
+	 * helper_release_cam_frame(), so queued control changes are applied
+	 * here instead, before the next frame and with no lock held.
 	 */
-	is_released = 1;
+	if (!ctrl_queue->empty())
+		apply_pending_controls();
+
+	for (;;) {
+		int r;
+
+		{
+			std::unique_lock<std::mutex> guard(*cfg_lock);
+
+			cfg_cond->wait(guard, [this] { return !reconfiguring; });
+			if (dequeue_buffer(&buf, info) == 0) {
+				handles_out++;
+				note_held();
+				if (build_plane_views(&buffers[buf.index * n_planes], info, views) < 0 || views.empty())
+					break;
+
+				/*
+				 * A single memory plane holding several colour planes
+				 * is returned whole, the way OpenCV expects e.g. NV12.
+				 */
+				if (n_planes == 1 && views.size() > 1) {
+					size_t bpl = views[0].step[0];
+					size_t bytes = 0;
+
+					for (i = 0; i < views.size(); i++)
+						bytes += views[i].step[0] * views[i].rows;
+					frame = cv::Mat(bytes / bpl, bpl, CV_8UC1, views[0].data, bpl);
+				} else {
+					frame = views[0];
+				}
+				break;
+			}
+		}
+
+		r = wait_for_frame(timeout_ms);
+		if (r == 1)
+			fprintf(stderr, "cam #%d: no frame within %d ms\n", camidx, timeout_ms);
+		if (r != 0)
+			return r < 0 ? ERR : 1;
+	}
+
+	if (views.empty()) {
+		release_handle(buf.index);
+		return ERR;
+	}
+
+	/* One UMatData shared by all views, so any of them keeps the buffer. */
+	u = new cv::UMatData(&frame_allocator);
+	u->userdata = this;
+	u->handle = (void *) (uintptr_t) buf.index;
+	u->data = u->origdata = frame.data;
+	u->size = buffers[buf.index * n_planes].length;
+	u->flags |= cv::UMatData::USER_ALLOCATED;
+
+	frame.allocator = &frame_allocator;
+	frame.u = u;
+	u->refcount++;
+	if (planes) {
+		*planes = views;
+		for (i = 0; i < planes->size(); i++) {
+			(*planes)[i].allocator = &frame_allocator;
+			(*planes)[i].u = u;
+			u->refcount++;
+		}
+	}
 	return 0;
 }
 
-int CamV4L2::helper_deinit_cam() {
-    if (!is_initialised)
-	{
-		fprintf(stderr, "Error: trying to de-initialise without initialising camera\n");
+/*
+ * Hands a buffer the application is done with back to the driver, or parks
+ * it when the queue is to shrink. Called with cfg_lock held.
+ */
+int CamV4L2::return_buffer(unsigned int index) {
+	if (IO_METHOD_DMABUF == io)
+		sync_buffer(index, DMA_BUF_SYNC_END);
+
+	if (park_next) {
+		parked.push_back(index);
+		park_next = false;
+	} else if (-1 == queue_buffer(index)) {
+		fprintf(stderr, "cam #%d: error occurred when re-queueing buffer %u\n",
+				camidx, index);
 		return ERR;
 	}
+	return 0;
+}
 
-	/*
-	 * It's better to turn off is_initialised even if the
-	 * de-initialisation fails as it shouldn't have affect
-	 * re-initialisation a lot.
+void CamV4L2::release_handle(unsigned int index) {
+	std::lock_guard<std::mutex> guard(*cfg_lock);
+
+	return_buffer(index);
+	handles_out--;
+	if (adaptive)
+		adapt_queue_depth();
+	/* Let a pending reconfiguration or de-initialisation go ahead. */
+	cfg_cond->notify_all();
+}
+
+/* Clears a wakeup left over from an earlier stop request. */
+void CamV4L2::arm_thread() {
+	uint64_t count;
+
+	if (wake_fd >= 0 && read(wake_fd, &count, sizeof(count)) < 0 && EAGAIN != errno)
+		fprintf(stderr, "cam #%d: error occurred when reading wakeup fd\n", camidx);
+	*running = true;
+}
+
+void CamV4L2::start_thread() {
+	arm_thread();
+	runner = std::thread(&CamV4L2::run_thread, this);
+}
+
+void CamV4L2::start_thread(FrameRing *ring) {
+	arm_thread();
+	runner = std::thread(&CamV4L2::run_ring_thread, this, ring);
+}
+
+void CamV4L2::request_stop() {
+	uint64_t one = 1;
+
+	*running = false;
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "cam #%d: error occurred when waking capture thread\n", camidx);
+}
+
+bool CamV4L2::is_running() const {
+	return *running;
+}
+
+void CamV4L2::stop_thread() {
+	request_stop();
+	if (runner.joinable())
+		runner.join();
+}
+
+int CamV4L2::run_thread() {
+	std::string who = "cam #" + std::to_string(camidx);
+
+	std::cout << "start thread #" << camidx << std::endl;
+	if (placement_apply(placement, who.c_str()) < 0) {
+		*running = false;
+		return -1;
+	}
+	start = GetTickCount();
+	while (*running) {
+		int r = helper_get_cam_frame(&ptr_cam_frame, &bytes_used);
+
+		if (r > 0)
+			continue;
+		if (r < 0 || process_frame() < 0) {
+			/* Lets the application notice the failure, see is_running(). */
+			*running = false;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Capture side of a FrameRing: only dequeues and publishes. Frames are
+ * zero-copy handles, so a frame dropped by the ring or released by the
+ * consumer goes straight back to the driver.
+ */
+int CamV4L2::run_ring_thread(FrameRing *ring) {
+	std::string who = "cam #" + std::to_string(camidx);
+	int ret = 0;
+
+	std::cout << "start capture thread #" << camidx << std::endl;
+	if (placement_apply(placement, who.c_str()) < 0) {
+		*running = false;
+		ring->close();
+		return -1;
+	}
+
+	while (*running) {
+		FrameSlot *slot;
+		cv::Mat frame;
+		std::vector<cv::Mat> planes;
+		int r = acquire_frame(frame, &planes);
+
+		if (r > 0)
+			continue;
+		if (r < 0) {
+			*running = false;
+			ret = -1;
+			break;
+		}
+
+		/* With RING_BLOCK this waits for the consumer. */
+		slot = ring->begin_write();
+		if (!slot) {
+			if (ring->is_closed())
+				break;
+			continue;
+		}
+		slot->frame = frame;
+		slot->planes = planes;
+		slot->dequeue_us = monotonic_us();
+		ring->publish();
+	}
+
+	ring->close();
+	return ret;
+}
+
+int CamV4L2::process_frame() {
+	/*
+	 * The planes of the frame are wrapped in matrices with the line pitch the
+	 * driver reported, which may include padding past the last pixel.
+	 */
+	if (get_frame_planes(plane_views) < 0 || plane_views.empty()) {
+		std::cout << "cam #" << camidx << ": Img load failed" << std::endl;
+		return -1;
+	}
+	yuyv_frame = plane_views[0];
+
+	/*
+	 * 1. We do not use the cv::cuda::cvtColor (along with cv::cuda::GpuMat matrices) for color
+	 *    space conversion as cv::cuda::cvtColor does not support color space conversion from
+	 *    UYVY to BGR (at least in OpenCV 3.3.1 and OpenCV 3.4.2).
+	 *
+	 *    The performance might differ for higher resolutions if it did support the color
+	 *    conversion.
+	 *
+	 * 2. The kernel comes from the PixelFormatTraits of the format the driver settled on
+	 *    (see pixel_format.hpp). The 4:2:2 formats go through the vectorized kernels of
+	 *    yuv_convert, which give the same result as cv::cvtColor but run faster on a single
+	 *    core. To use other formats, add traits for them.
+	 */
+	if (pix_ops) {
+		ConvertParams params;
+
+		params.scale = preview_scale;
+		params.pool = stripe_pool;
+		params.demosaic = demosaic;
+		pix_ops->to_bgr(plane_views, preview, params, full_preview);
+	} else {
+		/* Formats with a memory plane per colour plane (see plane_layouts). */
+		if (convert_split_planes(preview_scale > 1 ? full_preview : preview) < 0)
+		{
+			std::cout << "cam #" << camidx << ": unsupported pixel format" << std::endl;
+			return -1;
+		}
+		if (preview_scale > 1)
+			cv::resize(full_preview, preview, cv::Size(full_preview.cols / preview_scale,
+					full_preview.rows / preview_scale), 0, 0, cv::INTER_AREA);
+	}
+	mark_converted();
+	return finish_frame();
+}
+
+/*
+ * Converts the formats of plane_layouts, which keep each colour plane in a
+ * memory plane of its own. NV16M goes through the NV16 kernel of yuv_convert
+ * (NV61M after swapping its chroma into place); the 4:2:0 ones are packed
+ * back to back for OpenCV, which only takes them in one buffer.
+ */
+int CamV4L2::convert_split_planes(cv::Mat &bgr) {
+	__u32 fourcc = cur_fmt.fmt.pix_mp.pixelformat;
+	unsigned char *p;
+	size_t c;
+	int y;
+
+	if (!V4L2_TYPE_IS_MULTIPLANAR(buf_type) || plane_views.size() != n_planes)
+		return ERR;
+
+	switch (fourcc) {
+		case V4L2_PIX_FMT_NV12M:
+		case V4L2_PIX_FMT_NV21M:
+			cv::cvtColorTwoPlane(plane_views[0], plane_views[1], bgr,
+					fourcc == V4L2_PIX_FMT_NV12M ?
+					cv::COLOR_YUV2BGR_NV12 : cv::COLOR_YUV2BGR_NV21);
+			return 0;
+
+		case V4L2_PIX_FMT_NV16M:
+			nv16_to_bgr(plane_views[0], plane_views[1], bgr, stripe_pool);
+			return 0;
+
+		case V4L2_PIX_FMT_NV61M: {
+			static const int swap_uv[] = { 0, 1, 1, 0 };
+
+			plane_scratch.create(plane_views[1].rows, plane_views[1].cols, CV_8UC2);
+			cv::mixChannels(&plane_views[1], 1, &plane_scratch, 1, swap_uv, 2);
+			nv16_to_bgr(plane_views[0], plane_scratch, bgr, stripe_pool);
+			return 0;
+		}
+
+		case V4L2_PIX_FMT_YUV420M:
+		case V4L2_PIX_FMT_YVU420M:
+			plane_scratch.create(plane_views[0].rows * 3 / 2, plane_views[0].cols, CV_8UC1);
+			p = plane_scratch.data;
+			for (c = 0; c < plane_views.size(); c++) {
+				const cv::Mat &v = plane_views[c];
+
+				for (y = 0; y < v.rows; y++, p += v.cols)
+					memcpy(p, v.ptr(y), v.cols);
+			}
+			cv::cvtColor(plane_scratch, bgr, fourcc == V4L2_PIX_FMT_YUV420M ?
+					cv::COLOR_YUV2BGR_I420 : cv::COLOR_YUV2BGR_YV12);
+			return 0;
+	}
+
+	return ERR;
+}
+
+/*
+ * Saves the converted frame when enabled, releases it and updates the fps.
+ */
+int CamV4L2::finish_frame() {
+	if (enable_display) {
+		// cv::imshow(winname, preview);
+		// cv::waitKey(1);
+		cv::imwrite(savepath + std::to_string(savecnt) + ".png", preview);
+		savecnt++;
+	}
+
+	if (helper_release_cam_frame() < 0) {
+		return -1;
+	}
+
+	fps++;
+	end = GetTickCount();
+	if ((end - start) >= 1000) {
+		uint64_t dropped = get_stats().dropped;
+
+		std::cout << "cam #" << camidx << " - fps = " << fps
+			<< ", dropped = " << dropped - last_dropped << std::endl ;
+		last_dropped = dropped;
+		fps = 0;
+		start = end;
+	}
+	return 0;
+}
+
+int CamV4L2::get_fd() const {
+	return fd;
+}
+
+int CamV4L2::try_get_frame(void) {
+	return helper_try_get_cam_frame(&ptr_cam_frame, &bytes_used);
+}
+
+int CamV4L2::helper_release_cam_frame() {
+	int ret;
+
+	{
+		std::lock_guard<std::mutex> guard(*cfg_lock);
+
+		ret = release_frame();
+		/* Let a pending helper_change_cam_res() go ahead. */
+		if (is_released)
+			cfg_cond->notify_all();
+	}
+
+	/*
+	 * Queued control changes are applied here, between two frames and with
+	 * no lock held, so they never hold up dequeueing on another thread.
+	 */
+	if (!ctrl_queue->empty())
+		apply_pending_controls();
+	return ret;
+}
+
+int CamV4L2::release_frame(void) {
+    if (!is_initialised)
+	{
+		fprintf (stderr, "Error: trying to release frame without successfully initialising camera\n");
+		return ERR;
+	}
+
+	if (is_released)
+	{
+		fprintf (stderr, "Error: trying to release already released frame\n");
+		return ERR;
+	}
+
+	if (IO_METHOD_DMABUF == io && !copy_out)
+		sync_buffer(frame_buf.index, DMA_BUF_SYNC_END);
+
+	if (converted_us)
+		stats.latency[LAT_CONVERTED_TO_RELEASE].add(monotonic_us() - converted_us);
+
+	if (copy_out)
+	{
+		/* The buffer went back to the driver once it was copied. */
+		is_released = 1;
+		if (adaptive)
+			adapt_queue_depth();
+		return 0;
+	}
+
+	if (park_next)
+	{
+		/* Shrink the queue by keeping this buffer out of it. */
+		parked.push_back(frame_buf.index);
+		park_next = false;
+		is_released = 1;
+		return 0;
+	}
+
+	if (-1 == xioctl(fd, VIDIOC_QBUF, &frame_buf))
+	{
+		fprintf(stderr, "Error occurred when queueing frame for re-capture\n");
+		return ERR;
+	}
+	note_queued();
+
+	/*
+	 * We assume the frame hasn't been released if an error occurred as
+	 * we couldn't queue the frame for streaming.
+	 *
+	 * Assuming it to be released in case an error occurs causes issues
+	 * such as the loss of a buffer, etc.
+	 */
+	is_released = 1;
+
+	if (adaptive)
+		adapt_queue_depth();
+	return 0;
+}
+
+void CamV4L2::set_adaptive_buffers(unsigned int min_buffers, unsigned int max_buffers) {
+	adaptive = max_buffers > 0;
+	min_buffs = min_buffers ? min_buffers : 2;
+	max_buffs = max_buffers < min_buffs ? min_buffs : max_buffers;
+}
+
+unsigned int CamV4L2::queue_depth() const {
+	return n_buffers - parked.size();
+}
+
+/*
+ * Records sequence gaps and capture-to-dequeue latency of the frame just
+ * dequeued, both into the telemetry and for adapt_queue_depth().
+ */
+void CamV4L2::track_dequeue(const struct v4l2_buffer &buf) {
+	uint64_t ts = (uint64_t) buf.timestamp.tv_sec * 1000000 +
+		buf.timestamp.tv_usec;
+	unsigned int gap = 0;
+	dqbuf_us = monotonic_us();
+	converted_us = 0;
+	stats.frames++;
+
+	if (streamon_us) {
+		startup.first_frame_ms = (dqbuf_us - streamon_us) / 1000.0;
+		streamon_us = 0;
+	}
+
+	if (switch_start_us) {
+		std::cout << "cam #" << camidx << " - first frame "
+			<< (dqbuf_us - switch_start_us) / 1000.0
+			<< " ms after the switch started" << std::endl;
+		switch_start_us = 0;
+	}
+
+	if (seq_valid && buf.sequence > last_sequence + 1)
+		gap = buf.sequence - last_sequence - 1;
+	last_sequence = buf.sequence;
+	seq_valid = true;
+	stats.dropped += gap;
+	win_drops += gap;
+
+	if ((buf.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE)
+		stats.ts_soe++;
+	else
+		stats.ts_eof++;
+
+	/* Latency is only meaningful with timestamps taken from the same clock. */
+	if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+		V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC && ts != 0) {
+		uint64_t latency = dqbuf_us > ts ? dqbuf_us - ts : 0;
+
+		stats.latency[LAT_CAPTURE_TO_DQBUF].add(latency);
+		if (latency > win_max_latency_us)
+			win_max_latency_us = latency;
+		if (win_frames == 0)
+			win_first_ts = ts;
+		win_last_ts = ts;
+	} else {
+		/* COPY or UNKNOWN timestamps can't be compared with our clock. */
+		stats.ts_unusable++;
+	}
+
+	if (win_frames == 0)
+		win_start = GetTickCount();
+	win_frames++;
+}
+
+void CamV4L2::mark_converted(void) {
+	converted_us = monotonic_us();
+	stats.latency[LAT_DQBUF_TO_CONVERTED].add(converted_us - dqbuf_us);
+}
+
+CaptureStats CamV4L2::get_stats(void) const {
+	return stats;
+}
+
+void CamV4L2::reset_stats(void) {
+	stats.reset();
+}
+
+StartupTiming CamV4L2::get_startup_timing(void) const {
+	return startup;
+}
+
+/*
+ * Called after a frame is released. Grows the queue by one buffer when frames
+ * were dropped in the last window, and shrinks it by one after a run of windows
+ * where capture kept up with time to spare, so that every camera settles at the
+ * smallest depth that doesn't drop frames.
+ *
+ * Growing re-uses a parked buffer if there is one, otherwise a buffer is added
+ * with VIDIOC_CREATE_BUFS, falling back to re-requesting all buffers. That is
+ * skipped while any frame is held; a later window with drops tries again.
+ * Shrinking parks the next released buffer (keeps it dequeued) instead of
+ * re-requesting, as restarting the stream would itself drop frames.
+ */
+void CamV4L2::adapt_queue_depth(void) {
+	uint64_t frame_period = 0;
+	unsigned int depth = queue_depth();
+	int ret;
+
+	if (win_frames < 2 || GetTickCount() - win_start < ADAPT_WINDOW_MS)
+		return;
+
+	if (win_last_ts > win_first_ts)
+		frame_period = (win_last_ts - win_first_ts) / (win_frames - 1);
+
+	if (win_drops > 0) {
+		calm_windows = 0;
+		/* Dropping right after a shrink: don't go that low again. */
+		if (just_shrunk && depth + 1 > min_buffs)
+			min_buffs = depth + 1;
+		just_shrunk = false;
+		if (depth < max_buffs) {
+			std::cout << "cam #" << camidx << " - " << win_drops
+				<< " frame(s) dropped, queue depth " << depth
+				<< " -> " << depth + 1 << std::endl;
+			ret = grow_queue();
+			if (ret < 0)
+				fprintf(stderr, "cam #%d: could not grow the buffer queue\n", camidx);
+			else if (ret > 0)
+				fprintf(stderr, "cam #%d: growing the buffer queue deferred, "
+						"frames are still held\n", camidx);
+		}
+	} else if (frame_period && win_max_latency_us < frame_period) {
+		calm_windows++;
+		if (calm_windows >= ADAPT_SHRINK_WINDOWS && depth > min_buffs) {
+			std::cout << "cam #" << camidx << " - queue depth " << depth
+				<< " -> " << depth - 1 << std::endl;
+			park_next = true;
+			just_shrunk = true;
+			calm_windows = 0;
+		}
+	} else {
+		calm_windows = 0;
+	}
+
+	win_frames = 0;
+	win_drops = 0;
+	win_max_latency_us = 0;
+	win_first_ts = win_last_ts = 0;
+}
+
+int CamV4L2::grow_queue(void) {
+	if (!parked.empty()) {
+		if (-1 == queue_buffer(parked.back()))
+			return ERR;
+		parked.pop_back();
+		return 0;
+	}
+
+	if (IO_METHOD_READ == io || (IO_METHOD_DMABUF == io && !import_fds.empty()))
+		return ERR;
+
+	if (add_buffer() == 0)
+		return 0;
+
+	/*
+	 * VIDIOC_CREATE_BUFS isn't supported; re-request the whole queue. That
+	 * unmaps every buffer, so it waits until no frame is held: zero-copy
+	 * handles and the frame of helper_get_cam_frame() point into them.
+	 */
+	if (handles_out > 0 || !is_released)
+		return 1;
+	return restart_with_buffers(n_buffers + 1);
+}
+
+/*
+ * Adds one buffer to the queue while streaming, using VIDIOC_CREATE_BUFS.
+ */
+int CamV4L2::add_buffer(void) {
+	struct v4l2_create_buffers create;
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct buffer *grown, *b;
+	size_t page_size = getpagesize();
+	unsigned int p;
+
+	CLEAR(create);
+	create.count = 1;
+	create.memory = memory_type();
+	create.format = cur_fmt;
+
+	if (-1 == xioctl(fd, VIDIOC_CREATE_BUFS, &create) || create.count < 1)
+		return ERR;
+
+	if (create.index != n_buffers) {
+		fprintf(stderr, "cam #%d: unexpected buffer index from driver\n", camidx);
+		return ERR;
+	}
+
+	grown = (struct buffer *) realloc(buffers, (n_buffers + 1) * n_planes * sizeof(*buffers));
+	if (!grown) {
+		fprintf(stderr, "Out of memory\n");
+		return ERR;
+	}
+	buffers = grown;
+	b = &buffers[n_buffers * n_planes];
+	memset(b, 0, n_planes * sizeof(*b));
+
+	if (IO_METHOD_MMAP == io) {
+		CLEAR(buf);
+		CLEAR(planes);
+		buf.type = buf_type;
+		buf.memory = create.memory;
+		buf.index = n_buffers;
+		if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+			buf.m.planes = planes;
+			buf.length = n_planes;
+		}
+		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
+			return ERR;
+	}
+
+	for (p = 0; p < n_planes; p++) {
+		b[p].dmabuf_fd = -1;
+
+		switch (io) {
+			case IO_METHOD_MMAP:
+			{
+				off_t offset;
+
+				if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+					b[p].length = planes[p].length;
+					offset = planes[p].m.mem_offset;
+				} else {
+					b[p].length = buf.length;
+					offset = buf.m.offset;
+				}
+				b[p].start = mmap(NULL, b[p].length, PROT_READ | PROT_WRITE,
+						MAP_SHARED, fd, offset);
+				if (MAP_FAILED == b[p].start)
+					return ERR;
+				break;
+			}
+
+			case IO_METHOD_USERPTR:
+			{
+				struct pool_block blk;
+
+				b[p].length = plane_size(p);
+				if (pool_alloc(&blk, b[p].length, pool_flags, buffer_node) != 0)
+					return ERR;
+				b[p].start = blk.start;
+				b[p].pool_length = blk.map_length;
+				break;
+			}
+
+			case IO_METHOD_DMABUF:
+				b[p].length = (plane_size(p) + page_size - 1) & ~(page_size - 1);
+				b[p].dmabuf_fd = alloc_udmabuf(b[p].length);
+				if (-1 == b[p].dmabuf_fd)
+					return ERR;
+				b[p].start = mmap(NULL, b[p].length, PROT_READ | PROT_WRITE,
+						MAP_SHARED, b[p].dmabuf_fd, 0);
+				if (MAP_FAILED == b[p].start) {
+					close(b[p].dmabuf_fd);
+					return ERR;
+				}
+				break;
+
+			default:
+				return ERR;
+		}
+	}
+
+	/* The buffer is owned by us from here on, even if queueing fails. */
+	n_buffers++;
+
+	if (-1 == queue_buffer(n_buffers - 1))
+		return ERR;
+
+	return 0;
+}
+
+/*
+ * Stops the stream and re-requests all buffers with a new count.
+ */
+int CamV4L2::restart_with_buffers(unsigned int count) {
+	enum v4l2_buf_type type = buf_type;
+	int ret;
+
+	if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+		return ERR;
+
+	/*
+	 * Unmap before re-requesting, older kernels refuse to free buffers
+	 * that are still mapped.
+	 */
+	parked.clear();
+	park_next = false;
+	seq_valid = false;
+	uninit_device();
+	num_buffs = count;
+
+	switch (io) {
+		case IO_METHOD_MMAP:
+			ret = init_mmap();
+			break;
+		case IO_METHOD_USERPTR:
+			ret = init_userp();
+			break;
+		default:
+			ret = init_dmabuf();
+			break;
+	}
+
+	if (ret < 0 || start_capturing() < 0) {
+		fprintf(stderr, "cam #%d: error occurred when restarting stream\n", camidx);
+		return ERR;
+	}
+
+	return 0;
+}
+
+/*
+ * Sets up the buffers for a newly negotiated format. With 'reuse' the
+ * memory we own (USERPTR, dma-buf) is only handed to the driver again.
+ */
+int CamV4L2::reinit_buffers(bool reuse) {
+	struct v4l2_requestbuffers req;
+
+	if (reuse) {
+		CLEAR(req);
+		req.count = n_buffers;
+		req.type = buf_type;
+		req.memory = memory_type();
+
+		if (0 == xioctl(fd, VIDIOC_REQBUFS, &req) && req.count >= n_buffers)
+			return 0;
+
+		/* The driver wants fewer buffers than we have; start afresh. */
+		uninit_device();
+	}
+
+	switch (io) {
+		case IO_METHOD_MMAP:
+			return init_mmap();
+		case IO_METHOD_USERPTR:
+			return init_userp();
+		case IO_METHOD_DMABUF:
+			return init_dmabuf();
+		default:
+			return ERR;
+	}
+}
+
+int CamV4L2::helper_change_cam_res(unsigned int width, unsigned int height,
+    unsigned int format, double *switch_ms) {
+	return reconfigure(width, height, format, NULL, switch_ms);
+}
+
+int CamV4L2::set_roi(const cv::Rect &roi, double *switch_ms) {
+	unsigned int format;
+
+	if (!is_initialised)
+	{
+		fprintf(stderr, "Error: trying to set the ROI without initialising camera\n");
+		return ERR;
+	}
+
+	/*
+	 * Moving a region of the same size doesn't change the buffers; drivers
+	 * that allow it take the new crop while streaming.
+	 */
+	if (roi.area() > 0 && roi.size() == cur_roi.size()) {
+		std::lock_guard<std::mutex> guard(*cfg_lock);
+		uint64_t t0 = monotonic_us();
+
+		if (set_crop(roi) == 0 && cur_roi == roi) {
+			if (switch_ms)
+				*switch_ms = (monotonic_us() - t0) / 1000.0;
+			return 0;
+		}
+	}
+
+	/* Otherwise restart the stream with frames the size of the region. */
+	format = cur_mode.pixelformat;
+	return reconfigure(roi.width, roi.height, format, &roi, switch_ms);
+}
+
+cv::Rect CamV4L2::get_roi() const {
+	return cur_roi;
+}
+
+/*
+ * Restarts the stream with a new format and, if 'roi' is given, crop.
+ */
+int CamV4L2::reconfigure(unsigned int width, unsigned int height,
+    unsigned int format, const cv::Rect *roi, double *switch_ms) {
+	std::unique_lock<std::mutex> guard(*cfg_lock);
+	struct v4l2_requestbuffers req;
+	enum v4l2_buf_type type = buf_type;
+	CameraMode old_mode = cur_mode;
+	cv::Rect old_roi = cur_roi;
+	unsigned int old_planes = n_planes, i;
+	bool keep, reuse;
+	uint64_t t0, elapsed;
+	int ret = 0;
+
+	if (!is_initialised)
+	{
+		fprintf(stderr, "Error: trying to change resolution without initialising camera\n");
+		return ERR;
+	}
+
+	if (IO_METHOD_READ == io || reconfiguring)
+	{
+		fprintf(stderr, "cam #%d: cannot change resolution now\n", camidx);
+		return ERR;
+	}
+
+	/* No new frames are handed out from here on; wait for the one in use. */
+	reconfiguring = true;
+	if (!cfg_cond->wait_for(guard, std::chrono::seconds(2),
+				[this] { return is_released != 0 && handles_out == 0; }))
+	{
+		fprintf(stderr, "cam #%d: the frame in use was not released\n", camidx);
+		reconfiguring = false;
+		cfg_cond->notify_all();
+		return ERR;
+	}
+
+	t0 = monotonic_us();
+
+	if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+	{
+		fprintf(stderr, "Error occurred when streaming off\n");
+		reconfiguring = false;
+		cfg_cond->notify_all();
+		return ERR;
+	}
+	parked.clear();
+	park_next = false;
+	seq_valid = false;
+
+	/*
+	 * Memory we allocated ourselves can outlive the driver's buffers; MMAP
+	 * buffers must be unmapped before they can be freed.
+	 */
+	keep = IO_METHOD_USERPTR == io || IO_METHOD_DMABUF == io;
+	if (!keep) {
+		uninit_device();
+	}
+
+	CLEAR(req);
+	req.count = 0;
+	req.type = buf_type;
+	req.memory = memory_type();
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+		fprintf(stderr, "cam #%d: error occurred when releasing buffers\n", camidx);
+
+	if (roi && set_crop(*roi) < 0 && roi->area() > 0)
+		ret = ERR;
+
+	/* A reset to the full frame gets frames of the default crop size. */
+	if (roi && width == 0) {
+		width = cur_roi.area() > 0 ? cur_roi.width : old_mode.width;
+		height = cur_roi.area() > 0 ? cur_roi.height : old_mode.height;
+	}
+
+	if (ret < 0 || set_format(width, height, format) < 0)
+	{
+		fprintf(stderr, "cam #%d: restoring the previous format\n", camidx);
+		if (roi)
+			set_crop(old_roi);
+		set_format(old_mode.width, old_mode.height, old_mode.pixelformat);
+		ret = ERR;
+	}
+
+	reuse = keep && n_planes == old_planes;
+	for (i = 0; reuse && i < n_buffers * n_planes; i++) {
+		if (buffers[i].length < plane_size(i % n_planes))
+			reuse = false;
+	}
+	if (keep && !reuse) {
+		/*
+		 * set_format() may have changed n_planes; the table still holds
+		 * old_planes entries per buffer and must be freed as such.
+		 */
+		unsigned int new_planes = n_planes;
+
+		n_planes = old_planes;
+		uninit_device();
+		n_planes = new_planes;
+	}
+
+	if (reinit_buffers(reuse) < 0 || start_capturing() < 0) {
+		fprintf(stderr, "cam #%d: error occurred when restarting stream\n", camidx);
+		ret = ERR;
+	}
+
+	/* It viewed a buffer of the old size. */
+	yuyv_frame.release();
+
+	elapsed = monotonic_us() - t0;
+	if (switch_ms)
+		*switch_ms = elapsed / 1000.0;
+	if (ret == 0) {
+		std::cout << "cam #" << camidx << " - switched to " << cur_mode.width
+			<< "x" << cur_mode.height << " in " << elapsed / 1000.0 << " ms ("
+			<< (reuse ? "buffers reused" : "buffers reallocated") << ")" << std::endl;
+		switch_start_us = t0;
+	}
+
+	reconfiguring = false;
+	cfg_cond->notify_all();
+	return ret;
+}
+
+bool CamV4L2::is_reconfiguring() {
+	std::lock_guard<std::mutex> guard(*cfg_lock);
+
+	return reconfiguring;
+}
+
+/*
+ * Builds the control map in one pass over VIDIOC_QUERY_EXT_CTRL.
+ */
+int CamV4L2::query_controls(void) {
+	struct v4l2_query_ext_ctrl qctrl;
+
+	controls.clear();
+
+	CLEAR(qctrl);
+	qctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+
+	while (0 == xioctl(fd, VIDIOC_QUERY_EXT_CTRL, &qctrl)) {
+		if (
+			!(qctrl.flags & V4L2_CTRL_FLAG_DISABLED) &&
+			qctrl.type != V4L2_CTRL_TYPE_CTRL_CLASS
+		)
+			controls[qctrl.id] = qctrl;
+		qctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+	}
+
+	if (controls.empty()) {
+		fprintf(stderr, "cam #%d: no controls found\n", camidx);
+		return ERR;
+	}
+
+	return 0;
+}
+
+const std::map<__u32, struct v4l2_query_ext_ctrl> &CamV4L2::control_map() const {
+	return controls;
+}
+
+int CamV4L2::find_control(const char *name, __u32 *id) const {
+	std::map<__u32, struct v4l2_query_ext_ctrl>::const_iterator it;
+
+	for (it = controls.begin(); it != controls.end(); ++it) {
+		if (0 == strcasecmp(it->second.name, name)) {
+			*id = it->first;
+			return 0;
+		}
+	}
+	return ERR;
+}
+
+/*
+ * Checks a batch against the control map, without touching the device.
+ */
+int CamV4L2::validate_controls(const std::vector<ControlValue> &values) const {
+	size_t i;
+
+	for (i = 0; i < values.size(); i++) {
+		std::map<__u32, struct v4l2_query_ext_ctrl>::const_iterator it =
+			controls.find(values[i].id);
+		const struct v4l2_query_ext_ctrl *q;
+
+		if (it == controls.end()) {
+			fprintf(stderr, "cam #%d: unknown control 0x%08x\n", camidx, values[i].id);
+			return ERR;
+		}
+		q = &it->second;
+
+		if (q->flags & (V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_HAS_PAYLOAD)) {
+			fprintf(stderr, "cam #%d: control '%s' cannot be set by value\n",
+					camidx, q->name);
+			return ERR;
+		}
+
+		if (
+			q->type != V4L2_CTRL_TYPE_BUTTON &&
+			(values[i].value < q->minimum || values[i].value > q->maximum)
+		)
+		{
+			fprintf(stderr, "cam #%d: %lld is out of range for '%s' [%lld, %lld]\n",
+					camidx, (long long) values[i].value, q->name,
+					(long long) q->minimum, (long long) q->maximum);
+			return ERR;
+		}
+	}
+
+	return 0;
+}
+
+int CamV4L2::get_controls(std::vector<ControlValue> &values) {
+	std::vector<struct v4l2_ext_control> ctrls(values.size());
+	struct v4l2_ext_controls ext;
+	size_t i;
+
+	if (values.empty())
+		return 0;
+
+	for (i = 0; i < values.size(); i++) {
+		CLEAR(ctrls[i]);
+		ctrls[i].id = values[i].id;
+	}
+
+	/* ctrl_class (which) 0: controls of any class, current values. */
+	CLEAR(ext);
+	ext.count = ctrls.size();
+	ext.controls = ctrls.data();
+
+	if (-1 == xioctl(fd, VIDIOC_G_EXT_CTRLS, &ext)) {
+		fprintf(stderr, "cam #%d: error occurred when getting controls\n", camidx);
+		return ERR;
+	}
+
+	for (i = 0; i < values.size(); i++) {
+		std::map<__u32, struct v4l2_query_ext_ctrl>::const_iterator it =
+			controls.find(values[i].id);
+
+		if (it != controls.end() && it->second.type == V4L2_CTRL_TYPE_INTEGER64)
+			values[i].value = ctrls[i].value64;
+		else
+			values[i].value = ctrls[i].value;
+	}
+
+	return 0;
+}
+
+int CamV4L2::set_controls(const std::vector<ControlValue> &values) {
+	std::vector<struct v4l2_ext_control> ctrls(values.size());
+	struct v4l2_ext_controls ext;
+	size_t i;
+
+	if (values.empty())
+		return 0;
+
+	if (validate_controls(values) < 0)
+		return ERR;
+
+	for (i = 0; i < values.size(); i++) {
+		CLEAR(ctrls[i]);
+		ctrls[i].id = values[i].id;
+		if (controls[values[i].id].type == V4L2_CTRL_TYPE_INTEGER64)
+			ctrls[i].value64 = values[i].value;
+		else
+			ctrls[i].value = (__s32) values[i].value;
+	}
+
+	CLEAR(ext);
+	ext.count = ctrls.size();
+	ext.controls = ctrls.data();
+
+	/* Try the whole batch first, so a bad value leaves everything as it was. */
+	if (
+		-1 == xioctl(fd, VIDIOC_TRY_EXT_CTRLS, &ext) ||
+		-1 == xioctl(fd, VIDIOC_S_EXT_CTRLS, &ext)
+	)
+	{
+		if (ext.error_idx < ext.count)
+			fprintf(stderr, "cam #%d: error occurred when setting control '%s'\n",
+					camidx, controls[ctrls[ext.error_idx].id].name);
+		else
+			fprintf(stderr, "cam #%d: error occurred when setting controls\n", camidx);
+		return ERR;
+	}
+
+	return 0;
+}
+
+int CamV4L2::queue_controls(const std::vector<ControlValue> &values) {
+	if (validate_controls(values) < 0)
+		return ERR;
+
+	ctrl_queue->push(values);
+	return 0;
+}
+
+/*
+ * Applies everything queued with queue_controls() as one batch. A control
+ * queued more than once keeps its latest value.
+ */
+void CamV4L2::apply_pending_controls(void) {
+	std::vector<ControlValue> queued, batch;
+	size_t i, j;
+
+	if (!ctrl_queue->take_all(queued))
+		return;
+
+	for (i = 0; i < queued.size(); i++) {
+		for (j = 0; j < batch.size() && batch[j].id != queued[i].id; j++)
+			;
+		if (j < batch.size())
+			batch[j].value = queued[i].value;
+		else
+			batch.push_back(queued[i]);
+	}
+
+	if (set_controls(batch) < 0)
+		fprintf(stderr, "cam #%d: queued control update dropped\n", camidx);
+}
+
+void CamV4L2::set_dmabuf_fds(const std::vector<int> &fds) {
+	import_fds = fds;
+}
+
+void CamV4L2::set_buffer_pool(unsigned int flags) {
+	pool_flags = flags;
+}
+
+void CamV4L2::set_thread_placement(const ThreadPlacement &pl) {
+	placement = pl;
+}
+
+void CamV4L2::set_mode_cache(ModeCache *cache) {
+	mode_cache = cache;
+}
+
+void CamV4L2::set_copy_out(bool enable) {
+	copy_out = enable;
+}
+
+void CamV4L2::set_latest_frame(bool enable) {
+	latest_frame = enable;
+}
+
+unsigned int CamV4L2::frames_skipped() const {
+	return last_skipped;
+}
+
+int CamV4L2::set_preview_scale(unsigned int scale) {
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+		fprintf(stderr, "Preview scale must be 1, 2, 4 or 8, not %u\n", scale);
+		return ERR;
+	}
+	preview_scale = scale;
+	return 0;
+}
+
+void CamV4L2::set_stripe_pool(StripePool *pool) {
+	stripe_pool = pool;
+}
+
+void CamV4L2::set_demosaic(enum bayer_demosaic demosaic_) {
+	demosaic = demosaic_;
+}
+
+int CamV4L2::get_frame_fd(unsigned int plane) {
+	struct buffer *b;
+
+	if (!is_initialised || is_released)
+	{
+		fprintf (stderr, "Error: trying to get a dma-buf without holding a frame\n");
+		return ERR;
+	}
+
+	if (plane >= n_planes)
+	{
+		fprintf (stderr, "Error: frame has no plane %u\n", plane);
+		return ERR;
+	}
+
+	if (copy_out)
+	{
+		fprintf (stderr, "Error: frames are copies, not dma-bufs, in copy-out mode\n");
+		return ERR;
+	}
+
+	b = &buffers[frame_buf.index * n_planes + plane];
+
+	if (IO_METHOD_MMAP == io && b->dmabuf_fd < 0)
+	{
+		struct v4l2_exportbuffer expbuf;
+
+		/*
+		 * Export lazily, so MMAP users that never share frames don't
+		 * hold a dma-buf per buffer.
+		 */
+		CLEAR(expbuf);
+		expbuf.type = buf_type;
+		expbuf.index = frame_buf.index;
+		expbuf.plane = plane;
+		expbuf.flags = O_CLOEXEC | O_RDONLY;
+
+		if (-1 == xioctl(fd, VIDIOC_EXPBUF, &expbuf))
+		{
+			fprintf(stderr, "Error occurred when exporting buffer\n");
+			return ERR;
+		}
+		b->dmabuf_fd = expbuf.fd;
+	}
+
+	if (b->dmabuf_fd < 0)
+	{
+		fprintf(stderr, "Error: I/O method does not support dma-buf sharing\n");
+		return ERR;
+	}
+
+	return b->dmabuf_fd;
+}
+
+unsigned int CamV4L2::num_planes() const {
+	return n_planes;
+}
+
+int CamV4L2::get_frame_planes(std::vector<cv::Mat> &planes) {
+	if (!is_initialised || is_released)
+	{
+		fprintf (stderr, "Error: trying to get planes without holding a frame\n");
+		return ERR;
+	}
+
+	return build_plane_views(copy_out ? copy_bufs : &buffers[frame_buf.index * n_planes],
+			frame_planes, planes);
+}
+
+/*
+ * Wraps the colour planes of a frame in cv::Mat headers: 'bufs' holds its
+ * n_planes memory planes and 'info' the plane offsets reported by
+ * VIDIOC_DQBUF for multi-planar buffers.
+ */
+int CamV4L2::build_plane_views(const struct buffer *bufs, const struct v4l2_plane *info,
+		std::vector<cv::Mat> &planes) {
+	const struct plane_layout *layout = NULL;
+	unsigned int width, height, c;
+	size_t offset;
+
+	planes.clear();
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
+		width = cur_fmt.fmt.pix_mp.width;
+		height = cur_fmt.fmt.pix_mp.height;
+		layout = find_plane_layout(cur_fmt.fmt.pix_mp.pixelformat);
+	} else {
+		width = cur_fmt.fmt.pix.width;
+		height = cur_fmt.fmt.pix.height;
+	}
+
+	if (pix_ops) {
+		offset = V4L2_TYPE_IS_MULTIPLANAR(buf_type) ? info[0].data_offset : 0;
+		if (offset > bufs[0].length ||
+			pix_ops->views((unsigned char *) bufs[0].start + offset, bufs[0].length - offset,
+				width, height, plane_bytesperline(0), planes) < 0) {
+			fprintf(stderr, "cam #%d: frame exceeds the buffer\n", camidx);
+			return ERR;
+		}
+		return 0;
+	}
+
+	if (!layout || layout->n_planes != n_planes) {
+		/* Unknown layout: a byte-wide view of each memory plane. */
+		for (c = 0; c < n_planes; c++) {
+			const struct buffer *b = &bufs[c];
+			size_t bpl = plane_bytesperline(c);
+
+			offset = V4L2_TYPE_IS_MULTIPLANAR(buf_type) ?
+				info[c].data_offset : 0;
+			if (bpl == 0)
+				bpl = plane_size(c);
+			planes.push_back(cv::Mat((plane_size(c) - offset) / bpl, bpl, CV_8UC1,
+						(unsigned char *) b->start + offset, bpl));
+		}
+		return 0;
+	}
+
+	/* Each colour plane has a memory plane of its own. */
+	for (c = 0; c < layout->n_planes; c++) {
+		const struct plane_desc *d = &layout->planes[c];
+		unsigned int rows = height / d->v_div;
+		unsigned int cols = width / d->h_div;
+		size_t bytesperline = plane_bytesperline(c);
+
+		offset = info[c].data_offset;
+		if (offset + bytesperline * rows > bufs[c].length) {
+			fprintf(stderr, "cam #%d: plane %u exceeds the buffer\n", camidx, c);
+			planes.clear();
+			return ERR;
+		}
+
+		planes.push_back(cv::Mat(rows, cols, CV_8UC(d->cn),
+					(unsigned char *) bufs[c].start + offset, bytesperline));
+	}
+
+	return 0;
+}
+
+int CamV4L2::helper_deinit_cam() {
+    if (!is_initialised)
+	{
+		fprintf(stderr, "Error: trying to de-initialise without initialising camera\n");
+		return ERR;
+	}
+
+	{
+		/* Frame handles point into the buffers about to be unmapped. */
+		std::unique_lock<std::mutex> guard(*cfg_lock);
+
+		if (!cfg_cond->wait_for(guard, std::chrono::seconds(2),
+					[this] { return handles_out == 0; }))
+		{
+			fprintf(stderr, "cam #%d: %u frame handle(s) still in use\n",
+					camidx, handles_out);
+			return ERR;
+		}
+	}
+
+	/*
+	 * It's better to turn off is_initialised even if the
+	 * de-initialisation fails as it shouldn't have affect
+	 * re-initialisation a lot.
 	 */
 	is_initialised = 0;
 
+	for (unsigned int p = 0; p < VIDEO_MAX_PLANES; p++) {
+		pool_free(copy_bufs[p].start, copy_bufs[p].pool_length);
+		memset(&copy_bufs[p], 0, sizeof(copy_bufs[p]));
+	}
+
 	if(
 		stop_capturing() < 0 ||
 		uninit_device() < 0 ||
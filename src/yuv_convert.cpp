@@ -0,0 +1,778 @@
+/*
+ * opencv_v4l2 - yuv_convert.cpp file
+ *
+ * Copyright (c) 2017-2018, e-con Systems India Pvt. Ltd.  All rights reserved.
+ *
+ */
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#define YUV_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define YUV_NEON
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <yuv_convert.hpp>
+#include <stripe_pool.hpp>
+
+#define YUV_SHIFT		20
+#define YUV_HALF		(1 << (YUV_SHIFT - 1))
+
+/* Frames smaller than this are converted by the calling thread alone. */
+#define CONVERT_PARALLEL_MIN	(1UL << 20)
+/* Source bytes per stripe handed to a worker thread. */
+#define CONVERT_STRIPE		(256UL << 10)
+
+/*
+ * R = cy (Y - y_off) + cvr V
+ * G = cy (Y - y_off) + cug U + cvg V
+ * B = cy (Y - y_off) + cub U
+ * with U, V centred on 0, in units of 2^-YUV_SHIFT.
+ */
+struct yuv_coeffs {
+	int y_off, cy, cvr, cug, cvg, cub;
+};
+
+/*
+ * [matrix][range]. BT.601 limited range uses OpenCV's own constants
+ * (ITUR_BT_601_*) so that results match cvtColor exactly; the others are
+ * the standard coefficients, scaled by 255/219 (luma) and 255/224 (chroma)
+ * for limited range.
+ */
+static const struct yuv_coeffs coeffs[2][2] = {
+	{
+		{ 16, 1220542, 1673527, -409993, -852492, 2116026 },
+		{  0, 1048576, 1470104, -360853, -748826, 1858077 },
+	},
+	{
+		{ 16, 1220945, 1879825, -223607, -558796, 2215014 },
+		{  0, 1048576, 1651297, -196423, -490864, 1945738 },
+	},
+};
+
+static inline unsigned char clamp_u8(int v) {
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* Reference kernel; also converts what the vector kernels leave over. */
+static void row_scalar(const unsigned char *src, unsigned char *dst,
+	unsigned int width, const struct yuv_coeffs c) {
+	for (unsigned int x = 0; x + 1 < width; x += 2, src += 4, dst += 6) {
+		int u = src[0] - 128, v = src[2] - 128;
+		int ruv = YUV_HALF + c.cvr * v;
+		int guv = YUV_HALF + c.cvg * v + c.cug * u;
+		int buv = YUV_HALF + c.cub * u;
+		int y0 = std::max(0, src[1] - c.y_off) * c.cy;
+		int y1 = std::max(0, src[3] - c.y_off) * c.cy;
+
+		dst[0] = clamp_u8((y0 + buv) >> YUV_SHIFT);
+		dst[1] = clamp_u8((y0 + guv) >> YUV_SHIFT);
+		dst[2] = clamp_u8((y0 + ruv) >> YUV_SHIFT);
+		dst[3] = clamp_u8((y1 + buv) >> YUV_SHIFT);
+		dst[4] = clamp_u8((y1 + guv) >> YUV_SHIFT);
+		dst[5] = clamp_u8((y1 + ruv) >> YUV_SHIFT);
+	}
+}
+
+#ifdef YUV_X86
+/*
+ * The vector kernels do the scalar arithmetic in 32-bit lanes (hence SSE4.1
+ * for pmulld), so every kernel gives bit-identical results. Each is compiled
+ * for its instruction set through a target attribute and only called once
+ * the CPU is known to support it.
+ */
+#define TARGET_SSE41	__attribute__((target("sse4.1")))
+#define TARGET_AVX2	__attribute__((target("avx2")))
+#define TARGET_AVX512	__attribute__((target("avx512f,avx512bw")))
+
+/* Zero-extend U, V, even Y and odd Y of 4 UYVY pairs to 32-bit lanes. */
+static const int8_t mask_u[16]  = { 0, -1, -1, -1,  4, -1, -1, -1,  8, -1, -1, -1, 12, -1, -1, -1 };
+static const int8_t mask_v[16]  = { 2, -1, -1, -1,  6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1 };
+static const int8_t mask_ye[16] = { 1, -1, -1, -1,  5, -1, -1, -1,  9, -1, -1, -1, 13, -1, -1, -1 };
+static const int8_t mask_yo[16] = { 3, -1, -1, -1,  7, -1, -1, -1, 11, -1, -1, -1, 15, -1, -1, -1 };
+
+/* [output block][channel]: picks B, G and R of 16 pixels into 48 bytes of BGR. */
+static const int8_t mask_bgr[3][3][16] = {
+	{
+		{  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1,  5 },
+		{ -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1 },
+		{ -1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1 },
+	},
+	{
+		{ -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10, -1 },
+		{  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10 },
+		{ -1,  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1 },
+	},
+	{
+		{ -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1 },
+		{ -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1 },
+		{ 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15 },
+	},
+};
+
+TARGET_SSE41 static inline __m128i load_mask(const int8_t *mask) {
+	return _mm_loadu_si128((const __m128i *) mask);
+}
+
+TARGET_SSE41 static inline void store_bgr16(unsigned char *dst, __m128i b, __m128i g, __m128i r) {
+	for (int o = 0; o < 3; o++) {
+		__m128i out = _mm_or_si128(
+			_mm_or_si128(_mm_shuffle_epi8(b, load_mask(mask_bgr[o][0])),
+				_mm_shuffle_epi8(g, load_mask(mask_bgr[o][1]))),
+			_mm_shuffle_epi8(r, load_mask(mask_bgr[o][2])));
+
+		_mm_storeu_si128((__m128i *) (dst + 16 * o), out);
+	}
+}
+
+/*
+ * For each ISA: the coefficients broadcast once per row, and a step that
+ * turns UYVY into B, G and R of 16 (AVX-512: 32) pixels as bytes.
+ */
+struct sse41_consts {
+	__m128i mu, mv, mye, myo, c128, zero, half, y_off, cy, cvr, cug, cvg, cub;
+};
+
+TARGET_SSE41 static inline void sse41_init(struct sse41_consts *k, const struct yuv_coeffs &c) {
+	k->mu = load_mask(mask_u);
+	k->mv = load_mask(mask_v);
+	k->mye = load_mask(mask_ye);
+	k->myo = load_mask(mask_yo);
+	k->c128 = _mm_set1_epi32(128);
+	k->zero = _mm_setzero_si128();
+	k->half = _mm_set1_epi32(YUV_HALF);
+	k->y_off = _mm_set1_epi32(c.y_off);
+	k->cy = _mm_set1_epi32(c.cy);
+	k->cvr = _mm_set1_epi32(c.cvr);
+	k->cug = _mm_set1_epi32(c.cug);
+	k->cvg = _mm_set1_epi32(c.cvg);
+	k->cub = _mm_set1_epi32(c.cub);
+}
+
+/* 8 pixels to B, G, R in 16-bit lanes, in pixel order. */
+TARGET_SSE41 static inline void sse41_uyvy8(const unsigned char *src, const struct sse41_consts &k,
+	__m128i *b, __m128i *g, __m128i *r) {
+	__m128i px = _mm_loadu_si128((const __m128i *) src);
+	__m128i u = _mm_sub_epi32(_mm_shuffle_epi8(px, k.mu), k.c128);
+	__m128i v = _mm_sub_epi32(_mm_shuffle_epi8(px, k.mv), k.c128);
+	__m128i ye = _mm_mullo_epi32(_mm_max_epi32(_mm_sub_epi32(_mm_shuffle_epi8(px, k.mye), k.y_off), k.zero), k.cy);
+	__m128i yo = _mm_mullo_epi32(_mm_max_epi32(_mm_sub_epi32(_mm_shuffle_epi8(px, k.myo), k.y_off), k.zero), k.cy);
+	__m128i ruv = _mm_add_epi32(k.half, _mm_mullo_epi32(v, k.cvr));
+	__m128i guv = _mm_add_epi32(k.half, _mm_add_epi32(_mm_mullo_epi32(v, k.cvg), _mm_mullo_epi32(u, k.cug)));
+	__m128i buv = _mm_add_epi32(k.half, _mm_mullo_epi32(u, k.cub));
+	__m128i e, o;
+
+	/* Even and odd pixels back into order, narrowed to 16 bits. */
+	e = _mm_srai_epi32(_mm_add_epi32(ye, buv), YUV_SHIFT);
+	o = _mm_srai_epi32(_mm_add_epi32(yo, buv), YUV_SHIFT);
+	*b = _mm_packs_epi32(_mm_unpacklo_epi32(e, o), _mm_unpackhi_epi32(e, o));
+	e = _mm_srai_epi32(_mm_add_epi32(ye, guv), YUV_SHIFT);
+	o = _mm_srai_epi32(_mm_add_epi32(yo, guv), YUV_SHIFT);
+	*g = _mm_packs_epi32(_mm_unpacklo_epi32(e, o), _mm_unpackhi_epi32(e, o));
+	e = _mm_srai_epi32(_mm_add_epi32(ye, ruv), YUV_SHIFT);
+	o = _mm_srai_epi32(_mm_add_epi32(yo, ruv), YUV_SHIFT);
+	*r = _mm_packs_epi32(_mm_unpacklo_epi32(e, o), _mm_unpackhi_epi32(e, o));
+}
+
+TARGET_SSE41 static unsigned int row_sse41(const unsigned char *src, unsigned char *dst,
+	unsigned int width, const struct yuv_coeffs c) {
+	struct sse41_consts k;
+	unsigned int x;
+
+	sse41_init(&k, c);
+	for (x = 0; x + 16 <= width; x += 16, src += 32, dst += 48) {
+		__m128i b0, g0, r0, b1, g1, r1;
+
+		sse41_uyvy8(src, k, &b0, &g0, &r0);
+		sse41_uyvy8(src + 16, k, &b1, &g1, &r1);
+		store_bgr16(dst, _mm_packus_epi16(b0, b1), _mm_packus_epi16(g0, g1),
+				_mm_packus_epi16(r0, r1));
+	}
+	return x;
+}
+
+struct avx2_consts {
+	__m256i mu, mv, mye, myo, c128, zero, half, y_off, cy, cvr, cug, cvg, cub;
+};
+
+TARGET_AVX2 static inline void avx2_init(struct avx2_consts *k, const struct yuv_coeffs &c) {
+	k->mu = _mm256_broadcastsi128_si256(load_mask(mask_u));
+	k->mv = _mm256_broadcastsi128_si256(load_mask(mask_v));
+	k->mye = _mm256_broadcastsi128_si256(load_mask(mask_ye));
+	k->myo = _mm256_broadcastsi128_si256(load_mask(mask_yo));
+	k->c128 = _mm256_set1_epi32(128);
+	k->zero = _mm256_setzero_si256();
+	k->half = _mm256_set1_epi32(YUV_HALF);
+	k->y_off = _mm256_set1_epi32(c.y_off);
+	k->cy = _mm256_set1_epi32(c.cy);
+	k->cvr = _mm256_set1_epi32(c.cvr);
+	k->cug = _mm256_set1_epi32(c.cug);
+	k->cvg = _mm256_set1_epi32(c.cvg);
+	k->cub = _mm256_set1_epi32(c.cub);
+}
+
+/* Even / odd lanes to 16 pixels as bytes; each 128-bit lane holds 8 pixels. */
+TARGET_AVX2 static inline __m128i avx2_pack(__m256i e, __m256i o) {
+	__m256i w = _mm256_packs_epi32(_mm256_unpacklo_epi32(e, o), _mm256_unpackhi_epi32(e, o));
+
+	return _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+}
+
+TARGET_AVX2 static unsigned int row_avx2(const unsigned char *src, unsigned char *dst,
+	unsigned int width, const struct yuv_coeffs c) {
+	struct avx2_consts k;
+	unsigned int x;
+
+	avx2_init(&k, c);
+	for (x = 0; x + 16 <= width; x += 16, src += 32, dst += 48) {
+		__m256i px = _mm256_loadu_si256((const __m256i *) src);
+		__m256i u = _mm256_sub_epi32(_mm256_shuffle_epi8(px, k.mu), k.c128);
+		__m256i v = _mm256_sub_epi32(_mm256_shuffle_epi8(px, k.mv), k.c128);
+		__m256i ye = _mm256_mullo_epi32(_mm256_max_epi32(_mm256_sub_epi32(_mm256_shuffle_epi8(px, k.mye), k.y_off), k.zero), k.cy);
+		__m256i yo = _mm256_mullo_epi32(_mm256_max_epi32(_mm256_sub_epi32(_mm256_shuffle_epi8(px, k.myo), k.y_off), k.zero), k.cy);
+		__m256i ruv = _mm256_add_epi32(k.half, _mm256_mullo_epi32(v, k.cvr));
+		__m256i guv = _mm256_add_epi32(k.half, _mm256_add_epi32(_mm256_mullo_epi32(v, k.cvg), _mm256_mullo_epi32(u, k.cug)));
+		__m256i buv = _mm256_add_epi32(k.half, _mm256_mullo_epi32(u, k.cub));
+
+		store_bgr16(dst,
+			avx2_pack(_mm256_srai_epi32(_mm256_add_epi32(ye, buv), YUV_SHIFT),
+				_mm256_srai_epi32(_mm256_add_epi32(yo, buv), YUV_SHIFT)),
+			avx2_pack(_mm256_srai_epi32(_mm256_add_epi32(ye, guv), YUV_SHIFT),
+				_mm256_srai_epi32(_mm256_add_epi32(yo, guv), YUV_SHIFT)),
+			avx2_pack(_mm256_srai_epi32(_mm256_add_epi32(ye, ruv), YUV_SHIFT),
+				_mm256_srai_epi32(_mm256_add_epi32(yo, ruv), YUV_SHIFT)));
+	}
+	return x;
+}
+
+/*
+ * GCC 12's AVX-512 intrinsics start from _mm512_undefined_epi32(), which
+ * -Wmaybe-uninitialized wrongly reports once inlined (GCC bug 105593).
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+struct avx512_consts {
+	__m512i mu, mv, mye, myo, c128, zero, half, y_off, cy, cvr, cug, cvg, cub;
+};
+
+TARGET_AVX512 static inline void avx512_init(struct avx512_consts *k, const struct yuv_coeffs &c) {
+	k->mu = _mm512_broadcast_i32x4(load_mask(mask_u));
+	k->mv = _mm512_broadcast_i32x4(load_mask(mask_v));
+	k->mye = _mm512_broadcast_i32x4(load_mask(mask_ye));
+	k->myo = _mm512_broadcast_i32x4(load_mask(mask_yo));
+	k->c128 = _mm512_set1_epi32(128);
+	k->zero = _mm512_setzero_si512();
+	k->half = _mm512_set1_epi32(YUV_HALF);
+	k->y_off = _mm512_set1_epi32(c.y_off);
+	k->cy = _mm512_set1_epi32(c.cy);
+	k->cvr = _mm512_set1_epi32(c.cvr);
+	k->cug = _mm512_set1_epi32(c.cug);
+	k->cvg = _mm512_set1_epi32(c.cvg);
+	k->cub = _mm512_set1_epi32(c.cub);
+}
+
+/* Even / odd lanes to 32 pixels as bytes, in two halves of 16. */
+TARGET_AVX512 static inline void avx512_pack(__m512i e, __m512i o, __m128i *lo, __m128i *hi) {
+	__m512i w = _mm512_packs_epi32(_mm512_unpacklo_epi32(e, o), _mm512_unpackhi_epi32(e, o));
+
+	*lo = _mm_packus_epi16(_mm512_extracti32x4_epi32(w, 0), _mm512_extracti32x4_epi32(w, 1));
+	*hi = _mm_packus_epi16(_mm512_extracti32x4_epi32(w, 2), _mm512_extracti32x4_epi32(w, 3));
+}
+
+TARGET_AVX512 static unsigned int row_avx512(const unsigned char *src, unsigned char *dst,
+	unsigned int width, const struct yuv_coeffs c) {
+	struct avx512_consts k;
+	unsigned int x;
+
+	avx512_init(&k, c);
+	for (x = 0; x + 32 <= width; x += 32, src += 64, dst += 96) {
+		__m512i px = _mm512_loadu_si512((const void *) src);
+		__m512i u = _mm512_sub_epi32(_mm512_shuffle_epi8(px, k.mu), k.c128);
+		__m512i v = _mm512_sub_epi32(_mm512_shuffle_epi8(px, k.mv), k.c128);
+		__m512i ye = _mm512_mullo_epi32(_mm512_max_epi32(_mm512_sub_epi32(_mm512_shuffle_epi8(px, k.mye), k.y_off), k.zero), k.cy);
+		__m512i yo = _mm512_mullo_epi32(_mm512_max_epi32(_mm512_sub_epi32(_mm512_shuffle_epi8(px, k.myo), k.y_off), k.zero), k.cy);
+		__m512i ruv = _mm512_add_epi32(k.half, _mm512_mullo_epi32(v, k.cvr));
+		__m512i guv = _mm512_add_epi32(k.half, _mm512_add_epi32(_mm512_mullo_epi32(v, k.cvg), _mm512_mullo_epi32(u, k.cug)));
+		__m512i buv = _mm512_add_epi32(k.half, _mm512_mullo_epi32(u, k.cub));
+		__m128i b0, b1, g0, g1, r0, r1;
+
+		avx512_pack(_mm512_srai_epi32(_mm512_add_epi32(ye, buv), YUV_SHIFT),
+			_mm512_srai_epi32(_mm512_add_epi32(yo, buv), YUV_SHIFT), &b0, &b1);
+		avx512_pack(_mm512_srai_epi32(_mm512_add_epi32(ye, guv), YUV_SHIFT),
+			_mm512_srai_epi32(_mm512_add_epi32(yo, guv), YUV_SHIFT), &g0, &g1);
+		avx512_pack(_mm512_srai_epi32(_mm512_add_epi32(ye, ruv), YUV_SHIFT),
+			_mm512_srai_epi32(_mm512_add_epi32(yo, ruv), YUV_SHIFT), &r0, &r1);
+		store_bgr16(dst, b0, g0, r0);
+		store_bgr16(dst + 48, b1, g1, r1);
+	}
+	return x;
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef YUV_NEON
+static inline int32x4_t neon_luma(uint16x4_t y, int32x4_t y_off, int cy) {
+	return vmulq_n_s32(vmaxq_s32(vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(y)), y_off),
+			vdupq_n_s32(0)), cy);
+}
+
+/* Even / odd 16-bit channel values of 8 pairs to 16 pixels as bytes. */
+static inline uint8x16_t neon_interleave(int16x8_t e, int16x8_t o) {
+	uint8x8x2_t z = vzip_u8(vqmovun_s16(e), vqmovun_s16(o));
+
+	return vcombine_u8(z.val[0], z.val[1]);
+}
+
+static inline int16x8_t neon_narrow(int32x4_t y_lo, int32x4_t y_hi, int32x4_t uv_lo, int32x4_t uv_hi) {
+	return vcombine_s16(vqmovn_s32(vshrq_n_s32(vaddq_s32(y_lo, uv_lo), YUV_SHIFT)),
+			vqmovn_s32(vshrq_n_s32(vaddq_s32(y_hi, uv_hi), YUV_SHIFT)));
+}
+
+static unsigned int row_neon(const unsigned char *src, unsigned char *dst,
+	unsigned int width, const struct yuv_coeffs c) {
+	const int32x4_t y_off = vdupq_n_s32(c.y_off);
+	const int32x4_t half = vdupq_n_s32(YUV_HALF);
+	const int32x4_t c128 = vdupq_n_s32(128);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16, src += 32, dst += 48) {
+		/* U, even Y, V, odd Y of 8 pairs. */
+		uint8x8x4_t px = vld4_u8(src);
+		uint16x8_t u16 = vmovl_u8(px.val[0]), v16 = vmovl_u8(px.val[2]);
+		uint16x8_t ye16 = vmovl_u8(px.val[1]), yo16 = vmovl_u8(px.val[3]);
+		int32x4_t u_lo = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(u16))), c128);
+		int32x4_t u_hi = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(u16))), c128);
+		int32x4_t v_lo = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(v16))), c128);
+		int32x4_t v_hi = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(v16))), c128);
+		int32x4_t ye_lo = neon_luma(vget_low_u16(ye16), y_off, c.cy);
+		int32x4_t ye_hi = neon_luma(vget_high_u16(ye16), y_off, c.cy);
+		int32x4_t yo_lo = neon_luma(vget_low_u16(yo16), y_off, c.cy);
+		int32x4_t yo_hi = neon_luma(vget_high_u16(yo16), y_off, c.cy);
+		int32x4_t ruv_lo = vmlaq_n_s32(half, v_lo, c.cvr);
+		int32x4_t ruv_hi = vmlaq_n_s32(half, v_hi, c.cvr);
+		int32x4_t guv_lo = vmlaq_n_s32(vmlaq_n_s32(half, v_lo, c.cvg), u_lo, c.cug);
+		int32x4_t guv_hi = vmlaq_n_s32(vmlaq_n_s32(half, v_hi, c.cvg), u_hi, c.cug);
+		int32x4_t buv_lo = vmlaq_n_s32(half, u_lo, c.cub);
+		int32x4_t buv_hi = vmlaq_n_s32(half, u_hi, c.cub);
+		uint8x16x3_t out;
+
+		out.val[0] = neon_interleave(neon_narrow(ye_lo, ye_hi, buv_lo, buv_hi),
+				neon_narrow(yo_lo, yo_hi, buv_lo, buv_hi));
+		out.val[1] = neon_interleave(neon_narrow(ye_lo, ye_hi, guv_lo, guv_hi),
+				neon_narrow(yo_lo, yo_hi, guv_lo, guv_hi));
+		out.val[2] = neon_interleave(neon_narrow(ye_lo, ye_hi, ruv_lo, ruv_hi),
+				neon_narrow(yo_lo, yo_hi, ruv_lo, ruv_hi));
+		vst3q_u8(dst, out);
+	}
+	return x;
+}
+#endif
+
+static enum yuv_isa detect_isa() {
+	for (int isa = YUV_ISA_COUNT - 1; isa > YUV_ISA_SCALAR; isa--) {
+		if (yuv_isa_supported((enum yuv_isa) isa))
+			return (enum yuv_isa) isa;
+	}
+	return YUV_ISA_SCALAR;
+}
+
+enum yuv_isa yuv_best_isa() {
+	static const enum yuv_isa best = detect_isa();
+
+	return best;
+}
+
+bool yuv_isa_supported(enum yuv_isa isa) {
+	switch (isa) {
+		case YUV_ISA_SCALAR:
+			return true;
+#ifdef YUV_X86
+		case YUV_ISA_SSE41:
+			return __builtin_cpu_supports("sse4.1");
+		case YUV_ISA_AVX2:
+			return __builtin_cpu_supports("avx2");
+		case YUV_ISA_AVX512:
+			return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+#ifdef YUV_NEON
+		case YUV_ISA_NEON:
+			return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#endif
+		default:
+			return false;
+	}
+}
+
+const char *yuv_isa_name(enum yuv_isa isa) {
+	switch (isa) {
+		case YUV_ISA_AUTO:
+			return yuv_isa_name(yuv_best_isa());
+		case YUV_ISA_SCALAR:
+			return "scalar";
+		case YUV_ISA_SSE41:
+			return "SSE4.1";
+		case YUV_ISA_AVX2:
+			return "AVX2";
+		case YUV_ISA_AVX512:
+			return "AVX-512";
+		case YUV_ISA_NEON:
+			return "NEON";
+		default:
+			return "unknown";
+	}
+}
+
+static void convert_row(const unsigned char *src, unsigned char *dst, unsigned int width,
+	const struct yuv_coeffs &c, enum yuv_isa isa) {
+	unsigned int done = 0;
+
+	switch (isa) {
+#ifdef YUV_X86
+		case YUV_ISA_SSE41:
+			done = row_sse41(src, dst, width, c);
+			break;
+		case YUV_ISA_AVX2:
+			done = row_avx2(src, dst, width, c);
+			break;
+		case YUV_ISA_AVX512:
+			done = row_avx512(src, dst, width, c);
+			break;
+#endif
+#ifdef YUV_NEON
+		case YUV_ISA_NEON:
+			done = row_neon(src, dst, width, c);
+			break;
+#endif
+		default:
+			break;
+	}
+	row_scalar(src + 2 * done, dst + 3 * done, width - done, c);
+}
+
+/* Falls back to the best supported kernel for one the CPU lacks. */
+static enum yuv_isa resolve_isa(enum yuv_isa isa) {
+	if (YUV_ISA_AUTO == isa || !yuv_isa_supported(isa))
+		return yuv_best_isa();
+	return isa;
+}
+
+void uyvy_to_bgr_row(const unsigned char *src, unsigned char *dst, unsigned int width,
+	enum yuv_matrix matrix, enum yuv_range range, enum yuv_isa isa) {
+	convert_row(src, dst, width, coeffs[matrix][range], resolve_isa(isa));
+}
+
+class ConvertStripes : public cv::ParallelLoopBody {
+	private:
+		const cv::Mat &src;
+		cv::Mat &dst;
+		const struct yuv_coeffs &c;
+		enum yuv_isa isa;
+
+	public:
+		ConvertStripes(const cv::Mat &src_, cv::Mat &dst_, const struct yuv_coeffs &c_,
+			enum yuv_isa isa_) : src(src_), dst(dst_), c(c_), isa(isa_) {}
+
+		void operator()(const cv::Range &range) const {
+			for (int y = range.start; y < range.end; y++)
+				convert_row(src.ptr(y), dst.ptr(y), src.cols, c, isa);
+		}
+};
+
+/*
+ * Rows of a frame of 'bytes' source bytes on the stripe pool if given, else
+ * on OpenCV's threads once the frame is large enough to be worth it.
+ */
+static void run_stripes(int rows, const cv::ParallelLoopBody &body, size_t bytes,
+	StripePool *pool) {
+	if (pool)
+		pool->run(cv::Range(0, rows), body, bytes);
+	else if (bytes < CONVERT_PARALLEL_MIN)
+		body(cv::Range(0, rows));
+	else
+		cv::parallel_for_(cv::Range(0, rows), body, (double) bytes / CONVERT_STRIPE);
+}
+
+static void convert_frame(const cv::Mat &src, cv::Mat &dst, enum yuv_matrix matrix,
+	enum yuv_range range, enum yuv_isa isa, StripePool *pool) {
+	CV_Assert(src.type() == CV_8UC2 && src.cols % 2 == 0);
+	dst.create(src.rows, src.cols, CV_8UC3);
+
+	ConvertStripes body(src, dst, coeffs[matrix][range], resolve_isa(isa));
+	run_stripes(src.rows, body, src.total() * 2, pool);
+}
+
+void uyvy_to_bgr(const cv::Mat &src, cv::Mat &dst, enum yuv_matrix matrix,
+	enum yuv_range range, enum yuv_isa isa) {
+	convert_frame(src, dst, matrix, range, isa, NULL);
+}
+
+void uyvy_to_bgr(const cv::Mat &src, cv::Mat &dst, StripePool &pool, enum yuv_matrix matrix,
+	enum yuv_range range, enum yuv_isa isa) {
+	convert_frame(src, dst, matrix, range, isa, &pool);
+}
+
+/*
+ * Horizontal half of uyvy_to_bgr_scaled(): 'acc' holds the column sums of
+ * 2^shift source rows, 2^shift UYVY pairs per output pair. Each output pair
+ * gets the chroma averaged over all of them and the luma over each half.
+ */
+static void box_pairs_scalar(const uint16_t *acc, unsigned char *avg, unsigned int out_pairs,
+	unsigned int shift) {
+	const unsigned int n = 4U << shift, round = 1U << (2 * shift - 1);
+
+	for (unsigned int x = 0; x < out_pairs; x++, acc += n, avg += 4) {
+		unsigned int u = 0, v = 0, y0 = 0, y1 = 0;
+
+		for (unsigned int k = 0; k < n; k += 4) {
+			u += acc[k];
+			v += acc[k + 2];
+			if (k < n / 2)
+				y0 += acc[k + 1] + acc[k + 3];
+			else
+				y1 += acc[k + 1] + acc[k + 3];
+		}
+		avg[0] = (u + round) >> (2 * shift);
+		avg[1] = (y0 + round) >> (2 * shift);
+		avg[2] = (v + round) >> (2 * shift);
+		avg[3] = (y1 + round) >> (2 * shift);
+	}
+}
+
+#ifdef YUV_X86
+/* U0 + U1, Ya0 + Yb0, V0 + V1, Ya1 + Yb1 of two UYVY pairs in 16-bit lanes. */
+static const int8_t mask_box_a[16] = { 0, 1, 2, 3, 4, 5, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1 };
+static const int8_t mask_box_b[16] = { 8, 9, 6, 7, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1 };
+
+/*
+ * Two UYVY pairs worth of sums per output pair: the pairs of each half
+ * of the block are added up lane by lane, each half folded to one pair.
+ */
+TARGET_SSE41 static inline __m128i box_fold(const uint16_t *acc, unsigned int shift) {
+	const __m128i *p = (const __m128i *) acc;
+	__m128i lo, hi;
+
+	if (1 == shift)
+		return _mm_loadu_si128(p);
+
+	unsigned int half = 1U << (shift - 2);
+	lo = _mm_loadu_si128(p);
+	hi = _mm_loadu_si128(p + half);
+	for (unsigned int i = 1; i < half; i++) {
+		lo = _mm_add_epi16(lo, _mm_loadu_si128(p + i));
+		hi = _mm_add_epi16(hi, _mm_loadu_si128(p + half + i));
+	}
+	return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+}
+
+TARGET_SSE41 static unsigned int box_pairs_sse41(const uint16_t *acc, unsigned char *avg,
+	unsigned int out_pairs, unsigned int shift) {
+	const unsigned int n = 4U << shift;
+	const __m128i ma = load_mask(mask_box_a), mb = load_mask(mask_box_b);
+	const __m128i round = _mm_set1_epi16(1 << (2 * shift - 1));
+	const __m128i count = _mm_cvtsi32_si128(2 * shift);
+	unsigned int x;
+
+	for (x = 0; x + 2 <= out_pairs; x += 2, acc += 2 * n, avg += 8) {
+		__m128i p0 = box_fold(acc, shift), p1 = box_fold(acc + n, shift);
+		__m128i sum = _mm_add_epi16(
+			_mm_unpacklo_epi64(_mm_shuffle_epi8(p0, ma), _mm_shuffle_epi8(p1, ma)),
+			_mm_unpacklo_epi64(_mm_shuffle_epi8(p0, mb), _mm_shuffle_epi8(p1, mb)));
+
+		sum = _mm_srl_epi16(_mm_add_epi16(sum, round), count);
+		_mm_storel_epi64((__m128i *) avg, _mm_packus_epi16(sum, sum));
+	}
+	return x;
+}
+#endif
+
+/*
+ * One output row of uyvy_to_bgr_scaled(). The 2^SHIFT source rows are summed
+ * column by column into 'acc' (at most 8 * 255, so 16 bits suffice), box
+ * filtered into a row of UYVY averages and converted by the vector kernels.
+ */
+template <unsigned int SHIFT>
+static void scaled_row(const cv::Mat &src, int out_y, unsigned int out_w, unsigned char *dst,
+	uint16_t *acc, unsigned char *avg, const struct yuv_coeffs &c, enum yuv_isa isa) {
+	const unsigned int scale = 1U << SHIFT, bytes = out_w << (SHIFT + 1);
+	const unsigned char *p0 = src.ptr(out_y << SHIFT), *p1 = src.ptr((out_y << SHIFT) + 1);
+	unsigned int done = 0;
+
+	/* Two rows per pass over 'acc'; scale is at least 2. */
+	for (unsigned int i = 0; i < bytes; i++)
+		acc[i] = p0[i] + p1[i];
+	for (unsigned int r = 2; r < scale; r += 2) {
+		p0 = src.ptr((out_y << SHIFT) + r);
+		p1 = src.ptr((out_y << SHIFT) + r + 1);
+		for (unsigned int i = 0; i < bytes; i++)
+			acc[i] += p0[i] + p1[i];
+	}
+
+#ifdef YUV_X86
+	if (isa >= YUV_ISA_SSE41 && isa <= YUV_ISA_AVX512)
+		done = box_pairs_sse41(acc, avg, out_w / 2, SHIFT);
+#endif
+	box_pairs_scalar(acc + (done << (SHIFT + 2)), avg + 4 * done, out_w / 2 - done, SHIFT);
+	convert_row(avg, dst, out_w, c, isa);
+}
+
+class ScaledStripes : public cv::ParallelLoopBody {
+	private:
+		const cv::Mat &src;
+		cv::Mat &dst;
+		unsigned int shift;
+		const struct yuv_coeffs &c;
+		enum yuv_isa isa;
+
+	public:
+		ScaledStripes(const cv::Mat &src_, cv::Mat &dst_, unsigned int shift_,
+			const struct yuv_coeffs &c_, enum yuv_isa isa_) :
+			src(src_), dst(dst_), shift(shift_), c(c_), isa(isa_) {}
+
+		void operator()(const cv::Range &range) const {
+			std::vector<uint16_t> acc(dst.cols * 2 << shift);
+			std::vector<unsigned char> avg(dst.cols * 2);
+
+			for (int y = range.start; y < range.end; y++) {
+				unsigned char *out = dst.ptr(y);
+
+				if (1 == shift)
+					scaled_row<1>(src, y, dst.cols, out, acc.data(), avg.data(), c, isa);
+				else if (2 == shift)
+					scaled_row<2>(src, y, dst.cols, out, acc.data(), avg.data(), c, isa);
+				else
+					scaled_row<3>(src, y, dst.cols, out, acc.data(), avg.data(), c, isa);
+			}
+		}
+};
+
+static void convert_scaled(const cv::Mat &src, cv::Mat &dst, unsigned int scale,
+	enum yuv_matrix matrix, enum yuv_range range, enum yuv_isa isa, StripePool *pool) {
+	unsigned int shift;
+
+	if (1 == scale) {
+		convert_frame(src, dst, matrix, range, isa, pool);
+		return;
+	}
+	CV_Assert(src.type() == CV_8UC2 && (2 == scale || 4 == scale || 8 == scale));
+	shift = 2 == scale ? 1 : (4 == scale ? 2 : 3);
+	/* Whole output pairs only; what is left past the last block is dropped. */
+	dst.create(src.rows >> shift, (src.cols >> shift) & ~1, CV_8UC3);
+	if (dst.empty())
+		return;
+
+	ScaledStripes body(src, dst, shift, coeffs[matrix][range], resolve_isa(isa));
+	run_stripes(dst.rows, body, src.total() * 2, pool);
+}
+
+void uyvy_to_bgr_scaled(const cv::Mat &src, cv::Mat &dst, unsigned int scale,
+	enum yuv_matrix matrix, enum yuv_range range, enum yuv_isa isa) {
+	convert_scaled(src, dst, scale, matrix, range, isa, NULL);
+}
+
+void uyvy_to_bgr_scaled(const cv::Mat &src, cv::Mat &dst, unsigned int scale, StripePool &pool,
+	enum yuv_matrix matrix, enum yuv_range range, enum yuv_isa isa) {
+	convert_scaled(src, dst, scale, matrix, range, isa, &pool);
+}
+
+/*
+ * Row repacking to UYVY for the other 4:2:2 layouts: 'a' is the YUYV row or
+ * the NV16 luma row, 'b' the NV16 Cb/Cr row.
+ */
+typedef void (*repack_fn)(const unsigned char *a, const unsigned char *b, unsigned char *dst,
+		unsigned int width);
+
+static void repack_yuyv(const unsigned char *a, const unsigned char *, unsigned char *dst,
+	unsigned int width) {
+	/* A byte swap of each 16-bit word, which compilers vectorize. */
+	for (unsigned int i = 0; i < 2 * width; i += 2) {
+		dst[i] = a[i + 1];
+		dst[i + 1] = a[i];
+	}
+}
+
+static void repack_nv16(const unsigned char *a, const unsigned char *b, unsigned char *dst,
+	unsigned int width) {
+	for (unsigned int i = 0; i < width; i += 2) {
+		dst[2 * i] = b[i];
+		dst[2 * i + 1] = a[i];
+		dst[2 * i + 2] = b[i + 1];
+		dst[2 * i + 3] = a[i + 1];
+	}
+}
+
+/* Repacks each row, then converts it when 'c' is given. */
+class RepackStripes : public cv::ParallelLoopBody {
+	private:
+		const cv::Mat &a;
+		const cv::Mat *b;
+		cv::Mat &dst;
+		repack_fn repack;
+		const struct yuv_coeffs *c;
+		enum yuv_isa isa;
+
+	public:
+		RepackStripes(const cv::Mat &a_, const cv::Mat *b_, cv::Mat &dst_, repack_fn repack_,
+			const struct yuv_coeffs *c_, enum yuv_isa isa_) :
+			a(a_), b(b_), dst(dst_), repack(repack_), c(c_), isa(isa_) {}
+
+		void operator()(const cv::Range &range) const {
+			std::vector<unsigned char> row(c ? a.cols * 2 : 0);
+
+			for (int y = range.start; y < range.end; y++) {
+				const unsigned char *pb = b ? b->ptr(y) : NULL;
+
+				if (c) {
+					repack(a.ptr(y), pb, row.data(), a.cols);
+					convert_row(row.data(), dst.ptr(y), a.cols, *c, isa);
+				} else {
+					repack(a.ptr(y), pb, dst.ptr(y), a.cols);
+				}
+			}
+		}
+};
+
+static void repack_frame(const cv::Mat &a, const cv::Mat *b, cv::Mat &dst, repack_fn repack,
+	bool to_bgr, enum yuv_matrix matrix, enum yuv_range range, enum yuv_isa isa,
+	StripePool *pool) {
+	CV_Assert(a.cols % 2 == 0);
+	CV_Assert(!b || (b->type() == CV_8UC2 && b->rows == a.rows && b->cols * 2 == a.cols));
+	dst.create(a.rows, a.cols, to_bgr ? CV_8UC3 : CV_8UC2);
+
+	RepackStripes body(a, b, dst, repack, to_bgr ? &coeffs[matrix][range] : NULL,
+			resolve_isa(isa));
+	run_stripes(a.rows, body, a.total() * 2, pool);
+}
+
+void yuyv_to_bgr(const cv::Mat &src, cv::Mat &dst, StripePool *pool, enum yuv_matrix matrix,
+	enum yuv_range range, enum yuv_isa isa) {
+	CV_Assert(src.type() == CV_8UC2);
+	repack_frame(src, NULL, dst, repack_yuyv, true, matrix, range, isa, pool);
+}
+
+void nv16_to_bgr(const cv::Mat &y, const cv::Mat &uv, cv::Mat &dst, StripePool *pool,
+	enum yuv_matrix matrix, enum yuv_range range, enum yuv_isa isa) {
+	CV_Assert(y.type() == CV_8UC1);
+	repack_frame(y, &uv, dst, repack_nv16, true, matrix, range, isa, pool);
+}
+
+void yuyv_to_uyvy(const cv::Mat &src, cv::Mat &dst, StripePool *pool) {
+	CV_Assert(src.type() == CV_8UC2);
+	repack_frame(src, NULL, dst, repack_yuyv, false, YUV_BT601, YUV_RANGE_LIMITED,
+			YUV_ISA_AUTO, pool);
+}
+
+void nv16_to_uyvy(const cv::Mat &y, const cv::Mat &uv, cv::Mat &dst, StripePool *pool) {
+	CV_Assert(y.type() == CV_8UC1);
+	repack_frame(y, &uv, dst, repack_nv16, false, YUV_BT601, YUV_RANGE_LIMITED,
+			YUV_ISA_AUTO, pool);
+}